@@ -0,0 +1,95 @@
+/*!
+ * A process-wide census of allocations and deallocations of selected classes.
+ *
+ * @discussion
+ * +trackClass: hooks allocWithZone: and dealloc of a class (and thereby its
+ * subclasses) using hobjc_swizzle. Each allocation and deallocation is then
+ * counted, together with its size, in counters private to the calling thread
+ * -- no locks or atomic operations are involved. Instances of untracked
+ * subclasses are attributed to their nearest tracked ancestor.
+ *
+ * Snapshots sum the counters of all threads and can be subtracted from each
+ * other to see what changed between two points in time:
+ *
+ *    [HAllocationCensus trackClass:[HDStream class]];
+ *    HAllocationCensusSnapshot *before = [HAllocationCensus snapshot];
+ *    // ... work ...
+ *    HAllocationCensusSnapshot *after = [HAllocationCensus snapshot];
+ *    NSLog(@"%@", [after snapshotBySubtracting:before]);
+ *
+ * Notes:
+ * - Live counts are relative to when a class started being tracked. Objects
+ *   allocated earlier and deallocated while tracking count negatively.
+ * - Some Foundation class clusters and toll-free bridged classes (e.g. NSData)
+ *   create their instances through CoreFoundation rather than allocWithZone:
+ *   and are not seen by the census.
+ * - Tracking can not be turned off for a class, but +setEnabled: pauses all
+ *   counting.
+ */
+#import <Foundation/Foundation.h>
+
+// Statistics for one tracked class
+@interface HAllocationCensusRecord : NSObject {
+@public
+  Class trackedClass_;
+  int64_t allocations_;
+  int64_t deallocations_;
+  int64_t allocatedBytes_;
+  int64_t deallocatedBytes_;
+  NSMutableDictionary *sites_; // NSData (return addresses) => NSNumber
+}
+@property(readonly) Class trackedClass;
+@property(readonly) int64_t allocations;
+@property(readonly) int64_t deallocations;
+@property(readonly) int64_t allocatedBytes;
+@property(readonly) int64_t deallocatedBytes;
+@property(readonly) int64_t liveCount;  // allocations - deallocations
+@property(readonly) int64_t liveBytes;  // allocatedBytes - deallocatedBytes
+
+/*!
+ * Number of allocations per allocation site (a short symbolized call stack).
+ * Only recorded while +[HAllocationCensus recordsAllocationSites] is enabled.
+ */
+@property(readonly) NSDictionary *allocationSites;
+@end
+
+
+@interface HAllocationCensusSnapshot : NSObject {
+  NSArray *records_;
+  uint64_t timestamp_;
+}
+// HAllocationCensusRecord objects, ordered by liveBytes (largest first)
+@property(readonly) NSArray *records;
+// mach_absolute_time() when the snapshot was taken
+@property(readonly) uint64_t timestamp;
+// Record for |cls| or nil if |cls| is not tracked
+- (HAllocationCensusRecord*)recordForClass:(Class)cls;
+// The changes from |earlier| to the receiver
+- (HAllocationCensusSnapshot*)snapshotBySubtracting:(HAllocationCensusSnapshot*)earlier;
+@end
+
+
+@interface HAllocationCensus : NSObject
+
+/*!
+ * Start tracking |cls|. Returns NO if too many classes are being tracked.
+ * Tracking an already tracked class has no effect.
+ */
++ (BOOL)trackClass:(Class)cls;
+
+// Pause or resume counting in all threads. Enabled by default.
++ (void)setEnabled:(BOOL)enabled;
++ (BOOL)isEnabled;
+
+/*!
+ * Record a histogram of allocation sites (the innermost few return addresses
+ * of each allocation). Disabled by default since capturing the stack is much
+ * more expensive than updating the counters.
+ */
++ (void)setRecordsAllocationSites:(BOOL)recordsAllocationSites;
++ (BOOL)recordsAllocationSites;
+
+// Current totals of all tracked classes
++ (HAllocationCensusSnapshot*)snapshot;
+
+@end
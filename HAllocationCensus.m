@@ -0,0 +1,484 @@
+#import "HAllocationCensus.h"
+#import "NSThread-condensedStackTrace.h"
+#import "hcommon.h"
+#import <libkern/OSAtomic.h>
+#import <mach/mach_time.h>
+#import <malloc/malloc.h>
+#import <pthread.h>
+
+#define HCENSUS_MAX_CLASSES 128    // tracked classes
+#define HCENSUS_TABLE_SIZE 1024    // hooked and tracked classes (power of 2)
+#define HCENSUS_MAX_FRAMES 64      // nested hooked calls per thread
+#define HCENSUS_SITE_DEPTH 4       // return addresses per allocation site
+#define HCENSUS_SITES 512          // allocation sites per thread (power of 2)
+
+// The original implementations are kept under these selectors by
+// hobjc_swizzle. Declared here only so the compiler knows about them.
+@interface NSObject (HAllocationCensusHooks)
++ (id)_hcensus_allocWithZone:(NSZone*)zone;
+- (void)_hcensus_dealloc;
+@end
+
+@interface HAllocationCensusSnapshot (Private)
+- (id)_initWithRecords:(NSArray*)records timestamp:(uint64_t)timestamp;
+@end
+
+// Per-class information. Written (under gLock) before |cls| is set and never
+// modified afterwards, so it can be read without locking.
+typedef struct {
+  Class cls;
+  int32_t trackedIndex;  // -1 if not tracked
+  IMP origAlloc;         // NULL if allocWithZone: is not hooked in |cls|
+  IMP origDealloc;       // NULL if dealloc is not hooked in |cls|
+} hcensus_class_t;
+
+// A hooked call in progress on the current thread
+typedef struct {
+  id receiver;
+  Class hookedClass;     // the class whose original implementation runs
+  BOOL isDealloc;
+} hcensus_frame_t;
+
+typedef struct {
+  uint64_t count;        // 0 for empty slots
+  uint32_t trackedIndex;
+  uintptr_t frames[HCENSUS_SITE_DEPTH];
+} hcensus_site_t;
+
+// Per-thread counters. Only written by the owning thread.
+typedef struct hcensus_thread {
+  struct hcensus_thread *next;
+  volatile int32_t inUse;
+  uint32_t frameCount;
+  hcensus_frame_t frames[HCENSUS_MAX_FRAMES];
+  uint64_t allocs[HCENSUS_MAX_CLASSES];
+  uint64_t deallocs[HCENSUS_MAX_CLASSES];
+  uint64_t allocBytes[HCENSUS_MAX_CLASSES];
+  uint64_t deallocBytes[HCENSUS_MAX_CLASSES];
+  hcensus_site_t sites[HCENSUS_SITES];
+} hcensus_thread_t;
+
+static hcensus_class_t gTable[HCENSUS_TABLE_SIZE];
+static Class gTrackedClasses[HCENSUS_MAX_CLASSES];
+static volatile int32_t gTrackedCount = 0;
+static OSSpinLock gLock = OS_SPINLOCK_INIT;
+static hcensus_thread_t * volatile gThreads = NULL;
+static pthread_key_t gThreadKey;
+static volatile BOOL gEnabled = YES;
+static volatile BOOL gRecordSites = NO;
+
+
+static inline size_t _hcensus_hash(const void *p) {
+  return ((uintptr_t)p >> 4) * 2654435761u;
+}
+
+static inline hcensus_class_t *_hcensus_lookup(Class cls) {
+  size_t i = _hcensus_hash(cls) & (HCENSUS_TABLE_SIZE-1);
+  Class c;
+  while ((c = gTable[i].cls)) {
+    if (c == cls)
+      return &gTable[i];
+    i = (i + 1) & (HCENSUS_TABLE_SIZE-1);
+  }
+  return NULL;
+}
+
+// Must be called with gLock held
+static hcensus_class_t *_hcensus_insert(Class cls, int32_t trackedIndex,
+                                        IMP origAlloc, IMP origDealloc) {
+  size_t i = _hcensus_hash(cls) & (HCENSUS_TABLE_SIZE-1), n;
+  for (n = 0; n < HCENSUS_TABLE_SIZE; n++) {
+    if (!gTable[i].cls) {
+      gTable[i].trackedIndex = trackedIndex;
+      gTable[i].origAlloc = origAlloc;
+      gTable[i].origDealloc = origDealloc;
+      OSMemoryBarrier();
+      gTable[i].cls = cls;
+      return &gTable[i];
+    }
+    i = (i + 1) & (HCENSUS_TABLE_SIZE-1);
+  }
+  return NULL;
+}
+
+// Nearest tracked class of |cls|, or -1
+static inline int32_t _hcensus_tracked_index(Class cls) {
+  for (; cls; cls = class_getSuperclass(cls)) {
+    hcensus_class_t *c = _hcensus_lookup(cls);
+    if (c && c->trackedIndex != -1)
+      return c->trackedIndex;
+  }
+  return -1;
+}
+
+// Nearest class at or above |cls| in which the operation is hooked
+static inline hcensus_class_t *_hcensus_hooked(Class cls, BOOL isDealloc) {
+  for (; cls; cls = class_getSuperclass(cls)) {
+    hcensus_class_t *c = _hcensus_lookup(cls);
+    if (c && (isDealloc ? c->origDealloc : c->origAlloc))
+      return c;
+  }
+  return NULL;
+}
+
+
+static void _hcensus_thread_exit(void *arg) {
+  // keep the counters (they are part of the totals) but let another thread
+  // take over the slot
+  hcensus_thread_t *t = (hcensus_thread_t*)arg;
+  t->frameCount = 0;
+  OSMemoryBarrier();
+  t->inUse = 0;
+}
+
+static hcensus_thread_t *_hcensus_thread() {
+  hcensus_thread_t *t = (hcensus_thread_t*)pthread_getspecific(gThreadKey);
+  if (t)
+    return t;
+  for (t = gThreads; t; t = t->next) {
+    if (!t->inUse && h_atomic_cas(&t->inUse, 0, 1))
+      break;
+  }
+  if (!t) {
+    if (!(t = (hcensus_thread_t*)calloc(1, sizeof(hcensus_thread_t))))
+      return NULL;
+    t->inUse = 1;
+    do {
+      t->next = gThreads;
+    } while (!h_casptr(&gThreads, t->next, t));
+  }
+  pthread_setspecific(gThreadKey, t);
+  return t;
+}
+
+
+// Never inlined, since the frames to skip include this function's own
+__attribute__((noinline))
+static void _hcensus_record_site(hcensus_thread_t *t, int32_t index) {
+  uintptr_t frames[HCENSUS_SITE_DEPTH];
+  memset(frames, 0, sizeof(frames));
+  // skip this function and the allocWithZone: hook
+  h_stack_capture((void**)frames, HCENSUS_SITE_DEPTH, 2);
+  size_t h = index, i, n;
+  for (i = 0; i < HCENSUS_SITE_DEPTH; i++)
+    h = h * 31 + _hcensus_hash((void*)frames[i]);
+  for (n = 0, i = h & (HCENSUS_SITES-1); n < HCENSUS_SITES;
+       n++, i = (i + 1) & (HCENSUS_SITES-1)) {
+    hcensus_site_t *s = &t->sites[i];
+    if (s->count == 0) {
+      s->trackedIndex = index;
+      memcpy(s->frames, frames, sizeof(frames));
+      OSMemoryBarrier();
+      s->count = 1;
+      return;
+    }
+    if (s->trackedIndex == (uint32_t)index &&
+        memcmp(s->frames, frames, sizeof(frames)) == 0) {
+      s->count++;
+      return;
+    }
+  }
+  // table full -- the allocation is still counted, just not its site
+}
+
+
+static id _hcensus_allocWithZone(id self, SEL _cmd, NSZone *zone) {
+  hcensus_thread_t *t = _hcensus_thread();
+  hcensus_frame_t *f = (t && t->frameCount) ? &t->frames[t->frameCount-1] : NULL;
+  hcensus_class_t *hooked;
+  if (f && f->receiver == self && !f->isDealloc) {
+    // [super allocWithZone:] from a hooked class -- continue with the next
+    // hooked superclass without counting again
+    hooked = _hcensus_hooked(class_getSuperclass(f->hookedClass), NO);
+    f->hookedClass = hooked->cls;
+    return ((id(*)(id,SEL,NSZone*))hooked->origAlloc)(self, _cmd, zone);
+  }
+
+  hooked = _hcensus_hooked((Class)self, NO);
+  if (!t || t->frameCount == HCENSUS_MAX_FRAMES)
+    return ((id(*)(id,SEL,NSZone*))hooked->origAlloc)(self, _cmd, zone);
+  f = &t->frames[t->frameCount++];
+  f->receiver = self;
+  f->hookedClass = hooked->cls;
+  f->isDealloc = NO;
+  id obj = ((id(*)(id,SEL,NSZone*))hooked->origAlloc)(self, _cmd, zone);
+  t->frameCount--;
+
+  int32_t index;
+  if (obj && gEnabled && (index = _hcensus_tracked_index((Class)self)) != -1) {
+    t->allocs[index]++;
+    t->allocBytes[index] += malloc_size(obj);
+    if (gRecordSites)
+      _hcensus_record_site(t, index);
+  }
+  return obj;
+}
+
+
+static void _hcensus_dealloc(id self, SEL _cmd) {
+  hcensus_thread_t *t = _hcensus_thread();
+  hcensus_frame_t *f = (t && t->frameCount) ? &t->frames[t->frameCount-1] : NULL;
+  hcensus_class_t *hooked;
+  if (f && f->receiver == self && f->isDealloc) {
+    // [super dealloc] from a hooked class
+    hooked = _hcensus_hooked(class_getSuperclass(f->hookedClass), YES);
+    f->hookedClass = hooked->cls;
+    ((void(*)(id,SEL))hooked->origDealloc)(self, _cmd);
+    return;
+  }
+
+  Class cls = object_getClass(self);
+  int32_t index;
+  if (t && gEnabled && (index = _hcensus_tracked_index(cls)) != -1) {
+    t->deallocs[index]++;
+    t->deallocBytes[index] += malloc_size(self);
+  }
+
+  hooked = _hcensus_hooked(cls, YES);
+  if (!t || t->frameCount == HCENSUS_MAX_FRAMES) {
+    ((void(*)(id,SEL))hooked->origDealloc)(self, _cmd);
+    return;
+  }
+  f = &t->frames[t->frameCount++];
+  f->receiver = self;
+  f->hookedClass = hooked->cls;
+  f->isDealloc = YES;
+  ((void(*)(id,SEL))hooked->origDealloc)(self, _cmd);
+  t->frameCount--;
+}
+
+
+// Install |imp| as |sel| in |cls| through hobjc_swizzle. Returns NO if |cls|
+// was already hooked.
+static BOOL _hcensus_hook(Class cls, SEL sel, SEL hookSel, IMP imp) {
+  Method m = class_getInstanceMethod(cls, sel);
+  if (!class_addMethod(cls, hookSel, imp, method_getTypeEncoding(m)))
+    return NO;
+  hobjc_swizzle(cls, sel, hookSel);
+  return YES;
+}
+
+// ----------------------------------------------------------------------------
+
+@implementation HAllocationCensus
+
++ (void)initialize {
+  if (self == [HAllocationCensus class])
+    pthread_key_create(&gThreadKey, &_hcensus_thread_exit);
+}
+
+
++ (BOOL)trackClass:(Class)cls {
+  [self class]; // make sure +initialize has run
+  OSSpinLockLock(&gLock);
+  hcensus_class_t *c = _hcensus_lookup(cls);
+  if (c && c->trackedIndex != -1) {
+    OSSpinLockUnlock(&gLock);
+    return YES;
+  }
+  if (c || gTrackedCount == HCENSUS_MAX_CLASSES) {
+    // |cls| is in the table only if tracked
+    OSSpinLockUnlock(&gLock);
+    return NO;
+  }
+  int32_t index = gTrackedCount;
+  Class meta = object_getClass(cls);
+  IMP origAlloc = class_getMethodImplementation(meta, @selector(allocWithZone:));
+  IMP origDealloc = class_getMethodImplementation(cls, @selector(dealloc));
+  // The hooks look up the original implementations in the table as soon as
+  // another thread reaches them, so the entry goes in before the swizzle
+  c = _hcensus_insert(cls, index, origAlloc, origDealloc);
+  if (!c) {
+    OSSpinLockUnlock(&gLock);
+    return NO;
+  }
+  gTrackedClasses[index] = cls;
+  if (!_hcensus_hook(meta, @selector(allocWithZone:),
+                     @selector(_hcensus_allocWithZone:),
+                     (IMP)&_hcensus_allocWithZone)) {
+    c->origAlloc = NULL;
+  }
+  if (!_hcensus_hook(cls, @selector(dealloc), @selector(_hcensus_dealloc),
+                     (IMP)&_hcensus_dealloc)) {
+    c->origDealloc = NULL;
+  }
+  OSMemoryBarrier();
+  gTrackedCount = index + 1;
+  OSSpinLockUnlock(&gLock);
+  return YES;
+}
+
+
++ (void)setEnabled:(BOOL)enabled {
+  gEnabled = enabled;
+}
+
++ (BOOL)isEnabled {
+  return gEnabled;
+}
+
++ (void)setRecordsAllocationSites:(BOOL)recordsAllocationSites {
+  gRecordSites = recordsAllocationSites;
+}
+
++ (BOOL)recordsAllocationSites {
+  return gRecordSites;
+}
+
+
++ (HAllocationCensusSnapshot*)snapshot {
+  int32_t i, count = gTrackedCount;
+  OSMemoryBarrier();
+  NSMutableArray *records = [NSMutableArray arrayWithCapacity:count];
+  for (i = 0; i < count; i++) {
+    HAllocationCensusRecord *r = [[HAllocationCensusRecord alloc] init];
+    r->trackedClass_ = gTrackedClasses[i];
+    r->sites_ = [[NSMutableDictionary alloc] init];
+    [records addObject:r];
+    [r release];
+  }
+  hcensus_thread_t *t;
+  for (t = gThreads; t; t = t->next) {
+    for (i = 0; i < count; i++) {
+      HAllocationCensusRecord *r = [records objectAtIndex:i];
+      r->allocations_ += t->allocs[i];
+      r->deallocations_ += t->deallocs[i];
+      r->allocatedBytes_ += t->allocBytes[i];
+      r->deallocatedBytes_ += t->deallocBytes[i];
+    }
+    size_t s;
+    for (s = 0; s < HCENSUS_SITES; s++) {
+      uint64_t n = t->sites[s].count;
+      OSMemoryBarrier();
+      if (n == 0 || t->sites[s].trackedIndex >= (uint32_t)count)
+        continue;
+      HAllocationCensusRecord *r =
+          [records objectAtIndex:t->sites[s].trackedIndex];
+      NSData *key = [NSData dataWithBytes:t->sites[s].frames
+                                   length:sizeof(t->sites[s].frames)];
+      NSNumber *prev = [r->sites_ objectForKey:key];
+      [r->sites_ setObject:[NSNumber numberWithLongLong:
+                            (int64_t)n + [prev longLongValue]] forKey:key];
+    }
+  }
+  return [[[HAllocationCensusSnapshot alloc]
+           _initWithRecords:records timestamp:mach_absolute_time()] autorelease];
+}
+
+@end
+
+// ----------------------------------------------------------------------------
+
+@implementation HAllocationCensusRecord
+
+@synthesize trackedClass = trackedClass_, allocations = allocations_,
+            deallocations = deallocations_, allocatedBytes = allocatedBytes_,
+            deallocatedBytes = deallocatedBytes_;
+
+- (void)dealloc {
+  [sites_ release];
+  [super dealloc];
+}
+
+- (int64_t)liveCount {
+  return allocations_ - deallocations_;
+}
+
+- (int64_t)liveBytes {
+  return allocatedBytes_ - deallocatedBytes_;
+}
+
+- (NSDictionary*)allocationSites {
+  NSMutableDictionary *sites = [NSMutableDictionary dictionary];
+  for (NSData *key in sites_) {
+    const uintptr_t *frames = (const uintptr_t*)[key bytes];
+    NSUInteger i, count = [key length] / sizeof(uintptr_t);
+    NSMutableArray *names = [NSMutableArray array];
+    for (i = 0; i < count && frames[i]; i++) {
+      const char *image = NULL, *symbol = NULL;
+      h_stack_symbolize((const void*)(frames[i] - 1), &image, &symbol);
+      if (symbol)
+        [names addObject:[NSString stringWithUTF8String:symbol]];
+      else
+        [names addObject:[NSString stringWithFormat:@"%s`%p",
+                          image ? image : "???", (void*)frames[i]]];
+    }
+    NSString *site = [names componentsJoinedByString:@" ← "];
+    NSNumber *prev = [sites objectForKey:site];
+    [sites setObject:[NSNumber numberWithLongLong:
+                      [[sites_ objectForKey:key] longLongValue] +
+                      [prev longLongValue]] forKey:site];
+  }
+  return sites;
+}
+
+- (NSString*)description {
+  return [NSString stringWithFormat:@"%-32s live %8lld (%10lld B)  "
+          "allocated %8lld  deallocated %8lld",
+          class_getName(trackedClass_), self.liveCount, self.liveBytes,
+          allocations_, deallocations_];
+}
+
+@end
+
+// ----------------------------------------------------------------------------
+
+@implementation HAllocationCensusSnapshot
+
+@synthesize records = records_, timestamp = timestamp_;
+
+- (id)_initWithRecords:(NSArray*)records timestamp:(uint64_t)timestamp {
+  if ((self = [super init])) {
+    records_ = [[records sortedArrayUsingComparator:^(id a, id b) {
+      int64_t la = [a liveBytes], lb = [b liveBytes];
+      return la > lb ? NSOrderedAscending :
+             (la < lb ? NSOrderedDescending : NSOrderedSame);
+    }] retain];
+    timestamp_ = timestamp;
+  }
+  return self;
+}
+
+- (void)dealloc {
+  [records_ release];
+  [super dealloc];
+}
+
+- (HAllocationCensusRecord*)recordForClass:(Class)cls {
+  for (HAllocationCensusRecord *r in records_) {
+    if (r->trackedClass_ == cls)
+      return r;
+  }
+  return nil;
+}
+
+- (HAllocationCensusSnapshot*)snapshotBySubtracting:(HAllocationCensusSnapshot*)earlier {
+  NSMutableArray *records = [NSMutableArray arrayWithCapacity:[records_ count]];
+  for (HAllocationCensusRecord *r in records_) {
+    HAllocationCensusRecord *e = [earlier recordForClass:r->trackedClass_];
+    HAllocationCensusRecord *d = [[HAllocationCensusRecord alloc] init];
+    d->trackedClass_ = r->trackedClass_;
+    d->allocations_ = r->allocations_ - (e ? e->allocations_ : 0);
+    d->deallocations_ = r->deallocations_ - (e ? e->deallocations_ : 0);
+    d->allocatedBytes_ = r->allocatedBytes_ - (e ? e->allocatedBytes_ : 0);
+    d->deallocatedBytes_ = r->deallocatedBytes_ - (e ? e->deallocatedBytes_ : 0);
+    d->sites_ = [[NSMutableDictionary alloc] init];
+    for (NSData *key in r->sites_) {
+      int64_t n = [[r->sites_ objectForKey:key] longLongValue];
+      if (e)
+        n -= [[e->sites_ objectForKey:key] longLongValue];
+      if (n)
+        [d->sites_ setObject:[NSNumber numberWithLongLong:n] forKey:key];
+    }
+    [records addObject:d];
+    [d release];
+  }
+  return [[[HAllocationCensusSnapshot alloc]
+           _initWithRecords:records timestamp:timestamp_] autorelease];
+}
+
+- (NSString*)description {
+  return [records_ componentsJoinedByString:@"\n"];
+}
+
+@end
@@ -0,0 +1,99 @@
+/*!
+ * A pool of reusable buffers sorted into power-of-two size classes, and
+ * HDSlice, a refcounted buffer taken from such a pool.
+ *
+ * @discussion
+ * Buffers of each size class are carved out of larger slabs (64 kB, or a
+ * single buffer for classes of 64 kB and above). A buffer goes back to its
+ * slab when the HDSlice holding it is deallocated. Each class keeps at most
+ * one entirely unused slab around; further slabs are freed as soon as their
+ * last buffer is returned, so memory held by the pool follows the number of
+ * buffers in use rather than the number of streams or the largest read ever
+ * made.
+ *
+ * Example of keeping data delivered by a stream without copying it:
+ *
+ *    stream.onSlice = ^(HDSlice *slice) {
+ *      [messages addObject:slice];
+ *    };
+ *
+ * All methods are thread safe.
+ */
+#import <Foundation/Foundation.h>
+#import "hatomic.h"
+
+@class HDSlice;
+
+@interface HDBufferPool : NSObject {
+  struct hd_pool_class *classes_;
+  unsigned classCount_;
+  unsigned minimumShift_;
+  volatile int64_t bytesAllocated_;
+  volatile int64_t bytesInUse_;
+}
+
+// Shared pool with size classes from 256 bytes to 256 kB
++ (HDBufferPool*)sharedPool;
+
+/*!
+ * Initialize a pool with size classes from |minimumSize| to |maximumSize|
+ * bytes (both rounded up to a power of two; |minimumSize| to at least 16).
+ */
+- (id)initWithMinimumSize:(size_t)minimumSize maximumSize:(size_t)maximumSize;
+
+// Size of the largest size class. Larger slices are allocated individually.
+@property(readonly) size_t maximumSize;
+
+// Bytes currently held in slabs, whether in use or not
+@property(readonly) size_t bytesAllocated;
+
+// Bytes currently handed out as slices (capacity, not length)
+@property(readonly) size_t bytesInUse;
+
+/*!
+ * A new, retained slice with room for at least |capacity| bytes and a length
+ * of zero. Does not touch the autorelease pool so it can be used from threads
+ * without one.
+ */
+- (HDSlice*)newSliceWithCapacity:(size_t)capacity;
+
+// An autoreleased slice holding a copy of |length| bytes at |bytes|
+- (HDSlice*)sliceWithBytes:(const void*)bytes length:(size_t)length;
+
+// Free all slabs which have no buffers in use
+- (void)trim;
+
+@end
+
+// ----------------------------------------------------------------------------
+
+/*!
+ * An immutable NSData backed by a pooled buffer, which is returned to its pool
+ * when the slice is deallocated. Retaining a slice is all it takes to keep
+ * its bytes around.
+ *
+ * Like the buffer passed to onData, |bytes| has room for at least (|length| +
+ * 1) bytes. Copying a slice returns the same slice.
+ */
+@interface HDSlice : NSData {
+  HDBufferPool *pool_;
+  struct hd_slab *slab_; // NULL if allocated outside of the pool
+  void *bytes_;
+  NSUInteger length_;
+  NSUInteger capacity_;
+}
+
+// Number of bytes which can be stored in the slice
+@property(readonly) NSUInteger capacity;
+
+// An autoreleased slice from the shared pool holding a copy of |bytes|
++ (HDSlice*)sliceWithBytes:(const void*)bytes length:(size_t)length;
+
+/*!
+ * Writable bytes and length, for the producer filling a slice before handing
+ * it out (e.g. reading into it). Slices must not be modified after that.
+ */
+- (void*)mutableBytes;
+- (void)setLength:(NSUInteger)length;
+
+@end
@@ -0,0 +1,362 @@
+#import "HDBufferPool.h"
+#import "hcommon.h"
+
+// Bytes of buffers per slab. Classes this size or larger get one per slab.
+#define kSlabSize (64*1024)
+
+// Slab header size, keeping buffers cache line aligned
+#define kSlabHeaderSize ((sizeof(hd_slab_t) + 63) & ~(size_t)63)
+
+typedef struct hd_slab {
+  struct hd_slab *next; // in the class's list of slabs with free buffers
+  struct hd_slab *prev;
+  struct hd_pool_class *cls;
+  void *freeList;       // returned buffers, linked through their first word
+  char *unused;         // start of buffers which have never been handed out
+  char *end;
+  uint32_t used;        // buffers handed out
+} hd_slab_t;
+
+typedef struct hd_pool_class {
+  OSSpinLock lock;
+  size_t size;            // buffer size
+  size_t slabSize;        // bytes of buffers per slab
+  hd_slab_t *available;   // slabs with free buffers, partially used ones first
+  hd_slab_t *lastAvailable;
+  unsigned emptyCount;    // slabs in |available| with no buffers in use
+} hd_pool_class_t;
+
+
+static inline BOOL _slab_is_full(hd_slab_t *slab) {
+  return !slab->freeList && slab->unused == slab->end;
+}
+
+
+// Caller must hold cls->lock
+static void _class_unlink(hd_pool_class_t *cls, hd_slab_t *slab) {
+  if (slab->prev) slab->prev->next = slab->next;
+  else cls->available = slab->next;
+  if (slab->next) slab->next->prev = slab->prev;
+  else cls->lastAvailable = slab->prev;
+  slab->next = slab->prev = NULL;
+}
+
+
+// Caller must hold cls->lock
+static void _class_push_front(hd_pool_class_t *cls, hd_slab_t *slab) {
+  slab->prev = NULL;
+  slab->next = cls->available;
+  if (cls->available) cls->available->prev = slab;
+  else cls->lastAvailable = slab;
+  cls->available = slab;
+}
+
+
+// Caller must hold cls->lock
+static void _class_push_back(hd_pool_class_t *cls, hd_slab_t *slab) {
+  slab->next = NULL;
+  slab->prev = cls->lastAvailable;
+  if (cls->lastAvailable) cls->lastAvailable->next = slab;
+  else cls->available = slab;
+  cls->lastAvailable = slab;
+}
+
+
+static hd_slab_t *_slab_create(hd_pool_class_t *cls) {
+  hd_slab_t *slab = (hd_slab_t*)malloc(kSlabHeaderSize + cls->slabSize);
+  if (!slab) return NULL;
+  slab->next = slab->prev = NULL;
+  slab->cls = cls;
+  slab->freeList = NULL;
+  // buffers are carved out as needed so pages of a new slab are not touched
+  // until they are used
+  slab->unused = (char*)slab + kSlabHeaderSize;
+  slab->end = slab->unused + cls->slabSize;
+  slab->used = 0;
+  return slab;
+}
+
+
+// Take a buffer of class |cls|. Returns NULL if out of memory.
+static void *_class_get(hd_pool_class_t *cls, hd_slab_t **slabOut,
+                        volatile int64_t *bytesAllocated) {
+  OSSpinLockLock(&cls->lock);
+  hd_slab_t *slab = cls->available;
+  if (!slab) {
+    // no need to hold the lock while calling malloc
+    OSSpinLockUnlock(&cls->lock);
+    slab = _slab_create(cls);
+    if (!slab) return NULL;
+    h_atomic_add(bytesAllocated, (int64_t)cls->slabSize);
+    OSSpinLockLock(&cls->lock);
+    _class_push_front(cls, slab);
+    cls->emptyCount++;
+  }
+
+  void *buf;
+  if (slab->freeList) {
+    buf = slab->freeList;
+    slab->freeList = *(void**)buf;
+  } else {
+    buf = slab->unused;
+    slab->unused += cls->size;
+  }
+  if (slab->used++ == 0)
+    cls->emptyCount--;
+  if (_slab_is_full(slab))
+    _class_unlink(cls, slab);
+  OSSpinLockUnlock(&cls->lock);
+
+  *slabOut = slab;
+  return buf;
+}
+
+
+// Return |buf| to |slab|
+static void _class_put(hd_slab_t *slab, void *buf,
+                       volatile int64_t *bytesAllocated) {
+  hd_pool_class_t *cls = slab->cls;
+  hd_slab_t *freeSlab = NULL;
+  OSSpinLockLock(&cls->lock);
+  BOOL wasFull = _slab_is_full(slab);
+  *(void**)buf = slab->freeList;
+  slab->freeList = buf;
+  if (--slab->used == 0) {
+    if (!wasFull)
+      _class_unlink(cls, slab);
+    if (cls->emptyCount) {
+      // we already keep an empty slab around
+      freeSlab = slab;
+    } else {
+      // keep it, but hand out buffers from partially used slabs first
+      cls->emptyCount++;
+      _class_push_back(cls, slab);
+    }
+  } else if (wasFull) {
+    _class_push_front(cls, slab);
+  }
+  OSSpinLockUnlock(&cls->lock);
+
+  if (freeSlab) {
+    h_atomic_sub(bytesAllocated, (int64_t)cls->slabSize);
+    free(freeSlab);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+@interface HDBufferPool (Private)
+- (void)_putBytes:(void*)bytes slab:(hd_slab_t*)slab capacity:(size_t)capacity;
+@end
+
+@interface HDSlice (Private)
+- (id)_initWithPool:(HDBufferPool*)pool
+               slab:(hd_slab_t*)slab
+              bytes:(void*)bytes
+           capacity:(NSUInteger)capacity;
+@end
+
+// ----------------------------------------------------------------------------
+
+@implementation HDBufferPool
+
+
++ (HDBufferPool*)sharedPool {
+  static HDBufferPool *pool = nil;
+  static dispatch_once_t once;
+  dispatch_once(&once, ^{
+    pool = [[HDBufferPool alloc] initWithMinimumSize:256
+                                         maximumSize:256*1024];
+  });
+  return pool;
+}
+
+
+- (id)init {
+  return [self initWithMinimumSize:256 maximumSize:256*1024];
+}
+
+
+- (id)initWithMinimumSize:(size_t)minimumSize maximumSize:(size_t)maximumSize {
+  if (!(self = [super init])) return nil;
+  minimumShift_ = 4;
+  while (((size_t)1 << minimumShift_) < minimumSize)
+    minimumShift_++;
+  unsigned maximumShift = minimumShift_;
+  while (((size_t)1 << maximumShift) < maximumSize)
+    maximumShift++;
+
+  classCount_ = maximumShift - minimumShift_ + 1;
+  classes_ = (hd_pool_class_t*)calloc(classCount_, sizeof(hd_pool_class_t));
+  unsigned i;
+  for (i = 0; i < classCount_; i++) {
+    hd_pool_class_t *cls = &classes_[i];
+    cls->lock = OS_SPINLOCK_INIT;
+    cls->size = (size_t)1 << (minimumShift_ + i);
+    cls->slabSize = cls->size < kSlabSize ? kSlabSize : cls->size;
+  }
+  return self;
+}
+
+
+- (void)dealloc {
+  // slices retain their pool, so no buffers are in use at this point
+  [self trim];
+  free(classes_);
+  [super dealloc];
+}
+
+
+- (size_t)maximumSize {
+  return classes_[classCount_ - 1].size;
+}
+
+
+- (size_t)bytesAllocated {
+  return (size_t)bytesAllocated_;
+}
+
+
+- (size_t)bytesInUse {
+  return (size_t)bytesInUse_;
+}
+
+
+- (HDSlice*)newSliceWithCapacity:(size_t)capacity {
+  // +1 for the extra byte after the slice's length
+  size_t size = capacity + 1;
+  unsigned shift = minimumShift_;
+  while (((size_t)1 << shift) < size)
+    shift++;
+
+  hd_slab_t *slab = NULL;
+  void *buf;
+  if (shift - minimumShift_ < classCount_) {
+    hd_pool_class_t *cls = &classes_[shift - minimumShift_];
+    buf = _class_get(cls, &slab, &bytesAllocated_);
+    size = cls->size;
+  } else {
+    // too large for any size class
+    buf = malloc(size);
+    if (buf) h_atomic_add(&bytesAllocated_, (int64_t)size);
+  }
+  if (!buf) {
+    [NSException raise:NSMallocException
+                format:@"failed to allocate a %zu byte buffer", size];
+  }
+  h_atomic_add(&bytesInUse_, (int64_t)size);
+  return [[HDSlice alloc] _initWithPool:self slab:slab bytes:buf
+                               capacity:size - 1];
+}
+
+
+- (HDSlice*)sliceWithBytes:(const void*)bytes length:(size_t)length {
+  HDSlice *slice = [self newSliceWithCapacity:length];
+  memcpy(slice.mutableBytes, bytes, length);
+  [slice setLength:length];
+  return [slice autorelease];
+}
+
+
+// Called by -[HDSlice dealloc]
+- (void)_putBytes:(void*)bytes slab:(hd_slab_t*)slab capacity:(size_t)capacity {
+  h_atomic_sub(&bytesInUse_, (int64_t)(capacity + 1));
+  if (slab) {
+    _class_put(slab, bytes, &bytesAllocated_);
+  } else {
+    h_atomic_sub(&bytesAllocated_, (int64_t)(capacity + 1));
+    free(bytes);
+  }
+}
+
+
+- (void)trim {
+  unsigned i;
+  for (i = 0; i < classCount_; i++) {
+    hd_pool_class_t *cls = &classes_[i];
+    hd_slab_t *empty = NULL;
+    OSSpinLockLock(&cls->lock);
+    hd_slab_t *slab = cls->available;
+    while (slab) {
+      hd_slab_t *next = slab->next;
+      if (slab->used == 0) {
+        _class_unlink(cls, slab);
+        slab->next = empty;
+        empty = slab;
+        cls->emptyCount--;
+      }
+      slab = next;
+    }
+    OSSpinLockUnlock(&cls->lock);
+    while (empty) {
+      hd_slab_t *next = empty->next;
+      h_atomic_sub(&bytesAllocated_, (int64_t)cls->slabSize);
+      free(empty);
+      empty = next;
+    }
+  }
+}
+
+
+- (NSString*)description {
+  return [NSString stringWithFormat:@"<%@@%p %zu/%zu bytes in use>",
+          NSStringFromClass([self class]), self, self.bytesInUse,
+          self.bytesAllocated];
+}
+
+
+@end
+
+// ----------------------------------------------------------------------------
+
+@implementation HDSlice
+
+@synthesize capacity = capacity_;
+
+
++ (HDSlice*)sliceWithBytes:(const void*)bytes length:(size_t)length {
+  return [[HDBufferPool sharedPool] sliceWithBytes:bytes length:length];
+}
+
+
+- (id)_initWithPool:(HDBufferPool*)pool
+               slab:(hd_slab_t*)slab
+              bytes:(void*)bytes
+           capacity:(NSUInteger)capacity {
+  if (!(self = [super init])) return nil;
+  pool_ = [pool retain];
+  slab_ = slab;
+  bytes_ = bytes;
+  capacity_ = capacity;
+  return self;
+}
+
+
+- (void)dealloc {
+  [pool_ _putBytes:bytes_ slab:slab_ capacity:capacity_];
+  [pool_ release];
+  [super dealloc];
+}
+
+
+- (const void*)bytes { return bytes_; }
+- (void*)mutableBytes { return bytes_; }
+- (NSUInteger)length { return length_; }
+
+- (void)setLength:(NSUInteger)length {
+  if (length > capacity_) {
+    [NSException raise:NSRangeException
+                format:@"length %lu exceeds capacity %lu",
+                       (unsigned long)length, (unsigned long)capacity_];
+  }
+  length_ = length;
+}
+
+
+// slices are immutable once handed out
+- (id)copyWithZone:(NSZone*)zone {
+  return [self retain];
+}
+
+
+@end
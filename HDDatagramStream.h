@@ -0,0 +1,81 @@
+/*!
+ * HDDatagramStream is a HDStream for message-oriented sockets (e.g. UDP or
+ * AF_UNIX SOCK_DGRAM) which preserves message boundaries.
+ *
+ * @discussion
+ * Incoming messages are received in batches (using recvmmsg(2) where
+ * available) into a slab of buffers which is allocated once, the first time
+ * the stream becomes readable. Each read event drains the socket until it
+ * would block. Outgoing messages are queued just like with HDStream and sent
+ * in batches (using sendmmsg(2) where available).
+ *
+ * Each message is delivered to |onDatagram| together with its source address.
+ * If |onDatagram| is not set, messages are delivered to |onSlice| and |onData|
+ * instead.
+ *
+ * Example:
+ *
+ *    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+ *    bind(fd, ...);
+ *    HDDatagramStream *stream = [HDDatagramStream streamWithFileDescriptor:fd];
+ *    stream.onDatagram = ^(const void *bytes, size_t length,
+ *                          const struct sockaddr *address, socklen_t addrlen){
+ *      // one complete message
+ *    };
+ *    [stream resume];
+ *
+ */
+#import "HDStream.h"
+#import <sys/socket.h>
+
+// Maximum number of messages received or sent per syscall
+#define HD_DATAGRAM_BATCH_MAX 64
+
+// Block type for datagram events
+typedef void (^HDDatagramBlock)(const void *bytes, size_t length,
+                                const struct sockaddr *address,
+                                socklen_t addressLength);
+
+@interface HDDatagramStream : HDStream {
+@public
+  HDDatagramBlock onDatagram_;
+  size_t maximumDatagramSize_;
+  NSUInteger batchSize_;
+  struct hd_dgram_slab *slab_;
+}
+
+/*!
+ * Called for each message that arrives on a readable stream.
+ *
+ * @discussion
+ * |bytes| and |address| point into the stream's receive slab and are only
+ * valid within the calling scope. Just like with |onData|, |bytes| has room
+ * for at least (|length| + 1) bytes. Messages larger than
+ * |maximumDatagramSize| are truncated.
+ */
+@property(copy) HDDatagramBlock onDatagram;
+
+/*!
+ * Size of each receive buffer in the slab. Defaults to 2048 bytes. Changing
+ * this has no effect after the stream has received its first message.
+ */
+@property size_t maximumDatagramSize;
+
+// Number of messages to receive or send per syscall. Defaults to, and is
+// limited by, HD_DATAGRAM_BATCH_MAX.
+@property NSUInteger batchSize;
+
+/*!
+ * Queue |data| to be sent as a single message to |address| (a NSData wrapping
+ * a struct sockaddr). A nil |address| sends to the connected peer, which is
+ * also what writeData: does.
+ */
+- (void)writeData:(NSData*)data toAddress:(NSData*)address;
+
+// Queue |length| bytes from |bytes| to be sent as a single message to |address|
+- (void)writeBytes:(const void*)bytes
+            length:(size_t)length
+         toAddress:(const struct sockaddr*)address
+     addressLength:(socklen_t)addressLength;
+
+@end
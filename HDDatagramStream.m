@@ -0,0 +1,422 @@
+#import "HDDatagramStream.h"
+#import "HDStream-private.h"
+#import "hcommon.h"
+#import <sys/uio.h>
+
+// ----------------------------------------------------------------------------
+// Batched message I/O
+//
+// Linux provides recvmmsg(2) and sendmmsg(2) which transfer a whole vector of
+// messages in one syscall. Other systems get an emulation which performs one
+// recvmsg/sendmsg per message but otherwise behaves the same (returns the
+// number of messages transferred, or -1 if the first one failed).
+
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+  #define HD_HAVE_MMSG 1
+  typedef struct mmsghdr hd_mmsghdr_t;
+  #define _recvmmsg(fd, v, vlen, flags) recvmmsg((fd), (v), (vlen), (flags), NULL)
+  #define _sendmmsg(fd, v, vlen, flags) sendmmsg((fd), (v), (vlen), (flags))
+#else
+  typedef struct {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+  } hd_mmsghdr_t;
+
+  static int _recvmmsg(int fd, hd_mmsghdr_t *v, unsigned int vlen, int flags) {
+    unsigned int i;
+    for (i = 0; i < vlen; i++) {
+      ssize_t n = recvmsg(fd, &v[i].msg_hdr, flags);
+      if (n < 0)
+        return i ? (int)i : -1;
+      v[i].msg_len = (unsigned int)n;
+    }
+    return (int)vlen;
+  }
+
+  static int _sendmmsg(int fd, hd_mmsghdr_t *v, unsigned int vlen, int flags) {
+    unsigned int i;
+    for (i = 0; i < vlen; i++) {
+      ssize_t n = sendmsg(fd, &v[i].msg_hdr, flags);
+      if (n < 0)
+        return i ? (int)i : -1;
+      v[i].msg_len = (unsigned int)n;
+    }
+    return (int)vlen;
+  }
+#endif
+
+#ifndef MSG_DONTWAIT
+  #define MSG_DONTWAIT 0 // the fd is non-blocking anyway
+#endif
+
+// ----------------------------------------------------------------------------
+// Receive slab
+//
+// One allocation holding message headers, iovecs, source addresses and the
+// actual receive buffers for HD_DATAGRAM_BATCH_MAX messages.
+
+typedef struct hd_dgram_slab {
+  size_t bufsize; // usable size of each buffer (actual size is bufsize+1)
+  hd_mmsghdr_t hdrs[HD_DATAGRAM_BATCH_MAX];
+  struct iovec iov[HD_DATAGRAM_BATCH_MAX];
+  struct sockaddr_storage addrs[HD_DATAGRAM_BATCH_MAX];
+  char buffers[];
+} hd_dgram_slab_t;
+
+
+static hd_dgram_slab_t *_slab_create(size_t bufsize) {
+  size_t z = sizeof(hd_dgram_slab_t) + ((bufsize+1) * HD_DATAGRAM_BATCH_MAX);
+  hd_dgram_slab_t *slab = (hd_dgram_slab_t*)CFAllocatorAllocate(NULL, z, 0);
+  slab->bufsize = bufsize;
+  unsigned int i;
+  for (i = 0; i < HD_DATAGRAM_BATCH_MAX; i++) {
+    slab->iov[i].iov_base = slab->buffers + (i * (bufsize+1));
+    slab->iov[i].iov_len = bufsize;
+    struct msghdr *msg = &slab->hdrs[i].msg_hdr;
+    msg->msg_iov = &slab->iov[i];
+    msg->msg_iovlen = 1;
+    msg->msg_control = NULL;
+    msg->msg_controllen = 0;
+    msg->msg_name = &slab->addrs[i];
+  }
+  return slab;
+}
+
+
+// Reset fields which are modified by the kernel on receive
+static inline void _slab_reset(hd_dgram_slab_t *slab, unsigned int count) {
+  unsigned int i;
+  for (i = 0; i < count; i++) {
+    slab->hdrs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+    slab->hdrs[i].msg_hdr.msg_flags = 0;
+    slab->hdrs[i].msg_len = 0;
+  }
+}
+
+
+static inline unsigned int _batch_size(HDDatagramStream *self) {
+  NSUInteger n = self->batchSize_;
+  if (n < 1) return 1;
+  if (n > HD_DATAGRAM_BATCH_MAX) return HD_DATAGRAM_BATCH_MAX;
+  return (unsigned int)n;
+}
+
+// ----------------------------------------------------------------------------
+
+
+static void _dgram_read(HDDatagramStream *self) {
+  NSAutoreleasePool *pool = [NSAutoreleasePool new];
+
+  assert(self->readSource_);
+  int fd = dispatch_source_get_handle(self->readSource_);
+
+  // allocated on the first read event (safe since reads are serial)
+  if (!self->slab_)
+    self->slab_ = _slab_create(self->maximumDatagramSize_);
+  hd_dgram_slab_t *slab = self->slab_;
+  unsigned int vlen = _batch_size(self);
+
+  // Note: unlike byte streams, a zero estimate does not mean EOF -- there is
+  //       no such thing for datagram sockets and zero-length messages are
+  //       perfectly valid.
+
+  // drain the socket
+  while (1) {
+    _slab_reset(slab, vlen);
+    int count = _recvmmsg(fd, slab->hdrs, vlen, MSG_DONTWAIT);
+    if (count < 0) {
+      switch (errno) {
+        case EINTR:        // interrupted -- try again
+        case ECONNREFUSED: // ICMP feedback for an earlier send -- not fatal
+          continue;
+        case EAGAIN:       // drained
+          break;
+        default:
+          NSLog(@"%@: recvmmsg(): [%d] %s -- closing the file descriptor",
+                self, errno, strerror(errno));
+          dispatch_source_cancel(self->readSource_);
+      }
+      break;
+    }
+
+    int i;
+    for (i = 0; i < count; i++) {
+      struct msghdr *msg = &slab->hdrs[i].msg_hdr;
+      const void *bytes = slab->iov[i].iov_base;
+      size_t length = slab->hdrs[i].msg_len;
+      if (length > slab->bufsize) length = slab->bufsize; // MSG_TRUNC
+      @try {
+        if (self->onDatagram_) {
+          self->onDatagram_(bytes, length, (const struct sockaddr*)msg->msg_name,
+                            msg->msg_namelen);
+        } else {
+          // the receive slab is reused for the next batch, so slices get a copy
+          if (self->onSlice_)
+            self->onSlice_([HDSlice sliceWithBytes:bytes length:length]);
+          if (self->onData_)
+            self->onData_(bytes, length);
+        }
+      } @catch (NSException * e) {
+        NSLog(@"%@: exception while invoking callback: %@", self, e);
+      }
+    }
+
+    // A short batch means the next receive would have blocked, so we save
+    // ourselves the syscall which would tell us EAGAIN. Also stop if a
+    // callback canceled the stream.
+    if ((unsigned int)count < vlen ||
+        dispatch_source_testcancel(self->readSource_)) {
+      break;
+    }
+  }
+
+  [pool drain];
+}
+
+
+static void _dgram_read_finalize(HDDatagramStream *self) {
+  int fd = dispatch_source_get_handle(self->readSource_);
+  close(fd);
+
+  dispatch_source_t oldSource = self->readSource_;
+  if (h_casptr(&self->readSource_, oldSource, nil))
+    dispatch_release(oldSource);
+
+  // no more read events will be delivered, so give back the slab
+  if (self->slab_) {
+    CFAllocatorDeallocate(NULL, self->slab_);
+    self->slab_ = NULL;
+  }
+
+  self->fd_ = -1;
+  [self release];
+}
+
+
+// Remove |count| sent messages from the tail of the write buffer chain.
+// Returns YES if the chain is now empty.
+static BOOL _dgram_dequeue(HDDatagramStream *self, wbuf_t **wbufs, int count) {
+  BOOL empty = NO;
+  OSSpinLockLock(&(self->writeSpinLock_));
+  wbuf_t *next = wbufs[count-1]->next;
+  if (next == NULL) {
+    self->wbufTail_ = self->wbufHead_ = NULL;
+    OSSpinLockUnlock(&(self->writeSpinLock_));
+    // suspend write source until needed
+    if (HAFLAG_SET(&(self->flags_), kFlagSuspendedWrite))
+      dispatch_suspend(self->writeSource_);
+    empty = YES;
+  } else {
+    self->wbufTail_ = next;
+    OSSpinLockUnlock(&(self->writeSpinLock_));
+  }
+  int i;
+  for (i = 0; i < count; i++)
+    wbuf_free(wbufs[i]);
+  return empty;
+}
+
+
+static void _dgram_write(HDDatagramStream *self) {
+  int fd = dispatch_source_get_handle(self->writeSource_);
+  unsigned int vlen = _batch_size(self);
+  hd_mmsghdr_t hdrs[HD_DATAGRAM_BATCH_MAX];
+  struct iovec iov[HD_DATAGRAM_BATCH_MAX];
+  wbuf_t *wbufs[HD_DATAGRAM_BATCH_MAX];
+
+  while (1) {
+    // Collect a batch from the tail. We need the lock here since the head
+    // link's |next| might be modified by a concurrent writer.
+    unsigned int i, count = 0;
+    OSSpinLockLock(&(self->writeSpinLock_));
+    wbuf_t *wbuf = self->wbufTail_;
+    while (wbuf && count < vlen) {
+      wbufs[count++] = wbuf;
+      wbuf = wbuf->next;
+    }
+    OSSpinLockUnlock(&(self->writeSpinLock_));
+    assert(count != 0);
+
+    for (i = 0; i < count; i++) {
+      wbuf = wbufs[i];
+      iov[i].iov_base = (void*)[wbuf->data bytes];
+      iov[i].iov_len = [wbuf->data length];
+      struct msghdr *msg = &hdrs[i].msg_hdr;
+      msg->msg_iov = &iov[i];
+      msg->msg_iovlen = 1;
+      msg->msg_control = NULL;
+      msg->msg_controllen = 0;
+      msg->msg_flags = 0;
+      if (wbuf->address) {
+        msg->msg_name = (void*)[wbuf->address bytes];
+        msg->msg_namelen = (socklen_t)[wbuf->address length];
+      } else {
+        msg->msg_name = NULL;
+        msg->msg_namelen = 0;
+      }
+    }
+
+    int sent = _sendmmsg(fd, hdrs, count, 0);
+    if (sent < 0) {
+      switch (errno) {
+        // try-again "errors":
+        case EINTR:
+          continue;
+        case EAGAIN:
+          return;
+
+        // Problems with a single message. Drop it and carry on.
+        case EMSGSIZE:
+        case ECONNREFUSED:
+        case EHOSTUNREACH:
+        case ENETUNREACH:
+        case EDESTADDRREQ:
+        case EAFNOSUPPORT:
+          NSLog(@"%@: sendmmsg(): [%d] %s -- dropping message", self, errno,
+                strerror(errno));
+          sent = 1;
+          break;
+
+        // Gracefully cancel the source, closing fd:
+        case EBADF:
+        case EPIPE:
+        case EIO:
+          dispatch_source_cancel(self->writeSource_);
+          return;
+
+        // Other errors are considered serious and are logged
+        default:
+          NSLog(@"%@: sendmmsg(): [%d] %s -- closing the file descriptor", self,
+                errno, strerror(errno));
+          dispatch_source_cancel(self->writeSource_);
+          return;
+      }
+    }
+
+    // break on empty input or full output
+    if (_dgram_dequeue(self, wbufs, sent) || (unsigned int)sent < count)
+      break;
+  }
+}
+
+
+static void _dgram_write_finalize(HDDatagramStream *self) {
+  int fd = dispatch_source_get_handle(self->writeSource_);
+  close(fd);
+
+  dispatch_source_t oldSource = self->writeSource_;
+  if (h_casptr(&self->writeSource_, oldSource, nil))
+    dispatch_release(oldSource);
+
+  self->fd_ = -1;
+  [self release];
+}
+
+// ----------------------------------------------------------------------------
+
+@implementation HDDatagramStream
+
+@synthesize onDatagram = onDatagram_,
+            maximumDatagramSize = maximumDatagramSize_,
+            batchSize = batchSize_;
+
+
+- (id)init {
+  if ((self = [super init])) {
+    maximumDatagramSize_ = 2048;
+    batchSize_ = HD_DATAGRAM_BATCH_MAX;
+  }
+  return self;
+}
+
+
+- (void)dealloc {
+  if (onDatagram_) {
+    [onDatagram_ release];
+    onDatagram_ = nil;
+  }
+  if (slab_) {
+    CFAllocatorDeallocate(NULL, slab_);
+    slab_ = NULL;
+  }
+  [super dealloc];
+}
+
+
+// datagrams always use dispatch sources since we need recvmmsg/sendmmsg
++ (const hd_io_backend_t*)_IOBackend {
+  return NULL;
+}
+
+
+- (void)_createReadSource {
+  assert(readSource_ == nil);
+  assert(dispatchQueue_ != nil);
+
+  readSource_ =
+      dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, fd_, 0, dispatchQueue_);
+  assert(readSource_ != NULL);
+  dispatch_source_set_event_handler_f(readSource_,
+                                      (dispatch_function_t)&_dgram_read);
+  dispatch_source_set_cancel_handler_f(readSource_,
+      (dispatch_function_t)&_dgram_read_finalize);
+  dispatch_set_context(readSource_, [self retain]); // released by ^
+}
+
+
+- (void)_createWriteSource {
+  writeSource_ = dispatch_source_create(DISPATCH_SOURCE_TYPE_WRITE, fd_, 0,
+                                        dispatchQueue_);
+  assert(writeSource_ != NULL);
+  dispatch_source_set_event_handler_f(writeSource_,
+                                      (dispatch_function_t)&_dgram_write);
+  dispatch_source_set_cancel_handler_f(writeSource_,
+      (dispatch_function_t)&_dgram_write_finalize);
+  dispatch_set_context(writeSource_, [self retain]); // released by ^
+}
+
+
+- (HDStream*)copyWithFileDescriptor:(int)fd
+                     disableReading:(BOOL)disableReading
+                     disableWriting:(BOOL)disableWriting {
+  HDDatagramStream *stream =
+    [[isa alloc] initWithFileDescriptor:fd disableReading:disableReading
+                  disableWriting:disableWriting dispatchQueue:dispatchQueue_];
+  stream.maximumDatagramSize = maximumDatagramSize_;
+  stream.batchSize = batchSize_;
+  if (onData_)
+    stream.onData = onData_;
+  if (onSlice_)
+    stream.onSlice = onSlice_;
+  if (onDatagram_)
+    stream.onDatagram = onDatagram_;
+  if (!self.isSuspended)
+    [stream resume];
+  return stream;
+}
+
+
+#pragma mark Writing
+
+
+- (void)writeData:(NSData*)data {
+  [self _enqueueWriteBuffer:wbuf_alloc(data, nil)];
+}
+
+
+- (void)writeData:(NSData*)data toAddress:(NSData*)address {
+  [self _enqueueWriteBuffer:wbuf_alloc(data, address)];
+}
+
+
+- (void)writeBytes:(const void*)bytes
+            length:(size_t)length
+         toAddress:(const struct sockaddr*)address
+     addressLength:(socklen_t)addressLength {
+  NSData *addr = address ? [NSData dataWithBytes:address length:addressLength]
+                         : nil;
+  [self writeData:[NSData dataWithBytes:bytes length:length] toAddress:addr];
+}
+
+
+@end
@@ -0,0 +1,93 @@
+#import <Foundation/Foundation.h>
+#import <dispatch/dispatch.h>
+
+// Error domain and codes for errors passed to onComplete
+extern NSString * const HDHTTPClientErrorDomain;
+enum {
+  HDHTTPClientErrorUnsupportedURL = 1, // not a http:// URL
+  HDHTTPClientErrorConnectFailed,      // could not resolve or connect
+  HDHTTPClientErrorConnectionClosed,   // closed before the response completed
+  HDHTTPClientErrorProtocol,           // malformed response
+};
+
+/*!
+ * A HTTP/1.1 client built on HDStream which keeps connections alive and reuses
+ * them through per-host connection pools.
+ *
+ * @discussion
+ * Requests to the same host and port share up to |maximumConnectionsPerHost|
+ * persistent connections. When all of them are busy, requests are either
+ * pipelined onto an existing connection (if |pipeliningDepth| > 1 and the
+ * request is idempotent) or queued until a connection becomes available.
+ *
+ * Responses are parsed incrementally, directly from the stream's onData
+ * chunks, including chunked transfer decoding. The callbacks have the same
+ * shape as those of HURLConnection:
+ *
+ * - onResponse is called once the status line and headers have been parsed.
+ *   The response is a NSHTTPURLResponse. Returning an error aborts the request.
+ * - onData is called for each decoded piece of the body. If it is nil, the
+ *   body is accumulated and passed to onComplete instead.
+ * - onComplete is always called exactly once.
+ *
+ * If a connection closes before any of the response arrived, GET and HEAD
+ * requests are retried once on another connection. Other requests fail with
+ * HDHTTPClientErrorConnectionClosed since the server might have acted on them.
+ * When a read or write error closed the connection, it is the error's
+ * NSUnderlyingErrorKey.
+ *
+ * All callbacks are invoked serially on the client's dispatch queue.
+ *
+ * Only the "http" scheme is supported.
+ *
+ * Example:
+ *
+ *    HDHTTPClient *client = [HDHTTPClient sharedClient];
+ *    NSURL *url = [NSURL URLWithString:@"http://127.0.0.1:8080/status"];
+ *    [client fetch:[NSURLRequest requestWithURL:url]
+ *        onResponseBlock:nil
+ *            onDataBlock:nil
+ *        onCompleteBlock:^(NSError *err, NSData *data) {
+ *      NSLog(@"got %lu bytes", (unsigned long)data.length);
+ *    }];
+ *
+ */
+@interface HDHTTPClient : NSObject {
+  dispatch_queue_t dispatchQueue_;
+  NSMutableDictionary *pools_; // "host:port" => _HDHTTPPool
+  NSUInteger maximumConnectionsPerHost_;
+  NSUInteger pipeliningDepth_;
+  NSTimeInterval idleTimeout_;
+}
+
+// Maximum number of open connections per host and port. Defaults to 4.
+@property NSUInteger maximumConnectionsPerHost;
+
+/*!
+ * Maximum number of requests which can be in flight on a single connection.
+ * Defaults to 1 (no pipelining). Only GET and HEAD requests are pipelined.
+ */
+@property NSUInteger pipeliningDepth;
+
+// Idle connections are closed after this many seconds. Defaults to 30.
+@property NSTimeInterval idleTimeout;
+
+// The serial queue on which connections are managed and callbacks invoked
+@property(readonly) dispatch_queue_t dispatchQueue;
+
+// A shared client
++ (HDHTTPClient*)sharedClient;
+
+/*!
+ * Send |request|. The request's URL, HTTP method, header fields and body are
+ * used -- cache policy and timeout are ignored.
+ */
+- (void)fetch:(NSURLRequest*)request
+    onResponseBlock:(NSError*(^)(NSURLResponse *response))onResponse
+        onDataBlock:(NSError*(^)(NSData *data))onData
+    onCompleteBlock:(void(^)(NSError *err, NSData *data))onComplete;
+
+// Close all idle connections
+- (void)closeIdleConnections;
+
+@end
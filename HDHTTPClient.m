@@ -0,0 +1,866 @@
+#import "HDHTTPClient.h"
+#import "HDStream.h"
+#import "HEventEmitter.h"
+#import <sys/socket.h>
+#import <netinet/in.h>
+#import <netinet/tcp.h>
+#import <netdb.h>
+#import <fcntl.h>
+
+NSString * const HDHTTPClientErrorDomain = @"HDHTTPClientErrorDomain";
+
+// Longest status or header line we accept
+#define kMaxLineLength (64*1024)
+
+// Upper bound for presizing accumulated bodies from Content-Length
+#define kMaxPresize (64*1024*1024)
+
+// Seconds for which a host's resolved addresses are used for new connections
+#define kResolveTTL 60.0
+
+static NSError *_error(NSInteger code, NSString *description) {
+  NSDictionary *info = [NSDictionary dictionaryWithObject:description
+                                                   forKey:NSLocalizedDescriptionKey];
+  return [NSError errorWithDomain:HDHTTPClientErrorDomain code:code
+                         userInfo:info];
+}
+
+// HDHTTPClientErrorConnectionClosed, caused by |underlying| if not nil
+static NSError *_closed_error(NSError *underlying) {
+  NSMutableDictionary *info = [NSMutableDictionary dictionaryWithObject:
+      @"connection closed" forKey:NSLocalizedDescriptionKey];
+  if (underlying)
+    [info setObject:underlying forKey:NSUnderlyingErrorKey];
+  return [NSError errorWithDomain:HDHTTPClientErrorDomain
+                             code:HDHTTPClientErrorConnectionClosed
+                         userInfo:info];
+}
+
+// ----------------------------------------------------------------------------
+
+// A NSHTTPURLResponse which we can construct ourselves
+@interface _HDHTTPResponse : NSHTTPURLResponse {
+ @public
+  NSInteger statusCode_;
+  NSMutableDictionary *headers_;
+}
+@end
+@implementation _HDHTTPResponse
+
+- (NSInteger)statusCode { return statusCode_; }
+- (NSDictionary*)allHeaderFields { return headers_; }
+
+- (void)dealloc {
+  [headers_ release];
+  [super dealloc];
+}
+
+@end
+
+// ----------------------------------------------------------------------------
+
+// One request/response exchange
+@interface _HDHTTPExchange : NSObject {
+ @public
+  NSURL *url_;
+  NSData *requestData_;
+  BOOL isIdempotent_;
+  BOOL isHead_;
+  NSError*(^onResponse_)(NSURLResponse *response);
+  NSError*(^onData_)(NSData *data);
+  void(^onComplete_)(NSError *err, NSData *data);
+  NSMutableData *body_;
+  BOOL receivedBytes_;
+  NSUInteger attempts_;
+}
+- (void)completeWithError:(NSError*)err;
+@end
+@implementation _HDHTTPExchange
+
+- (void)completeWithError:(NSError*)err {
+  void(^onComplete)(NSError *err, NSData *data) = onComplete_;
+  if (!onComplete) return;
+  onComplete_ = nil; // exactly once
+  @try {
+    onComplete(err, err ? nil : body_);
+  } @catch (NSException * e) {
+    NSLog(@"%@: exception while invoking callback: %@", self, e);
+  }
+  [onComplete release];
+}
+
+- (void)dealloc {
+  [url_ release];
+  [requestData_ release];
+  [onResponse_ release];
+  [onData_ release];
+  [onComplete_ release];
+  [body_ release];
+  [super dealloc];
+}
+
+@end
+
+// ----------------------------------------------------------------------------
+
+@class _HDHTTPConnection;
+
+// Connections and queued exchanges for one host:port
+@interface _HDHTTPPool : NSObject {
+ @public
+  NSString *host_;
+  int port_;
+  NSMutableArray *connections_;
+  NSMutableArray *pending_;
+  struct addrinfo *addrinfo_;  // resolved addresses, or NULL
+  NSTimeInterval resolvedAt_;
+  BOOL resolving_;
+}
+- (void)setAddrinfo:(struct addrinfo*)addrinfo;
+@end
+@implementation _HDHTTPPool
+
+- (id)initWithHost:(NSString*)host port:(int)port {
+  if ((self = [super init])) {
+    host_ = [host retain];
+    port_ = port;
+    connections_ = [NSMutableArray new];
+    pending_ = [NSMutableArray new];
+  }
+  return self;
+}
+
+- (void)setAddrinfo:(struct addrinfo*)addrinfo {
+  if (addrinfo_) freeaddrinfo(addrinfo_);
+  addrinfo_ = addrinfo;
+  resolvedAt_ = [NSDate timeIntervalSinceReferenceDate];
+}
+
+- (void)dealloc {
+  [host_ release];
+  [connections_ release];
+  [pending_ release];
+  if (addrinfo_) freeaddrinfo(addrinfo_);
+  [super dealloc];
+}
+
+@end
+
+// ----------------------------------------------------------------------------
+
+@interface HDHTTPClient (Private)
+- (void)_pump:(_HDHTTPPool*)pool;
+- (BOOL)_resolve:(_HDHTTPPool*)pool;
+@end
+
+// parser states
+enum {
+  kStateStatusLine = 0,
+  kStateHeaders,
+  kStateBody,       // |remaining_| bytes of body (or chunk), -1 until EOF
+  kStateChunkSize,
+  kStateChunkEnd,   // CRLF after chunk data
+  kStateTrailer,
+};
+
+// A persistent connection with its own incremental response parser. Only
+// touched on the client's (serial) dispatch queue.
+@interface _HDHTTPConnection : NSObject {
+ @public
+  HDHTTPClient *client_; // weak
+  _HDHTTPPool *pool_;    // weak
+  HDStream *stream_;
+  NSMutableArray *inflight_; // sent exchanges, in response order
+  NSUInteger completed_;
+  BOOL keepAlive_;
+  BOOL closed_;
+  NSUInteger idleGeneration_;
+
+  // parser
+  int state_;
+  NSMutableData *line_;
+  int versionMinor_;
+  _HDHTTPResponse *response_;
+  int64_t contentLength_;
+  int64_t remaining_;
+  BOOL chunked_;
+  BOOL connectionClose_;
+  BOOL connectionKeepAlive_;
+}
+- (id)initWithClient:(HDHTTPClient*)client
+                pool:(_HDHTTPPool*)pool
+      fileDescriptor:(int)fd;
+- (void)send:(_HDHTTPExchange*)exchange;
+- (BOOL)isIdle;
+- (BOOL)canPipeline:(_HDHTTPExchange*)exchange depth:(NSUInteger)depth;
+- (void)close;
+- (void)closeWithError:(NSError*)error;
+- (void)_parse:(const char*)p length:(size_t)length;
+@end
+
+@implementation _HDHTTPConnection
+
+
+- (id)initWithClient:(HDHTTPClient*)client
+                pool:(_HDHTTPPool*)pool
+      fileDescriptor:(int)fd {
+  if (!(self = [super init])) return nil;
+  client_ = client;
+  pool_ = pool;
+  inflight_ = [NSMutableArray new];
+  line_ = [NSMutableData new];
+  keepAlive_ = YES;
+  contentLength_ = -1;
+
+  stream_ = [[HDStream alloc] initWithFileDescriptor:fd];
+  stream_.dispatchQueue = client.dispatchQueue;
+  // The stream is owned by us and all callbacks happen on the same serial
+  // queue as -close (which clears them), so a weak reference is sufficient.
+  __block _HDHTTPConnection *conn = self;
+  stream_.onData = ^(const void *bytes, size_t length) {
+    [conn _parse:(const char*)bytes length:length];
+  };
+  [stream_ on:@"error", ^(HDStream *stream, NSError *error) {
+    [conn closeWithError:error];
+  }];
+  [stream_ on:@"close", ^(HDStream *stream) {
+    [conn close];
+  }];
+  [stream_ resume];
+  return self;
+}
+
+
+- (void)dealloc {
+  [stream_ release];
+  [inflight_ release];
+  [line_ release];
+  [response_ release];
+  [super dealloc];
+}
+
+
+- (void)send:(_HDHTTPExchange*)exchange {
+  idleGeneration_++;
+  exchange->attempts_++;
+  [inflight_ addObject:exchange];
+  [stream_ writeData:exchange->requestData_];
+}
+
+
+- (BOOL)isIdle {
+  return !closed_ && keepAlive_ && inflight_.count == 0;
+}
+
+
+// Can |exchange| be pipelined behind what's already in flight?
+- (BOOL)canPipeline:(_HDHTTPExchange*)exchange depth:(NSUInteger)depth {
+  if (closed_ || !keepAlive_ || inflight_.count >= depth ||
+      !exchange->isIdempotent_) {
+    return NO;
+  }
+  for (_HDHTTPExchange *ex in inflight_)
+    if (!ex->isIdempotent_) return NO;
+  return YES;
+}
+
+
+- (void)_resetParser {
+  state_ = kStateStatusLine;
+  [line_ setLength:0];
+  [response_ release];
+  response_ = nil;
+  contentLength_ = -1;
+  remaining_ = 0;
+  chunked_ = connectionClose_ = connectionKeepAlive_ = NO;
+}
+
+
+- (void)close {
+  [self closeWithError:nil];
+}
+
+
+// Close the connection, which failed with |error| unless it's nil
+- (void)closeWithError:(NSError*)error {
+  if (closed_) return;
+  closed_ = YES;
+  [[self retain] autorelease]; // the pool might be our last owner
+
+  // detach from the stream
+  stream_.onData = nil;
+  [stream_ removeAllListeners];
+  [stream_ cancel];
+  [pool_->connections_ removeObjectIdenticalTo:self];
+
+  // a response delimited by EOF is complete now -- unless the connection
+  // failed, in which case we can't tell whether we got all of it
+  if (!error && state_ == kStateBody && remaining_ == -1 && inflight_.count) {
+    _HDHTTPExchange *ex = [[inflight_ objectAtIndex:0] retain];
+    [inflight_ removeObjectAtIndex:0];
+    [ex completeWithError:nil];
+    [ex release];
+  }
+
+  // Requeue idempotent exchanges which never saw a byte of their response
+  // (e.g. the server closed an idle keep-alive connection just as we reused
+  // it). Others might have been acted upon by the server even though no
+  // response arrived, so they fail along with the rest.
+  NSUInteger i = 0;
+  for (_HDHTTPExchange *ex in inflight_) {
+    if (ex->isIdempotent_ && !ex->receivedBytes_ && ex->attempts_ < 2) {
+      [pool_->pending_ insertObject:ex atIndex:i++];
+    } else {
+      [ex completeWithError:_closed_error(error)];
+    }
+  }
+  [inflight_ removeAllObjects];
+  [self _resetParser];
+  [client_ _pump:pool_];
+}
+
+
+// Abort the current exchange with |error| and close the connection since we
+// can't tell where the next response starts
+- (void)_abort:(NSError*)error {
+  if (inflight_.count) {
+    _HDHTTPExchange *ex = [[inflight_ objectAtIndex:0] retain];
+    [inflight_ removeObjectAtIndex:0];
+    [ex completeWithError:error];
+    [ex release];
+  }
+  [self _resetParser];
+  [self close];
+}
+
+
+- (void)_finish {
+  _HDHTTPExchange *ex = [[inflight_ objectAtIndex:0] retain];
+  [inflight_ removeObjectAtIndex:0];
+  completed_++;
+  [self _resetParser];
+  [ex completeWithError:nil];
+  [ex release];
+
+  if (!keepAlive_) {
+    [self close];
+    return;
+  }
+
+  if (inflight_.count == 0) {
+    // idle -- close after a while unless reused
+    NSUInteger generation = ++idleGeneration_;
+    dispatch_time_t when = dispatch_time(DISPATCH_TIME_NOW,
+        (int64_t)(client_.idleTimeout * 1000000000.0));
+    dispatch_after(when, client_.dispatchQueue, ^{
+      NSAutoreleasePool *pool = [NSAutoreleasePool new];
+      if (!closed_ && inflight_.count == 0 && idleGeneration_ == generation)
+        [self close];
+      [pool drain];
+    });
+  }
+  [client_ _pump:pool_];
+}
+
+
+- (void)_deliver:(const char*)bytes length:(size_t)length {
+  _HDHTTPExchange *ex = [inflight_ objectAtIndex:0];
+  if (ex->onData_) {
+    NSError *error = ex->onData_([NSData dataWithBytes:bytes length:length]);
+    if (error) [self _abort:error];
+  } else {
+    [ex->body_ appendBytes:bytes length:length];
+  }
+}
+
+
+- (void)_headersComplete {
+  // retained since _finish removes it from inflight_
+  _HDHTTPExchange *ex = [[inflight_ objectAtIndex:0] retain];
+  NSInteger status = response_->statusCode_;
+
+  // skip informational responses (e.g. 100 Continue)
+  if (status >= 100 && status < 200 && status != 101) {
+    [self _resetParser];
+    [ex release];
+    return;
+  }
+
+  if (connectionClose_ || (versionMinor_ == 0 && !connectionKeepAlive_))
+    keepAlive_ = NO;
+
+  if (ex->onResponse_) {
+    NSError *error = ex->onResponse_(response_);
+    if (error) {
+      [self _abort:error];
+      [ex release];
+      return;
+    }
+  }
+
+  BOOL hasBody = !(ex->isHead_ || status == 204 || status == 304 ||
+                   status < 200);
+
+  // before any _finish, so that responses without a body complete with an
+  // empty body rather than nil
+  if (!ex->onData_ && !ex->body_) {
+    NSUInteger capacity = (hasBody && contentLength_ > 0 &&
+                           contentLength_ < kMaxPresize) ?
+                          (NSUInteger)contentLength_ : 0;
+    ex->body_ = [[NSMutableData alloc] initWithCapacity:capacity];
+  }
+
+  if (!hasBody) {
+    [self _finish];
+  } else if (chunked_) {
+    state_ = kStateChunkSize;
+  } else if (contentLength_ == 0) {
+    [self _finish];
+  } else {
+    state_ = kStateBody;
+    remaining_ = contentLength_; // -1 means until EOF
+    if (remaining_ == -1)
+      keepAlive_ = NO;
+  }
+  [ex release];
+}
+
+
+- (BOOL)_parseStatusLine:(const char*)line length:(size_t)length {
+  // HTTP/1.1 200 OK
+  if (length < 12 || memcmp(line, "HTTP/1.", 7) != 0 || line[8] != ' ')
+    return NO;
+  versionMinor_ = line[7] - '0';
+  NSInteger status = 0;
+  size_t i;
+  for (i = 9; i < 12; i++) {
+    if (line[i] < '0' || line[i] > '9') return NO;
+    status = (status * 10) + (line[i] - '0');
+  }
+  _HDHTTPExchange *ex = [inflight_ objectAtIndex:0];
+  response_ = [[_HDHTTPResponse alloc] initWithURL:ex->url_ MIMEType:nil
+                                 expectedContentLength:-1
+                                      textEncodingName:nil];
+  response_->statusCode_ = status;
+  response_->headers_ = [NSMutableDictionary new];
+  return YES;
+}
+
+
+- (BOOL)_parseHeader:(const char*)line length:(size_t)length {
+  const char *colon = memchr(line, ':', length);
+  if (!colon || colon == line) return NO;
+  NSString *name = [[NSString alloc] initWithBytes:line length:colon-line
+                                          encoding:NSISOLatin1StringEncoding];
+  const char *v = colon + 1, *end = line + length;
+  while (v < end && (*v == ' ' || *v == '\t')) v++;
+  while (end > v && (end[-1] == ' ' || end[-1] == '\t')) end--;
+  NSString *value = [[NSString alloc] initWithBytes:v length:end-v
+                                           encoding:NSISOLatin1StringEncoding];
+
+  NSMutableDictionary *headers = response_->headers_;
+  NSString *existing = [headers objectForKey:name];
+  if (existing) {
+    [headers setObject:[NSString stringWithFormat:@"%@, %@", existing, value]
+                forKey:name];
+  } else {
+    [headers setObject:value forKey:name];
+  }
+
+  // headers which affect framing or connection reuse
+  if ([name caseInsensitiveCompare:@"Content-Length"] == NSOrderedSame) {
+    contentLength_ = strtoll([value UTF8String], NULL, 10);
+  } else if ([name caseInsensitiveCompare:@"Transfer-Encoding"] ==
+             NSOrderedSame) {
+    chunked_ = [value rangeOfString:@"chunked"
+                            options:NSCaseInsensitiveSearch].location !=
+               NSNotFound;
+  } else if ([name caseInsensitiveCompare:@"Connection"] == NSOrderedSame) {
+    if ([value rangeOfString:@"close" options:NSCaseInsensitiveSearch]
+        .location != NSNotFound) {
+      connectionClose_ = YES;
+    } else if ([value rangeOfString:@"keep-alive"
+                            options:NSCaseInsensitiveSearch].location !=
+               NSNotFound) {
+      connectionKeepAlive_ = YES;
+    }
+  }
+
+  [name release];
+  [value release];
+  return YES;
+}
+
+
+- (void)_parseLine:(const char*)line length:(size_t)length {
+  switch (state_) {
+    case kStateStatusLine:
+      if (length == 0) return; // tolerate stray CRLF between responses
+      if (![self _parseStatusLine:line length:length]) break;
+      state_ = kStateHeaders;
+      return;
+
+    case kStateHeaders:
+      if (length == 0) {
+        [self _headersComplete];
+        return;
+      }
+      if (![self _parseHeader:line length:length]) break;
+      return;
+
+    case kStateChunkSize: {
+      // hex size, optionally followed by ";extension"
+      int64_t size = 0;
+      size_t i, digits = 0;
+      for (i = 0; i < length && line[i] != ';' && line[i] != ' '; i++) {
+        char c = line[i];
+        int d = (c >= '0' && c <= '9') ? c - '0' :
+                (c >= 'a' && c <= 'f') ? c - 'a' + 10 :
+                (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+        if (d == -1 || ++digits > 15) break;
+        size = (size << 4) | d;
+      }
+      if (digits == 0 || (i < length && line[i] != ';' && line[i] != ' '))
+        break;
+      if (size == 0) {
+        state_ = kStateTrailer;
+      } else {
+        state_ = kStateBody;
+        remaining_ = size;
+      }
+      return;
+    }
+
+    case kStateChunkEnd:
+      if (length != 0) break;
+      state_ = kStateChunkSize;
+      return;
+
+    case kStateTrailer:
+      if (length == 0)
+        [self _finish];
+      return;
+  }
+  [self _abort:_error(HDHTTPClientErrorProtocol, @"malformed response")];
+}
+
+
+- (void)_parse:(const char*)p length:(size_t)length {
+  if (length == 0) return; // EOF is handled by the "close" event
+  if (inflight_.count == 0) {
+    // data we did not ask for
+    [self close];
+    return;
+  }
+  const char *end = p + length;
+  while (p < end && !closed_ && inflight_.count) {
+    if (state_ == kStateBody) {
+      size_t n = end - p;
+      if (remaining_ != -1 && (int64_t)n > remaining_)
+        n = (size_t)remaining_;
+      ((_HDHTTPExchange*)[inflight_ objectAtIndex:0])->receivedBytes_ = YES;
+      [self _deliver:p length:n];
+      p += n;
+      if (remaining_ != -1 && !closed_) {
+        remaining_ -= n;
+        if (remaining_ == 0) {
+          if (chunked_) {
+            state_ = kStateChunkEnd;
+          } else {
+            [self _finish];
+          }
+        }
+      }
+      continue;
+    }
+
+    // line-oriented states
+    ((_HDHTTPExchange*)[inflight_ objectAtIndex:0])->receivedBytes_ = YES;
+    const char *nl = memchr(p, '\n', end - p);
+    if (!nl) {
+      [line_ appendBytes:p length:end - p];
+      if (line_.length > kMaxLineLength)
+        [self _abort:_error(HDHTTPClientErrorProtocol, @"line too long")];
+      break;
+    }
+    const char *line = p;
+    size_t linelen = nl - p;
+    if (line_.length) {
+      [line_ appendBytes:p length:linelen];
+      line = (const char*)[line_ bytes];
+      linelen = line_.length;
+    }
+    p = nl + 1;
+    if (linelen && line[linelen-1] == '\r')
+      linelen--;
+    [self _parseLine:line length:linelen];
+    if (!closed_)
+      [line_ setLength:0];
+  }
+}
+
+@end
+
+// ----------------------------------------------------------------------------
+
+static NSData *_serialize_request(NSURLRequest *request, NSString *host,
+                                  int port) {
+  NSURL *url = [request URL];
+  NSString *path = [(NSString*)CFURLCopyPath((CFURLRef)url) autorelease];
+  if (!path || path.length == 0) path = @"/";
+  NSString *query = [url query];
+  NSString *method = [request HTTPMethod] ? [request HTTPMethod] : @"GET";
+  NSData *body = [request HTTPBody];
+
+  NSMutableString *head = [NSMutableString stringWithFormat:
+      @"%@ %@%@%@ HTTP/1.1\r\nHost: %@", method, path,
+      query ? @"?" : @"", query ? query : @"", host];
+  if (port != 80)
+    [head appendFormat:@":%d", port];
+  [head appendString:@"\r\n"];
+  NSDictionary *headers = [request allHTTPHeaderFields];
+  for (NSString *name in headers) {
+    if ([name caseInsensitiveCompare:@"Host"] == NSOrderedSame ||
+        [name caseInsensitiveCompare:@"Content-Length"] == NSOrderedSame) {
+      continue;
+    }
+    [head appendFormat:@"%@: %@\r\n", name, [headers objectForKey:name]];
+  }
+  if (body.length || [method isEqualToString:@"POST"] ||
+      [method isEqualToString:@"PUT"]) {
+    [head appendFormat:@"Content-Length: %lu\r\n", (unsigned long)body.length];
+  }
+  [head appendString:@"\r\n"];
+
+  NSMutableData *data = [[[head dataUsingEncoding:NSUTF8StringEncoding]
+                          mutableCopy] autorelease];
+  if (body.length)
+    [data appendData:body];
+  return data;
+}
+
+
+// Resolve |host|:|port| with getaddrinfo(3), which blocks. Returns a gai error.
+static int _resolve(NSString *host, int port, struct addrinfo **res) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  char portstr[8];
+  snprintf(portstr, sizeof(portstr), "%d", port);
+  *res = NULL;
+  return getaddrinfo([host UTF8String], portstr, &hints, res);
+}
+
+
+// Start a non-blocking connect to the first usable address in |res|. Returns
+// -1 on failure.
+static int _connect(struct addrinfo *res) {
+  struct addrinfo *ai;
+  int fd = -1;
+  for (ai = res; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd == -1) continue;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    #ifdef SO_NOSIGPIPE
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    #endif
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+// ----------------------------------------------------------------------------
+
+@implementation HDHTTPClient
+
+@synthesize maximumConnectionsPerHost = maximumConnectionsPerHost_,
+            pipeliningDepth = pipeliningDepth_,
+            idleTimeout = idleTimeout_,
+            dispatchQueue = dispatchQueue_;
+
+
++ (HDHTTPClient*)sharedClient {
+  static HDHTTPClient *client = nil;
+  static dispatch_once_t once;
+  dispatch_once(&once, ^{ client = [HDHTTPClient new]; });
+  return client;
+}
+
+
+- (id)init {
+  if ((self = [super init])) {
+    dispatchQueue_ = dispatch_queue_create("se.hunch.hdhttpclient", NULL);
+    pools_ = [NSMutableDictionary new];
+    maximumConnectionsPerHost_ = 4;
+    pipeliningDepth_ = 1;
+    idleTimeout_ = 30.0;
+  }
+  return self;
+}
+
+
+- (void)dealloc {
+  for (_HDHTTPPool *pool in [pools_ allValues]) {
+    for (_HDHTTPConnection *conn in [[pool->connections_ copy] autorelease])
+      [conn close];
+  }
+  [pools_ release];
+  dispatch_release(dispatchQueue_);
+  [super dealloc];
+}
+
+
+- (void)fetch:(NSURLRequest*)request
+    onResponseBlock:(NSError*(^)(NSURLResponse *response))onResponse
+        onDataBlock:(NSError*(^)(NSData *data))onData
+    onCompleteBlock:(void(^)(NSError *err, NSData *data))onComplete {
+  NSURL *url = [request URL];
+  _HDHTTPExchange *ex = [[_HDHTTPExchange new] autorelease];
+  ex->onResponse_ = [onResponse copy];
+  ex->onData_ = [onData copy];
+  ex->onComplete_ = [onComplete copy];
+
+  if (![[[url scheme] lowercaseString] isEqualToString:@"http"] || ![url host]) {
+    dispatch_async(dispatchQueue_, ^{
+      NSAutoreleasePool *pool = [NSAutoreleasePool new];
+      [ex completeWithError:_error(HDHTTPClientErrorUnsupportedURL,
+                                   @"unsupported URL")];
+      [pool drain];
+    });
+    return;
+  }
+
+  NSString *host = [url host];
+  int port = [url port] ? [[url port] intValue] : 80;
+  NSString *method = [request HTTPMethod] ? [request HTTPMethod] : @"GET";
+  ex->url_ = [url retain];
+  ex->requestData_ = [_serialize_request(request, host, port) retain];
+  ex->isHead_ = [method isEqualToString:@"HEAD"];
+  ex->isIdempotent_ = ex->isHead_ || [method isEqualToString:@"GET"];
+
+  dispatch_async(dispatchQueue_, ^{
+    NSAutoreleasePool *arpool = [NSAutoreleasePool new];
+    NSString *key = [NSString stringWithFormat:@"%@:%d", host, port];
+    _HDHTTPPool *pool = [pools_ objectForKey:key];
+    if (!pool) {
+      pool = [[[_HDHTTPPool alloc] initWithHost:host port:port] autorelease];
+      [pools_ setObject:pool forKey:key];
+    }
+    [pool->pending_ addObject:ex];
+    [self _pump:pool];
+    [arpool drain];
+  });
+}
+
+
+- (void)closeIdleConnections {
+  dispatch_async(dispatchQueue_, ^{
+    NSAutoreleasePool *arpool = [NSAutoreleasePool new];
+    for (_HDHTTPPool *pool in [pools_ allValues]) {
+      for (_HDHTTPConnection *conn in [[pool->connections_ copy] autorelease])
+        if ([conn isIdle]) [conn close];
+    }
+    [arpool drain];
+  });
+}
+
+
+// Assign queued exchanges to connections. Must be called on dispatchQueue_.
+- (void)_pump:(_HDHTTPPool*)pool {
+  while (pool->pending_.count) {
+    _HDHTTPExchange *ex = [pool->pending_ objectAtIndex:0];
+    _HDHTTPConnection *conn = nil;
+
+    // 1. an idle connection
+    for (_HDHTTPConnection *c in pool->connections_) {
+      if ([c isIdle]) { conn = c; break; }
+    }
+
+    // 2. a new connection, once the host has been resolved
+    if (!conn && pool->connections_.count < maximumConnectionsPerHost_ &&
+        [self _resolve:pool]) {
+      int fd = _connect(pool->addrinfo_);
+      if (fd == -1) {
+        int code = errno;
+        // resolve again next time in case the host moved
+        [pool setAddrinfo:NULL];
+        [[ex retain] autorelease];
+        [pool->pending_ removeObjectAtIndex:0];
+        [ex completeWithError:_error(HDHTTPClientErrorConnectFailed,
+            [NSString stringWithFormat:@"connect to %@:%d failed: %s",
+             pool->host_, pool->port_, strerror(code)])];
+        continue;
+      }
+      conn = [[_HDHTTPConnection alloc] initWithClient:self pool:pool
+                                        fileDescriptor:fd];
+      [pool->connections_ addObject:conn];
+      [conn release];
+    }
+
+    // 3. pipeline onto the least busy connection
+    if (!conn && pipeliningDepth_ > 1) {
+      for (_HDHTTPConnection *c in pool->connections_) {
+        if ([c canPipeline:ex depth:pipeliningDepth_] &&
+            (!conn || c->inflight_.count < conn->inflight_.count)) {
+          conn = c;
+        }
+      }
+    }
+
+    if (!conn) break; // wait for a connection to become available
+    [conn send:ex];
+    [pool->pending_ removeObjectAtIndex:0];
+  }
+}
+
+
+/*!
+ * Returns YES if |pool| has addresses to connect to. Otherwise starts
+ * resolving its host on a global queue -- getaddrinfo(3) can block for
+ * seconds, which would hold up every connection on our queue -- and pumps the
+ * pool again once done. Must be called on dispatchQueue_.
+ */
+- (BOOL)_resolve:(_HDHTTPPool*)pool {
+  if (pool->addrinfo_ && [NSDate timeIntervalSinceReferenceDate] -
+                         pool->resolvedAt_ < kResolveTTL) {
+    return YES;
+  }
+  if (pool->resolving_)
+    return NO;
+  pool->resolving_ = YES;
+  dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+                 ^{
+    NSAutoreleasePool *arpool = [NSAutoreleasePool new];
+    struct addrinfo *res;
+    int status = _resolve(pool->host_, pool->port_, &res);
+    [arpool drain];
+    dispatch_async(dispatchQueue_, ^{
+      NSAutoreleasePool *arpool = [NSAutoreleasePool new];
+      pool->resolving_ = NO;
+      [pool setAddrinfo:(status == 0 ? res : NULL)];
+      if (status != 0) {
+        // like a failed connect, fail the exchanges waiting for a connection
+        NSError *error = _error(HDHTTPClientErrorConnectFailed,
+            [NSString stringWithFormat:@"could not resolve %@: %s",
+             pool->host_, gai_strerror(status)]);
+        NSArray *failed = [[pool->pending_ copy] autorelease];
+        [pool->pending_ removeAllObjects];
+        for (_HDHTTPExchange *ex in failed)
+          [ex completeWithError:error];
+      }
+      [self _pump:pool];
+      [arpool drain];
+    });
+  });
+  return NO;
+}
+
+
+@end
@@ -3,7 +3,7 @@
 
 #import "HDStream.h"
 #import "HEventEmitter.h"
-@class HDProcess;
+@class HDProcess, HDProcessPipeline, HDShmChannel;
 
 // Block type for process events
 typedef void (^HDProcessBlock)(HDProcess *process);
@@ -50,6 +50,7 @@ typedef void (^HDProcessBlock)(HDProcess *process);
   int exitStatus_;
   BOOL hasSocketpair_;
   NSMutableArray *queuedInput_;
+  HDProcessPipeline *pipeline_; // weak, set while part of a running pipeline
 }
 
 /**
@@ -212,4 +213,102 @@ typedef void (^HDProcessBlock)(HDProcess *process);
  */
 - (HDNamedStream*)openChannel:(NSString*)name onData:(HDStreamBlock)onData;
 
+/**
+ * Create a new bidirectional channel backed by shared memory (see
+ * HDShmChannel.h), with two rings of |ringSize| bytes.
+ *
+ * Works like createChannel: and has the same requirements, except that two
+ * file descriptors are sent in a single message: the shared memory object
+ * followed by the process' end of the doorbell socketpair. See
+ * examples/shm-channel-client.c for how to use them from the process.
+ *
+ * The returned channel is autoreleased and suspended, and is canceled when
+ * the process exits.
+ */
+- (HDShmChannel*)createSharedMemoryChannel:(NSString*)name
+                                  ringSize:(NSUInteger)ringSize;
+
+// createSharedMemoryChannel:ringSize: with 1 MB rings
+- (HDShmChannel*)createSharedMemoryChannel:(NSString*)name;
+
+@end
+
+
+/*!
+ * A pipeline of processes, like "a | b | c" in a shell.
+ *
+ * The standard output of each process is connected directly to the standard
+ * input of the next one using pipes which are handed to the processes when
+ * they are started, so data passing between processes never goes through the
+ * parent process.
+ *
+ * The standard input of the first process, the standard output of the last
+ * process and the standard error of every process are available as usual
+ * through each process' streams (or the shortcuts below). The stdout of all
+ * but the last process and the stdin of all but the first process are not
+ * used, and channels can only be created for the first process.
+ *
+ * Events emitted:
+ *
+ * - "exit" (HDProcessPipeline *self) -- all processes exited
+ *
+ * Example:
+ *
+ *    HDProcessPipeline *pipeline = [HDProcessPipeline pipelineWithProcesses:
+ *        [HDProcess start:@"cat", @"/etc/hosts", nil],
+ *        [HDProcess start:@"grep", @"-v", @"^#", nil],
+ *        [HDProcess start:@"sort", nil], nil];
+ *    pipeline.stdout.onData = ^(const void *bytes, size_t length) {
+ *      // output of sort
+ *    };
+ *    [pipeline on:@"exit", ^(HDProcessPipeline *pipeline){
+ *      NSLog(@"exit code: %d", pipeline.exitStatus);
+ *    }];
+ *    [pipeline start];
+ *
+ */
+@interface HDProcessPipeline : NSObject {
+  NSArray *processes_;
+  volatile int32_t runningCount_;
+  int exitStatus_;
+}
+
+// The processes of the pipeline, in order
+@property(readonly) NSArray *processes;
+
+// Standard input of the first process
+@property(readonly) HDStream *stdin;
+
+// Standard output of the last process
+@property(readonly) HDStream *stdout;
+
+// Standard error of each process, in the same order as |processes|
+@property(readonly) NSArray *stderrStreams;
+
+/*!
+ * Aggregated exit status -- that of the last process which exited with a
+ * non-zero status, or zero if all processes succeeded (like "set -o pipefail"
+ * in bash). -1 until all processes have exited.
+ */
+@property(readonly) int exitStatus;
+
+// True while any of the processes are running
+@property(readonly) BOOL isRunning;
+
+// New autoreleased pipeline of the processes in nil-terminated argument list
++ (HDProcessPipeline*)pipelineWithProcesses:(HDProcess*)firstProcess, ...
+    __attribute__((sentinel));
+
+// Initialize with an array of at least one HDProcess
+- (id)initWithProcesses:(NSArray*)processes;
+
+/*!
+ * Launch all processes. Raises an NSInternalInconsistencyException if any of
+ * the processes are already running.
+ */
+- (void)start;
+
+// Terminate all processes which are still running
+- (void)terminate;
+
 @end
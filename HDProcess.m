@@ -7,6 +7,16 @@
 #define environ (*_NSGetEnviron())
 
 #import "HDProcess.h"
+#import "HDShmChannel.h"
+#import "hcommon.h"
+
+@interface HDProcessPipeline (Private)
+- (void)_processDidExit:(HDProcess*)process;
+@end
+
+@interface HDProcess (Private)
+- (void)_sendSharedMemoryChannel:(HDShmChannel*)channel;
+@end
 
 // FD utils
 
@@ -74,6 +84,11 @@ static void _proc_handle_ev(HDProcess *self) {
 
     [self emitEvent:@"exit" argument:self];
 
+    // let our pipeline know (it keeps a reference to itself while running)
+    HDProcessPipeline *pipeline = self->pipeline_;
+    self->pipeline_ = nil;
+    [pipeline _processDidExit:self];
+
     // release proc sources' reference to self
     [self release];
   }
@@ -209,6 +224,14 @@ static void _proc_handle_ev(HDProcess *self) {
 
 
 - (void)start {
+  [self _startWithStdin:-1 stdout:-1];
+}
+
+
+// Launch the process. If |stdinFd| or |stdoutFd| is not -1, it's used as the
+// process' stdin or stdout instead of a pipe to us. The caller keeps ownership
+// of the file descriptors, which should be close-on-exec.
+- (void)_startWithStdin:(int)stdinFd stdout:(int)stdoutFd {
   // check program
   if (!program_) {
     [NSException raise:NSInvalidArgumentException
@@ -221,18 +244,29 @@ static void _proc_handle_ev(HDProcess *self) {
                 format:@"already running"];
   }
 
+  // channels are sent through our end of stdin
+  if (stdinFd != -1) {
+    if (queuedInput_) {
+      [NSException raise:NSInternalInconsistencyException
+                  format:@"channels require stdin to be connected to us"];
+    }
+    hasSocketpair_ = NO;
+  }
+
   // reset exist status
   exitStatus_ = -1;
 
   // pipes
-  int stdin_pipe[2], stdout_pipe[2], stderr_pipe[2];
-  if (pipe(stdout_pipe) < 0 || pipe(stderr_pipe) < 0) {
+  int stdin_pipe[2] = {-1, -1}, stdout_pipe[2] = {-1, -1}, stderr_pipe[2];
+  if ((stdoutFd == -1 && pipe(stdout_pipe) < 0) || pipe(stderr_pipe) < 0) {
     [NSException raise:NSInternalInconsistencyException
                 format:@"pipe(): %s", strerror(errno)];
   }
 
   // stdin (unix socket if usesSocketStdin_ is true, used for FD delegation)
-  if (hasSocketpair_) {
+  if (stdinFd != -1) {
+    // provided by the caller
+  } else if (hasSocketpair_) {
     if (!_fd_socketpipe(stdin_pipe)) {
       [NSException raise:NSInternalInconsistencyException
                   format:@"socketpair(): %s", strerror(errno)];
@@ -246,8 +280,12 @@ static void _proc_handle_ev(HDProcess *self) {
   }
 
   // set close-on-exec flag
-  _fd_set_closeonexec(stdin_pipe[0]);  _fd_set_closeonexec(stdin_pipe[1]);
-  _fd_set_closeonexec(stdout_pipe[0]); _fd_set_closeonexec(stdout_pipe[1]);
+  if (stdinFd == -1) {
+    _fd_set_closeonexec(stdin_pipe[0]);  _fd_set_closeonexec(stdin_pipe[1]);
+  }
+  if (stdoutFd == -1) {
+    _fd_set_closeonexec(stdout_pipe[0]); _fd_set_closeonexec(stdout_pipe[1]);
+  }
   _fd_set_closeonexec(stderr_pipe[0]); _fd_set_closeonexec(stderr_pipe[1]);
 
   // save environ in the case that we get it clobbered by the child process.
@@ -261,10 +299,18 @@ static void _proc_handle_ev(HDProcess *self) {
     // child
 
     // close parent end of pipes and assign our stdio to our end
-    close(stdin_pipe[1]);  // close write end
-    dup2(stdin_pipe[0],  STDIN_FILENO);
-    close(stdout_pipe[0]);  // close read end
-    dup2(stdout_pipe[1], STDOUT_FILENO);
+    if (stdinFd != -1) {
+      dup2(stdinFd, STDIN_FILENO);
+    } else {
+      close(stdin_pipe[1]);  // close write end
+      dup2(stdin_pipe[0],  STDIN_FILENO);
+    }
+    if (stdoutFd != -1) {
+      dup2(stdoutFd, STDOUT_FILENO);
+    } else {
+      close(stdout_pipe[0]);  // close read end
+      dup2(stdout_pipe[1], STDOUT_FILENO);
+    }
     close(stderr_pipe[0]);  // close read end
     dup2(stderr_pipe[1], STDERR_FILENO);
 
@@ -341,8 +387,10 @@ static void _proc_handle_ev(HDProcess *self) {
   dispatch_resume(procSource_);
 
   // close other end of pipes
-  close(stdin_pipe[0]);//  _fd_set_nonblock(stdin_pipe[1]);
-  close(stdout_pipe[1]);// _fd_set_nonblock(stdout_pipe[0]);
+  if (stdinFd == -1)
+    close(stdin_pipe[0]);//  _fd_set_nonblock(stdin_pipe[1]);
+  if (stdoutFd == -1)
+    close(stdout_pipe[1]);// _fd_set_nonblock(stdout_pipe[0]);
   close(stderr_pipe[1]);// _fd_set_nonblock(stderr_pipe[0]);
 
   // explicitly set dispatchQueue_
@@ -350,22 +398,24 @@ static void _proc_handle_ev(HDProcess *self) {
   stdoutStream_.dispatchQueue = dispatchQueue_;
   stderrStream_.dispatchQueue = dispatchQueue_;
 
-  // setup and resume stdin, stdout and stderr streams
-  HDStream *stdinStream = [stdinStream_
-    copyWithFileDescriptor:stdin_pipe[1] disableReading:YES disableWriting:NO];
-  HDStream *stdoutStream = [stdoutStream_
-    copyWithFileDescriptor:stdout_pipe[0] disableReading:NO disableWriting:YES];
+  // setup and resume stdin, stdout and stderr streams. Streams for file
+  // descriptors provided by the caller are left unopened.
+  id old;
+  if (stdinFd == -1) {
+    HDStream *stdinStream = [stdinStream_
+      copyWithFileDescriptor:stdin_pipe[1] disableReading:YES disableWriting:NO];
+    old = stdinStream_; stdinStream_ = stdinStream; [old release];
+    [stdinStream_ resume];
+  }
+  if (stdoutFd == -1) {
+    HDStream *stdoutStream = [stdoutStream_
+      copyWithFileDescriptor:stdout_pipe[0] disableReading:NO disableWriting:YES];
+    old = stdoutStream_; stdoutStream_ = stdoutStream; [old release];
+    [stdoutStream_ resume];
+  }
   HDStream *stderrStream = [stderrStream_
     copyWithFileDescriptor:stderr_pipe[0] disableReading:NO disableWriting:YES];
-
-  // swap instances
-  id old = stdinStream_; stdinStream_ = stdinStream; [old release];
-  old = stdoutStream_; stdoutStream_ = stdoutStream; [old release];
   old = stderrStream_; stderrStream_ = stderrStream; [old release];
-
-  // make sure they are all in an unsuspended state
-  [stdinStream_ resume];
-  [stdoutStream_ resume];
   [stderrStream_ resume];
 
   // dequeue any queued input
@@ -374,9 +424,12 @@ static void _proc_handle_ev(HDProcess *self) {
       if ([entry isKindOfClass:[NSDictionary class]]) {
         NSNumber *fdn = [entry objectForKey:@"fd"];
         HDNamedStream *channel = [entry objectForKey:@"channel"];
+        HDShmChannel *shmChannel = [entry objectForKey:@"shmChannel"];
         if (fdn && channel && channel.isValid) {
           // channel file descriptor
           [stdinStream_ writeFileDescriptor:[fdn intValue] name:channel.name];
+        } else if (shmChannel && shmChannel.isValid) {
+          [self _sendSharedMemoryChannel:shmChannel];
         }
       }
     }
@@ -419,7 +472,7 @@ static void _proc_handle_ev(HDProcess *self) {
     if (queuedInput_ == nil)
       queuedInput_ = [[NSMutableArray alloc] initWithCapacity:1];
     id entry = [NSDictionary dictionaryWithObjectsAndKeys:
-                [NSNumber numberWithInt:stream.fileDescriptor], @"fd",
+                [NSNumber numberWithInt:fds[1]], @"fd",
                 stream, @"channel", nil];
     [queuedInput_ addObject:entry]; // push back
   } else {
@@ -431,6 +484,53 @@ static void _proc_handle_ev(HDProcess *self) {
 }
 
 
+- (void)_sendSharedMemoryChannel:(HDShmChannel*)channel {
+  int fds[2] = {channel.peerMemoryFileDescriptor,
+                channel.peerDoorbellFileDescriptor};
+  [stdinStream_ writeFileDescriptors:fds count:2 name:channel.name];
+  [channel closePeerFileDescriptors];
+}
+
+
+- (HDShmChannel*)createSharedMemoryChannel:(NSString*)name
+                                  ringSize:(NSUInteger)ringSize {
+  if (!self.isRunning) {
+    hasSocketpair_ = YES;
+  } else if (!hasSocketpair_) {
+    [NSException raise:NSInternalInconsistencyException
+                format:@"underlying stdin stream does not support channels"];
+  }
+
+  HDShmChannel *channel =
+      [[[HDShmChannel alloc] initWithName:name ringSize:ringSize] autorelease];
+  channel.dispatchQueue = dispatchQueue_;
+
+  // register object (canceled when the process exits)
+  if (!channels_) {
+    channels_ = [[NSMutableArray alloc] initWithObjects:channel, nil];
+  } else {
+    [channels_ addObject:channel];
+  }
+
+  // send FDs or enqueue
+  if (!self.isRunning) {
+    if (queuedInput_ == nil)
+      queuedInput_ = [[NSMutableArray alloc] initWithCapacity:1];
+    [queuedInput_ addObject:
+        [NSDictionary dictionaryWithObject:channel forKey:@"shmChannel"]];
+  } else {
+    [self _sendSharedMemoryChannel:channel];
+  }
+
+  return channel;
+}
+
+
+- (HDShmChannel*)createSharedMemoryChannel:(NSString*)name {
+  return [self createSharedMemoryChannel:name ringSize:1024*1024];
+}
+
+
 - (HDNamedStream*)openChannel:(NSString*)name
                               onData:(HDStreamBlock)onData {
   HDNamedStream *stream = [self createChannel:name];
@@ -464,3 +564,145 @@ static void _proc_handle_ev(HDProcess *self) {
 
 
 @end
+
+
+// ----------------------------------------------------------------------------
+
+@implementation HDProcessPipeline
+
+@synthesize processes = processes_,
+            exitStatus = exitStatus_;
+
+
++ (HDProcessPipeline*)pipelineWithProcesses:(HDProcess*)firstProcess, ... {
+  NSMutableArray *processes = [NSMutableArray arrayWithObject:firstProcess];
+  va_list valist;
+  va_start(valist, firstProcess);
+  HDProcess *process;
+  while ((process = va_arg(valist, HDProcess*))) {
+    [processes addObject:process];
+  }
+  va_end(valist);
+  return [[[self alloc] initWithProcesses:processes] autorelease];
+}
+
+
+- (id)initWithProcesses:(NSArray*)processes {
+  if (!processes || [processes count] == 0) {
+    [self release];
+    [NSException raise:NSInvalidArgumentException
+                format:@"a pipeline needs at least one process"];
+  }
+  if ((self = [super init])) {
+    processes_ = [processes copy];
+    exitStatus_ = -1;
+  }
+  return self;
+}
+
+
+- (void)dealloc {
+  [processes_ release];
+  [super dealloc];
+}
+
+
+- (HDStream*)stdin {
+  return [[processes_ objectAtIndex:0] stdin];
+}
+
+- (HDStream*)stdout {
+  return [[processes_ lastObject] stdout];
+}
+
+- (NSArray*)stderrStreams {
+  NSMutableArray *streams = [NSMutableArray arrayWithCapacity:processes_.count];
+  for (HDProcess *process in processes_) {
+    [streams addObject:process.stderr];
+  }
+  return streams;
+}
+
+
+- (BOOL)isRunning {
+  return runningCount_ != 0;
+}
+
+
+- (void)start {
+  for (HDProcess *process in processes_) {
+    if (process.isRunning || process->pipeline_) {
+      [NSException raise:NSInternalInconsistencyException
+                  format:@"%@ is already running", process];
+    }
+  }
+
+  exitStatus_ = -1;
+  runningCount_ = (int32_t)processes_.count;
+  [self retain]; // released when the last process exits
+
+  // Each pipe is created just before the process writing to it is started
+  // and our copies of its ends are closed as soon as the process at each end
+  // has been started, so that only the two processes hold on to it (and the
+  // reader sees EOF when the writer exits).
+  NSUInteger i, count = processes_.count;
+  int readFd = -1;
+  for (i = 0; i < count; i++) {
+    HDProcess *process = [processes_ objectAtIndex:i];
+    int fds[2] = {-1, -1};
+    @try {
+      if (i+1 < count) {
+        if (pipe(fds) < 0) {
+          [NSException raise:NSInternalInconsistencyException
+                      format:@"pipe(): %s", strerror(errno)];
+        }
+        _fd_set_closeonexec(fds[0]);
+        _fd_set_closeonexec(fds[1]);
+      }
+      process->pipeline_ = self;
+      [process _startWithStdin:readFd stdout:fds[1]];
+    } @catch (NSException *e) {
+      process->pipeline_ = nil;
+      if (readFd != -1) close(readFd);
+      if (fds[0] != -1) { close(fds[0]); close(fds[1]); }
+      [self terminate];
+      // processes which did not start will never report their exit
+      if (h_atomic_sub(&runningCount_, (int32_t)(count - i)) == 0)
+        [self release];
+      @throw;
+    }
+    if (readFd != -1) close(readFd);
+    if (fds[1] != -1) close(fds[1]);
+    readFd = fds[0];
+  }
+}
+
+
+- (void)terminate {
+  for (HDProcess *process in processes_) {
+    [process terminate];
+  }
+}
+
+
+- (void)_processDidExit:(HDProcess*)process {
+  if (h_atomic_dec(&runningCount_) != 0)
+    return;
+  int status = 0;
+  for (HDProcess *p in processes_) {
+    if (p.exitStatus != 0)
+      status = p.exitStatus;
+  }
+  exitStatus_ = status;
+  [self emitEvent:@"exit" argument:self];
+  [self release];
+}
+
+
+- (NSString*)description {
+  return [NSString stringWithFormat:@"<%@@%p %@>",
+          NSStringFromClass([self class]), self,
+          [[processes_ valueForKey:@"program"] componentsJoinedByString:@" | "]];
+}
+
+@end
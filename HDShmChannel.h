@@ -0,0 +1,112 @@
+/*!
+ * A message channel to a child process backed by shared memory.
+ *
+ * @discussion
+ * HDShmChannel is the shared memory counterpart of the socketpair channels
+ * created by -[HDProcess createChannel:]. Messages are copied directly into a
+ * pair of single-producer, single-consumer ring buffers in a shared memory
+ * object (memfd on Linux, an unlinked POSIX shared memory object elsewhere)
+ * and received in place, so there's one copy per message and, while both
+ * sides are busy, no system calls at all. A socketpair is used as a doorbell
+ * to wake up a side which ran out of work and went to sleep. See HDShmRing.h
+ * for the memory layout and protocol, and examples/shm-channel-client.c for a
+ * child process implementation.
+ *
+ * Unlike socketpair channels, message boundaries are preserved: each call to
+ * writeBytes:length: results in exactly one call to the peer's onData.
+ *
+ * Channels are usually created with -[HDProcess createSharedMemoryChannel:],
+ * which sends the shared memory object and the child's doorbell to the child
+ * process as two file descriptors in a single SCM_RIGHTS message.
+ *
+ * Events emitted:
+ *
+ * - "close" (HDShmChannel *self) -- the child closed its doorbell (e.g. exited)
+ */
+#import <Foundation/Foundation.h>
+#import <dispatch/dispatch.h>
+#import <libkern/OSAtomic.h>
+#import "HDStream.h"
+
+@interface HDShmChannel : NSObject {
+@public
+  NSString *name_;
+  struct hd_shm_header *shm_;
+  size_t shmSize_;
+  int doorbellFd_;
+  int peerFds_[2]; // shared memory object and the child's doorbell
+  dispatch_queue_t dispatchQueue_;
+  dispatch_source_t doorbellSource_;
+  HDStreamBlock onData_;
+  OSSpinLock writeLock_;
+  NSMutableArray *pendingWrites_; // messages which did not fit in the ring
+  NSUInteger spinCount_;
+  BOOL suspended_;
+  BOOL closed_;
+}
+
+@property(readonly) NSString *name;
+
+/*!
+ * Called with each message received from the child. |bytes| points into the
+ * shared memory, has room for (|length| + 1) bytes and is only valid within
+ * the calling scope. Calls are serial but might happen on any thread.
+ */
+@property(copy) HDStreamBlock onData;
+
+// Queue onData is called on. Defaults to the global normal priority queue.
+@property dispatch_queue_t dispatchQueue;
+
+// Size in bytes of each of the two rings
+@property(readonly) NSUInteger ringSize;
+
+// Largest message which can be written
+@property(readonly) NSUInteger maximumMessageSize;
+
+/*!
+ * Number of times to poll for new messages before going to sleep on the
+ * doorbell. Spinning avoids the doorbell round trip when messages arrive in
+ * quick succession. Defaults to 2000, or 0 on single-CPU systems.
+ */
+@property NSUInteger spinCount;
+
+// True until the channel is canceled or the child closes it
+@property(readonly) BOOL isValid;
+
+/*!
+ * File descriptors to hand to the child process: the shared memory object and
+ * the child's end of the doorbell, or -1 after closePeerFileDescriptors.
+ */
+@property(readonly) int peerMemoryFileDescriptor;
+@property(readonly) int peerDoorbellFileDescriptor;
+
+/*!
+ * Create a channel with two rings of |ringSize| bytes each (rounded up to a
+ * power of two). Raises NSInternalInconsistencyException if the shared memory
+ * could not be created. New channels are suspended.
+ */
+- (id)initWithName:(NSString*)name ringSize:(NSUInteger)ringSize;
+
+// Close our copies of the child's file descriptors after sending them
+- (void)closePeerFileDescriptors;
+
+/*!
+ * Send a message. If the ring is full, the message is copied and sent as soon
+ * as the child has made room (messages are always delivered in order).
+ * Raises NSInvalidArgumentException if |length| exceeds maximumMessageSize.
+ */
+- (void)writeBytes:(const void*)bytes length:(size_t)length;
+
+// Send |data| as one message (retained rather than copied if the ring is full)
+- (void)writeData:(NSData*)data;
+
+// Start or resume delivering messages to onData
+- (void)resume;
+
+// Stop delivering messages (no-op if already suspended)
+- (void)suspend;
+
+// Close the channel. The child sees the doorbell close.
+- (void)cancel;
+
+@end
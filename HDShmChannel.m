@@ -0,0 +1,336 @@
+#import "HDShmChannel.h"
+#import "HDShmRing.h"
+#import "HEventEmitter.h"
+#import "hcommon.h"
+#import <fcntl.h>
+#import <sys/mman.h>
+#import <sys/socket.h>
+#import <unistd.h>
+
+#define RING_OUT HD_SHM_RING_TO_CHILD
+#define RING_IN HD_SHM_RING_TO_PARENT
+
+// Create an anonymous shared memory object of |size| bytes
+static int _shm_create(size_t size) {
+  int fd = -1;
+  #if defined(__linux__) && defined(MFD_CLOEXEC)
+  fd = memfd_create("hdshm", MFD_CLOEXEC);
+  #endif
+  if (fd == -1) {
+    // named object which is unlinked right away
+    static volatile int32_t counter = 0;
+    char name[32];
+    int attempt;
+    for (attempt = 0; attempt < 16 && fd == -1; attempt++) {
+      snprintf(name, sizeof(name), "/hdshm.%d.%d", getpid(),
+               (int)h_atomic_inc(&counter));
+      fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    }
+    if (fd == -1)
+      return -1;
+    shm_unlink(name);
+    int flags = fcntl(fd, F_GETFD, 0);
+    fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+  }
+  if (ftruncate(fd, size) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+#ifndef MSG_NOSIGNAL
+  #define MSG_NOSIGNAL 0 // SO_NOSIGPIPE is set instead
+#endif
+
+static void _ring_doorbell(HDShmChannel *self) {
+  char c = 0;
+  // EAGAIN means there are unread wakeups already, which is just as good.
+  // EPIPE means the child is gone, which the doorbell source notices.
+  while (send(self->doorbellFd_, &c, 1, MSG_NOSIGNAL) < 0 && errno == EINTR) {}
+}
+
+
+// Write as many pending messages as fit. Must be called with writeLock_ held.
+// Returns YES if the child should be woken.
+static BOOL _flush_pending(HDShmChannel *self) {
+  hd_shm_header_t *shm = self->shm_;
+  BOOL wrote = NO;
+  while (self->pendingWrites_.count) {
+    uint32_t tail = hd_shm_ring_tail(shm, RING_OUT);
+    NSData *data = [self->pendingWrites_ objectAtIndex:0];
+    if (hd_shm_ring_write(shm, RING_OUT, data.bytes, (uint32_t)data.length)) {
+      [self->pendingWrites_ removeObjectAtIndex:0];
+      wrote = YES;
+    } else if (hd_shm_ring_prepare_wait(shm, RING_OUT, tail)) {
+      // the child rings the doorbell when it has made room
+      break;
+    }
+  }
+  return wrote && hd_shm_ring_should_wake_reader(shm, RING_OUT);
+}
+
+
+// Pass a message to onData and release it from the ring
+static void _deliver(HDShmChannel *self, char *bytes, uint32_t length,
+                     uint32_t next) {
+  if (self->onData_) {
+    @try {
+      self->onData_(bytes, length);
+    } @catch (NSException * e) {
+      NSLog(@"%@: exception while invoking callback: %@", self, e);
+    }
+  }
+  if (hd_shm_ring_consume(self->shm_, RING_IN, next))
+    _ring_doorbell(self);
+}
+
+
+static void _doorbell(HDShmChannel *self) {
+  NSAutoreleasePool *pool = [NSAutoreleasePool new];
+  hd_shm_header_t *shm = self->shm_;
+  uint32_t length, next;
+  char *bytes;
+
+  // drain the doorbell
+  char buf[64];
+  ssize_t n;
+  while ((n = read(self->doorbellFd_, buf, sizeof(buf))) > 0) {}
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+    // the child closed its end, but messages it wrote before that are still
+    // in the ring
+    while ((bytes = hd_shm_ring_peek(shm, RING_IN, &length, &next)))
+      _deliver(self, bytes, length, next);
+    dispatch_source_cancel(self->doorbellSource_);
+    [self emitEvent:@"close" argument:self];
+    [pool drain];
+    return;
+  }
+
+  // messages waiting for room
+  if (self->pendingWrites_.count) {
+    OSSpinLockLock(&self->writeLock_);
+    BOOL wake = _flush_pending(self);
+    OSSpinLockUnlock(&self->writeLock_);
+    if (wake) _ring_doorbell(self);
+  }
+
+  // deliver messages until the ring stays empty. The doorbell is only rung
+  // once we have announced that we're going to sleep, so there is never
+  // anything left in the ring when we return.
+  NSUInteger spins = 0;
+  while (1) {
+    bytes = hd_shm_ring_peek(shm, RING_IN, &length, &next);
+    if (bytes) {
+      spins = 0;
+      _deliver(self, bytes, length, next);
+    } else if (spins++ < self->spinCount_) {
+      #if defined(__x86_64__) || defined(__i386__)
+      __asm__ __volatile__("pause");
+      #endif
+    } else if (hd_shm_ring_prepare_sleep(shm, RING_IN)) {
+      break;
+    }
+  }
+
+  [pool drain];
+}
+
+
+static void _doorbell_finalize(HDShmChannel *self) {
+  self->closed_ = YES;
+  self->shm_->closed = 1;
+  close(self->doorbellFd_);
+  self->doorbellFd_ = -1;
+
+  dispatch_source_t oldSource = self->doorbellSource_;
+  if (h_casptr(&self->doorbellSource_, oldSource, nil))
+    dispatch_release(oldSource);
+
+  [self release];
+}
+
+// ----------------------------------------------------------------------------
+
+@implementation HDShmChannel
+
+@synthesize name = name_, onData = onData_, spinCount = spinCount_;
+
+
+- (id)initWithName:(NSString*)name ringSize:(NSUInteger)ringSize {
+  if (!(self = [super init])) return nil;
+  name_ = [name copy];
+  doorbellFd_ = peerFds_[0] = peerFds_[1] = -1;
+  writeLock_ = OS_SPINLOCK_INIT;
+  pendingWrites_ = [[NSMutableArray alloc] init];
+  spinCount_ = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? 2000 : 0;
+  suspended_ = YES;
+  dispatchQueue_ =
+      dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+
+  uint32_t size = 64;
+  while (size < ringSize && size < (1u << 30))
+    size <<= 1;
+  shmSize_ = hd_shm_size(size);
+
+  int fds[2];
+  int memfd = _shm_create(shmSize_);
+  if (memfd == -1 || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    int e = errno;
+    if (memfd != -1) close(memfd);
+    [self release];
+    [NSException raise:NSInternalInconsistencyException
+                format:@"shared memory channel: %s", strerror(e)];
+  }
+  shm_ = (hd_shm_header_t*)mmap(NULL, shmSize_, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, memfd, 0);
+  if (shm_ == MAP_FAILED) {
+    int e = errno;
+    shm_ = NULL;
+    close(memfd); close(fds[0]); close(fds[1]);
+    [self release];
+    [NSException raise:NSInternalInconsistencyException
+                format:@"mmap(): %s", strerror(e)];
+  }
+  hd_shm_init(shm_, size);
+  // nobody is delivering messages until the doorbell rings
+  shm_->rings[RING_IN].readerSleeping = 1;
+
+  doorbellFd_ = fds[0];
+  peerFds_[0] = memfd;
+  peerFds_[1] = fds[1];
+  int flags = fcntl(doorbellFd_, F_GETFL, 0);
+  fcntl(doorbellFd_, F_SETFL, flags | O_NONBLOCK);
+  flags = fcntl(doorbellFd_, F_GETFD, 0);
+  fcntl(doorbellFd_, F_SETFD, flags | FD_CLOEXEC);
+  #ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(doorbellFd_, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+  #endif
+  flags = fcntl(peerFds_[1], F_GETFD, 0);
+  fcntl(peerFds_[1], F_SETFD, flags | FD_CLOEXEC);
+
+  doorbellSource_ = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ,
+                                           doorbellFd_, 0, dispatchQueue_);
+  dispatch_source_set_event_handler_f(doorbellSource_,
+                                      (dispatch_function_t)&_doorbell);
+  dispatch_source_set_cancel_handler_f(doorbellSource_,
+                                       (dispatch_function_t)&_doorbell_finalize);
+  dispatch_set_context(doorbellSource_, [self retain]); // released by ^
+  return self;
+}
+
+
+- (void)dealloc {
+  // the doorbell source holds a reference to us until it's been canceled, so
+  // it's gone by now (unless init failed)
+  assert(doorbellSource_ == nil);
+  [self closePeerFileDescriptors];
+  if (doorbellFd_ != -1) close(doorbellFd_);
+  if (shm_) munmap(shm_, shmSize_);
+  [pendingWrites_ release];
+  [onData_ release];
+  [name_ release];
+  dispatch_release(dispatchQueue_); // no effect if its a global shared queue
+  [super dealloc];
+}
+
+
+- (dispatch_queue_t)dispatchQueue { return dispatchQueue_; }
+
+- (void)setDispatchQueue:(dispatch_queue_t)queue {
+  dispatch_queue_t old = dispatchQueue_;
+  dispatchQueue_ = queue;
+  if (dispatchQueue_) {
+    dispatch_retain(dispatchQueue_);
+  } else {
+    dispatchQueue_ =
+        dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+  }
+  if (doorbellSource_) dispatch_set_target_queue(doorbellSource_, dispatchQueue_);
+  if (old) dispatch_release(old);
+}
+
+
+- (NSUInteger)ringSize { return shm_->ringSize; }
+- (NSUInteger)maximumMessageSize { return hd_shm_max_message(shm_); }
+- (BOOL)isValid { return !closed_ && !shm_->closed; }
+- (int)peerMemoryFileDescriptor { return peerFds_[0]; }
+- (int)peerDoorbellFileDescriptor { return peerFds_[1]; }
+
+
+- (void)closePeerFileDescriptors {
+  if (peerFds_[0] != -1) { close(peerFds_[0]); peerFds_[0] = -1; }
+  if (peerFds_[1] != -1) { close(peerFds_[1]); peerFds_[1] = -1; }
+}
+
+
+- (void)_write:(const void*)bytes length:(size_t)length data:(NSData*)data {
+  if (length > hd_shm_max_message(shm_)) {
+    [NSException raise:NSInvalidArgumentException
+                format:@"message of %zu bytes exceeds maximumMessageSize (%u)",
+                       length, hd_shm_max_message(shm_)];
+  }
+  if (!self.isValid)
+    return;
+  BOOL wake;
+  OSSpinLockLock(&writeLock_);
+  if (pendingWrites_.count == 0 &&
+      hd_shm_ring_write(shm_, RING_OUT, bytes, (uint32_t)length)) {
+    wake = hd_shm_ring_should_wake_reader(shm_, RING_OUT);
+  } else {
+    // ring is full -- keep the message until the child has made room
+    [pendingWrites_ addObject:data ? data :
+                    [NSData dataWithBytes:bytes length:length]];
+    wake = _flush_pending(self);
+  }
+  OSSpinLockUnlock(&writeLock_);
+  if (wake)
+    _ring_doorbell(self);
+}
+
+
+- (void)writeBytes:(const void*)bytes length:(size_t)length {
+  [self _write:bytes length:length data:nil];
+}
+
+
+- (void)writeData:(NSData*)data {
+  [self _write:data.bytes length:data.length data:data];
+}
+
+
+- (void)resume {
+  // messages which arrived while suspended have rung the doorbell, so the
+  // source fires as soon as it's resumed
+  if (suspended_ && doorbellSource_) {
+    suspended_ = NO;
+    dispatch_resume(doorbellSource_);
+  }
+}
+
+
+- (void)suspend {
+  if (!suspended_ && doorbellSource_) {
+    suspended_ = YES;
+    dispatch_suspend(doorbellSource_);
+  }
+}
+
+
+- (void)cancel {
+  if (doorbellSource_ && !closed_) {
+    dispatch_source_cancel(doorbellSource_);
+    [self resume];
+  }
+}
+
+
+- (NSString*)description {
+  return [NSString stringWithFormat:@"<%@@%p '%@'%@>",
+          NSStringFromClass([self class]), self, name_,
+          self.isValid ? @"" : @" closed"];
+}
+
+@end
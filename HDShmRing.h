@@ -0,0 +1,212 @@
+/*!
+ * Layout and operations of the shared memory used by HDShmChannel.
+ *
+ * @discussion
+ * This is a plain C header so that child processes written in C (see
+ * examples/shm-channel-client.c) can use it directly.
+ *
+ * The shared memory object starts with a hd_shm_header_t which is followed by
+ * the data of two single-producer, single-consumer ring buffers: ring 0
+ * carries messages from the parent to the child and ring 1 from the child to
+ * the parent.
+ *
+ * Each message is stored contiguously as an 8 byte record header (the payload
+ * length) followed by the payload, padded to a multiple of 8 bytes with at
+ * least one byte to spare (so receivers can null-terminate in place). A
+ * record which does not fit before the end of the ring is preceded by a
+ * HD_SHM_RING_WRAP marker and placed at the start of the ring instead.
+ *
+ * Positions are free-running 32-bit byte counters. The producer only writes
+ * |head| and the consumer only writes |tail|, so no locks are involved.
+ *
+ * Each side also has a doorbell -- one end of a socketpair -- which is only
+ * written to when the peer has announced that it's going to sleep
+ * (|readerSleeping| or |writerWaiting|). While both sides are busy, messages
+ * are exchanged without any system calls. A wakeup means "look at both
+ * rings", and the bytes written to the doorbell carry no meaning.
+ */
+#ifndef HD_SHM_RING_H_
+#define HD_SHM_RING_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define HD_SHM_RING_MAGIC 0x48445352u /* "HDSR" */
+#define HD_SHM_RING_VERSION 1
+#define HD_SHM_RING_WRAP 0xffffffffu
+
+#define HD_SHM_RING_TO_CHILD 0
+#define HD_SHM_RING_TO_PARENT 1
+
+typedef struct hd_shm_ring {
+  volatile uint32_t head;            // written by the producer
+  volatile uint32_t writerWaiting;   // producer waits for space
+  char pad0[56];
+  volatile uint32_t tail;            // written by the consumer
+  volatile uint32_t readerSleeping;  // consumer waits for messages
+  char pad1[56];
+} hd_shm_ring_t;
+
+typedef struct hd_shm_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t ringSize;                 // data bytes per ring (power of two)
+  volatile uint32_t closed;          // set by either side when closing
+  char pad[48];
+  hd_shm_ring_t rings[2];
+} hd_shm_header_t;
+
+// Total size of a shared memory object with rings of |ringSize| bytes
+static inline size_t hd_shm_size(uint32_t ringSize) {
+  return sizeof(hd_shm_header_t) + 2 * (size_t)ringSize;
+}
+
+// Initialize a new (zero-filled) shared memory object
+static inline void hd_shm_init(hd_shm_header_t *h, uint32_t ringSize) {
+  h->ringSize = ringSize;
+  h->version = HD_SHM_RING_VERSION;
+  __atomic_store_n(&h->magic, HD_SHM_RING_MAGIC, __ATOMIC_RELEASE);
+}
+
+// Check that |h| of |size| bytes was set up by hd_shm_init
+static inline int hd_shm_valid(const hd_shm_header_t *h, size_t size) {
+  return size >= sizeof(hd_shm_header_t) &&
+         __atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) == HD_SHM_RING_MAGIC &&
+         h->version == HD_SHM_RING_VERSION &&
+         h->ringSize >= 64 && (h->ringSize & (h->ringSize - 1)) == 0 &&
+         hd_shm_size(h->ringSize) <= size;
+}
+
+static inline char *hd_shm_ring_data(hd_shm_header_t *h, int ring) {
+  return (char*)(h + 1) + (size_t)ring * h->ringSize;
+}
+
+// Bytes used by a record with a payload of |length| bytes
+static inline uint32_t hd_shm_record_size(uint32_t length) {
+  return 8 + ((length + 1 + 7) & ~7u);
+}
+
+// Largest payload which can be written to a ring of |h|
+static inline uint32_t hd_shm_max_message(const hd_shm_header_t *h) {
+  return h->ringSize / 2 - 16;
+}
+
+/*!
+ * Append a message to |ring| (producer side). Returns 1 on success, 0 if
+ * there's not enough room at the moment and -1 if |length| is larger than
+ * hd_shm_max_message.
+ */
+static inline int hd_shm_ring_write(hd_shm_header_t *h, int ring,
+                                    const void *bytes, uint32_t length) {
+  if (length > hd_shm_max_message(h))
+    return -1;
+  hd_shm_ring_t *r = &h->rings[ring];
+  char *data = hd_shm_ring_data(h, ring);
+  uint32_t size = h->ringSize;
+  uint32_t need = hd_shm_record_size(length);
+  uint32_t head = r->head;
+  uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  uint32_t idx = head & (size - 1);
+  uint32_t contiguous = size - idx;
+  uint32_t total = need <= contiguous ? need : contiguous + need;
+  if (size - (head - tail) < total)
+    return 0;
+  if (need > contiguous) {
+    *(uint32_t*)(data + idx) = HD_SHM_RING_WRAP;
+    head += contiguous;
+    idx = 0;
+  }
+  *(uint32_t*)(data + idx) = length;
+  memcpy(data + idx + 8, bytes, length);
+  __atomic_store_n(&r->head, head + need, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/*!
+ * Peek at the oldest message in |ring| (consumer side). Returns a pointer to
+ * the payload, which has room for (*length + 1) bytes and stays valid until
+ * hd_shm_ring_consume is called with the value stored in |next|. Returns NULL
+ * if the ring is empty.
+ */
+static inline char *hd_shm_ring_peek(hd_shm_header_t *h, int ring,
+                                     uint32_t *length, uint32_t *next) {
+  hd_shm_ring_t *r = &h->rings[ring];
+  char *data = hd_shm_ring_data(h, ring);
+  uint32_t size = h->ringSize;
+  uint32_t tail = r->tail;
+  uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  if (tail == head)
+    return NULL;
+  uint32_t idx = tail & (size - 1);
+  uint32_t len = *(uint32_t*)(data + idx);
+  if (len == HD_SHM_RING_WRAP) {
+    tail += size - idx;
+    idx = 0;
+    len = *(uint32_t*)data;
+  }
+  if (len > hd_shm_max_message(h))
+    return NULL; // corrupt
+  *length = len;
+  *next = tail + hd_shm_record_size(len);
+  return data + idx + 8;
+}
+
+/*!
+ * Release messages up to |next| (consumer side). Returns 1 if the producer is
+ * waiting for space and should be woken through the doorbell.
+ */
+static inline int hd_shm_ring_consume(hd_shm_header_t *h, int ring,
+                                      uint32_t next) {
+  hd_shm_ring_t *r = &h->rings[ring];
+  __atomic_store_n(&r->tail, next, __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&r->writerWaiting, __ATOMIC_SEQ_CST) &&
+         __sync_bool_compare_and_swap(&r->writerWaiting, 1, 0);
+}
+
+/*!
+ * Call after one or more hd_shm_ring_write (producer side). Returns 1 if the
+ * consumer is sleeping and should be woken through the doorbell.
+ */
+static inline int hd_shm_ring_should_wake_reader(hd_shm_header_t *h, int ring) {
+  hd_shm_ring_t *r = &h->rings[ring];
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return __atomic_load_n(&r->readerSleeping, __ATOMIC_SEQ_CST) &&
+         __sync_bool_compare_and_swap(&r->readerSleeping, 1, 0);
+}
+
+/*!
+ * Announce that the consumer of |ring| is going to wait on its doorbell.
+ * Returns 0 (and cancels the announcement) if messages arrived meanwhile.
+ */
+static inline int hd_shm_ring_prepare_sleep(hd_shm_header_t *h, int ring) {
+  hd_shm_ring_t *r = &h->rings[ring];
+  __atomic_store_n(&r->readerSleeping, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) != r->tail) {
+    __atomic_store_n(&r->readerSleeping, 0, __ATOMIC_SEQ_CST);
+    return 0;
+  }
+  return 1;
+}
+
+/*!
+ * Announce that the producer of |ring| is going to wait for space after
+ * hd_shm_ring_write returned 0. Returns 0 (and cancels the announcement) if
+ * the consumer made room meanwhile, in which case the write should be retried.
+ */
+static inline int hd_shm_ring_prepare_wait(hd_shm_header_t *h, int ring,
+                                           uint32_t tailSeen) {
+  hd_shm_ring_t *r = &h->rings[ring];
+  __atomic_store_n(&r->writerWaiting, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) != tailSeen) {
+    __atomic_store_n(&r->writerWaiting, 0, __ATOMIC_SEQ_CST);
+    return 0;
+  }
+  return 1;
+}
+
+// Current consumer position of |ring|, for hd_shm_ring_prepare_wait
+static inline uint32_t hd_shm_ring_tail(hd_shm_header_t *h, int ring) {
+  return __atomic_load_n(&h->rings[ring].tail, __ATOMIC_ACQUIRE);
+}
+
+#endif // HD_SHM_RING_H_
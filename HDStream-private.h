@@ -0,0 +1,168 @@
+/*!
+ * Internals shared by HDStream and its subclasses. Not part of the public
+ * interface -- only import this from HDStream implementation files.
+ */
+#import "HDStream.h"
+#import "HDStreamTransform.h"
+#import "HDBufferPool.h"
+#import "HEventEmitter.h"
+#import "hatomic.h"
+
+// ----------------------------------------------------------------------------
+// flags
+
+enum { // [0-31]
+  kFlagSuspended = 0,
+  kFlagSuspendedWrite,
+  kFlagReadable,
+  kFlagWritable,
+  kFlagCloseEmitted,
+};
+
+// types are: volatile uint32_t *flags, uint32_t flag
+
+// Set |flag| in |flags| unless already set. Returns true if set.
+#define HAFLAG_SET(flags, flag) !OSAtomicTestAndSetBarrier(flag, flags)
+
+// Clear |flag| in |flags| if set. Returns false if |flag| was not set (no-op).
+#define HAFLAG_CLEAR(flags, flag) OSAtomicTestAndClearBarrier(flag, flags)
+
+// Test if |flag| is set in |flags|. True if set.
+#define HAFLAG_TEST(flags, flag) \
+  (!!(  ( *((char*)(flags)+((flag) >> 3)) ) & (0x80 >> ((flag) & 7))  ))
+
+
+// instance-local macros
+#define FLAG_SET(flag) HAFLAG_SET(&flags_, flag)
+#define FLAG_CLEAR(flag) HAFLAG_CLEAR(&flags_, flag)
+#define FLAG_TEST(flag) HAFLAG_TEST(&flags_, flag)
+
+// ----------------------------------------------------------------------------
+// Write buffer chain
+
+typedef struct wbuf {
+  struct wbuf *next; // a more recent buffer (closer to wbufHead_)
+  NSData *data;
+  size_t offset;
+  NSData *address; // destination sockaddr (datagram streams only) or nil
+} wbuf_t;
+
+// Allocate a new wbuf_t retaining |data| and |address| (which may be nil)
+static inline wbuf_t *wbuf_alloc(NSData *data, NSData *address) {
+  wbuf_t *wbuf = CFAllocatorAllocate(NULL, sizeof(wbuf_t), 0);
+  wbuf->data = [data retain];
+  wbuf->next = NULL;
+  wbuf->offset = 0;
+  wbuf->address = [address retain];
+  return wbuf;
+}
+
+// Release the contents of and deallocate |wbuf|
+static inline void wbuf_free(wbuf_t *wbuf) {
+  [wbuf->data release];
+  [wbuf->address release];
+  CFAllocatorDeallocate(NULL, wbuf);
+}
+
+// ----------------------------------------------------------------------------
+// Events
+
+// An NSError in NSPOSIXErrorDomain for the errno value |code|
+static inline NSError *hd_posix_error(int code) {
+  return [NSError errorWithDomain:NSPOSIXErrorDomain code:code userInfo:nil];
+}
+
+// Emit "error" with |error|. Must be followed by closing the stream.
+static inline void hd_stream_emit_error(HDStream *self, NSError *error) {
+  [self emitEvent:@"error", self, error, nil];
+}
+
+// Emit "close" unless it has already been emitted
+static inline void hd_stream_emit_close(HDStream *self) {
+  if (HAFLAG_SET(&(self->flags_), kFlagCloseEmitted))
+    [self emitEvent:@"close" argument:self];
+}
+
+// ----------------------------------------------------------------------------
+// Read delivery
+
+/*!
+ * Pass |length| bytes read from the stream to onSlice_ and onData_, through
+ * readTransform_ if set. |slice| is the slice holding |bytes|, or nil if
+ * |bytes| live elsewhere, in which case they are copied into a slice for
+ * onSlice_. A |length| of zero means EOF and finishes the transform. Returns
+ * the transform's error if it failed, in which case the caller should emit it
+ * and close the stream, or nil.
+ */
+static inline NSError *hd_stream_deliver(HDStream *self, const void *bytes,
+                                         size_t length, HDSlice *slice) {
+  HDStreamBlock onData = self->onData_;
+  HDSliceBlock onSlice = self->onSlice_;
+  id<HDStreamTransform> transform = self->readTransform_;
+  if (!transform) {
+    if (onSlice)
+      onSlice(slice ? slice : [HDSlice sliceWithBytes:bytes length:length]);
+    if (onData)
+      onData(bytes, length);
+    return nil;
+  }
+  HDStreamBlock output = onData;
+  if (onSlice) {
+    // transform output lives in the transform's own buffer
+    output = ^(const void *b, size_t n) {
+      onSlice([HDSlice sliceWithBytes:b length:n]);
+      if (onData)
+        onData(b, n);
+    };
+  } else if (!onData) {
+    output = ^(const void *b, size_t n) {};
+  }
+  NSError *error = [transform transformBytes:bytes length:length
+                                      finish:(length == 0) output:output];
+  if (error) {
+    NSLog(@"%@: read transform: %@ -- closing the file descriptor", self,
+          [error localizedDescription]);
+  }
+  return error;
+}
+
+// ----------------------------------------------------------------------------
+// I/O backends
+//
+// A stream with a non-NULL |backend_| does not use dispatch sources. Instead,
+// these functions are called at the corresponding points in the stream's life.
+
+#if !defined(HD_USE_URING) && defined(__linux__) && defined(__has_include)
+  #if __has_include(<liburing.h>)
+    #define HD_USE_URING 1
+  #endif
+#endif
+
+typedef struct hd_io_backend {
+  HDStreamIOBackend type;
+  BOOL (*isAvailable)(void);
+  void (*resume)(HDStream *self);  // start or continue reading and writing
+  void (*suspend)(HDStream *self); // stop submitting new reads and writes
+  void (*cancel)(HDStream *self);  // close the stream once I/O has drained
+  void (*write)(HDStream *self);   // wbufs were appended to the chain
+  void (*dispose)(HDStream *self); // free |backendContext_| (from dealloc)
+} hd_io_backend_t;
+
+#if HD_USE_URING
+extern const hd_io_backend_t hd_uring_backend; // HDStream-uring.m
+#endif
+
+// ----------------------------------------------------------------------------
+
+@interface HDStream (Private)
+// Backend to use for new instances (NULL for dispatch sources). HDStream
+// subclasses which install their own dispatch source handlers return NULL.
++ (const hd_io_backend_t*)_IOBackend;
+// Create the read/write dispatch sources. Subclasses may override these to
+// install their own event handlers.
+- (void)_createReadSource;
+- (void)_createWriteSource;
+// Append |wbuf| to the write buffer chain, creating or resuming the write source
+// as needed. Takes ownership of |wbuf|.
+- (void)_enqueueWriteBuffer:(wbuf_t*)wbuf;
+@end
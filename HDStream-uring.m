@@ -0,0 +1,547 @@
+/*
+ * io_uring backend for HDStream (Linux only, requires liburing).
+ *
+ * All streams share one ring. Submissions are serialized by a mutex while
+ * completions are reaped on a private serial dispatch queue which is woken by
+ * an eventfd registered with the ring. Read completions are delivered to the
+ * stream's own dispatch queue, so |onData| and the "close" event are emitted
+ * just like with dispatch sources.
+ *
+ * Each stream has at most one read and one write in flight. Reads go into
+ * registered (fixed) buffers when one is available, or into a slice from the
+ * shared HDBufferPool otherwise. Streams with an onSlice consumer always read
+ * into slices, which are then handed over as is. Since HDStream file
+ * descriptors are non-blocking, a read or write which would block is turned
+ * into a POLL_ADD followed by a retry.
+ */
+#import "HDStream-private.h"
+
+#if HD_USE_URING
+
+#import "HEventEmitter.h"
+#import "hcommon.h"
+#import <liburing.h>
+#import <sys/eventfd.h>
+#import <poll.h>
+#import <pthread.h>
+
+#define kRingEntries 1024
+#define kRegisteredBufferCount 64
+#define kRegisteredBufferSize (64*1024)
+
+typedef struct hd_uring_op hd_uring_op_t;
+
+struct hd_uring_op {
+  void (*complete)(hd_uring_op_t *op); // called on the reap queue
+  HDStream *stream;
+  int res;        // result of the completed operation
+  BOOL polling;   // waiting for readiness rather than transferring data
+  int bufIndex;   // registered buffer in use, or -1
+  void *buf;      // buffer in use (registered or |slice|)
+  HDSlice *slice; // pooled buffer in use, or nil
+};
+
+typedef struct hd_uring_ctx {
+  hd_uring_op_t readOp;
+  hd_uring_op_t writeOp;
+  volatile int32_t inflight;  // submitted ops which have not been handled
+  volatile int32_t reading;   // owner of readOp
+  volatile int32_t writing;   // owner of writeOp
+  volatile int32_t canceled;
+  volatile int32_t finalized;
+} hd_uring_ctx_t;
+
+// shared ring
+static struct io_uring gRing;
+static BOOL gAvailable = NO;
+static int gEventFD = -1;
+static dispatch_queue_t gReapQueue;
+static dispatch_source_t gReapSource;
+
+// guards the submission queue and the registered buffer free list
+static pthread_mutex_t gSubmitLock = PTHREAD_MUTEX_INITIALIZER;
+static char *gBuffers = NULL;
+static int gFreeBuffers[kRegisteredBufferCount];
+static int gFreeBufferCount = 0;
+
+static void _read_complete(hd_uring_op_t *op);
+static void _write_complete(hd_uring_op_t *op);
+static void _submit_read(HDStream *self, hd_uring_ctx_t *ctx);
+static void _submit_write(HDStream *self, hd_uring_ctx_t *ctx);
+
+// ----------------------------------------------------------------------------
+// Ring
+
+
+static void _ring_reap(void *unused) {
+  uint64_t count;
+  read(gEventFD, &count, sizeof(count));
+  struct io_uring_cqe *cqe;
+  while (io_uring_peek_cqe(&gRing, &cqe) == 0) {
+    hd_uring_op_t *op = (hd_uring_op_t*)io_uring_cqe_get_data(cqe);
+    int res = cqe->res;
+    io_uring_cqe_seen(&gRing, cqe);
+    if (op) { // cancel requests have no op
+      op->res = res;
+      op->complete(op);
+    }
+  }
+}
+
+
+static void _ring_init(void *unused) {
+  if (io_uring_queue_init(kRingEntries, &gRing, 0) != 0)
+    return;
+
+  // Registered buffers are an optimization -- if we can't pin them (e.g. due
+  // to RLIMIT_MEMLOCK) we just read into heap buffers instead.
+  struct iovec iov[kRegisteredBufferCount];
+  gBuffers = (char*)valloc(kRegisteredBufferCount * kRegisteredBufferSize);
+  int i;
+  for (i = 0; i < kRegisteredBufferCount; i++) {
+    iov[i].iov_base = gBuffers + (i * kRegisteredBufferSize);
+    iov[i].iov_len = kRegisteredBufferSize;
+  }
+  if (io_uring_register_buffers(&gRing, iov, kRegisteredBufferCount) == 0) {
+    for (i = 0; i < kRegisteredBufferCount; i++)
+      gFreeBuffers[gFreeBufferCount++] = i;
+  } else {
+    free(gBuffers);
+    gBuffers = NULL;
+  }
+
+  gEventFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (gEventFD == -1 || io_uring_register_eventfd(&gRing, gEventFD) != 0) {
+    if (gEventFD != -1) close(gEventFD);
+    io_uring_queue_exit(&gRing);
+    return;
+  }
+
+  gReapQueue = dispatch_queue_create("se.hunch.hdstream.uring", NULL);
+  gReapSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, gEventFD, 0,
+                                       gReapQueue);
+  dispatch_source_set_event_handler_f(gReapSource, &_ring_reap);
+  dispatch_resume(gReapSource);
+  gAvailable = YES;
+}
+
+
+static BOOL _uring_is_available(void) {
+  static dispatch_once_t once;
+  dispatch_once_f(&once, NULL, &_ring_init);
+  return gAvailable;
+}
+
+
+// Get a SQE, flushing the submission queue if it's full. Caller must hold
+// gSubmitLock.
+static struct io_uring_sqe *_sqe_get(void) {
+  struct io_uring_sqe *sqe;
+  while (!(sqe = io_uring_get_sqe(&gRing)))
+    io_uring_submit(&gRing);
+  return sqe;
+}
+
+// ----------------------------------------------------------------------------
+// Stream context
+
+
+// Emit "close" on the stream's queue and drop the reference held by _ctx
+static void _finalized(HDStream *self) {
+  NSAutoreleasePool *pool = [NSAutoreleasePool new];
+  hd_stream_emit_close(self);
+  [pool drain];
+  [self release]; // retained by _ctx
+}
+
+
+static void _finalize(HDStream *self, hd_uring_ctx_t *ctx) {
+  if (!h_atomic_cas(&ctx->finalized, 0, 1))
+    return;
+  close(self->fd_);
+  self->fd_ = -1;
+
+  // discard anything which was never written
+  OSSpinLockLock(&(self->writeSpinLock_));
+  wbuf_t *wbuf = self->wbufTail_;
+  self->wbufTail_ = self->wbufHead_ = NULL;
+  OSSpinLockUnlock(&(self->writeSpinLock_));
+  while (wbuf) {
+    wbuf_t *next = wbuf->next;
+    wbuf_free(wbuf);
+    wbuf = next;
+  }
+
+  // we might be on the reap queue, but events are emitted on the stream's
+  dispatch_async_f(self->dispatchQueue_, self,
+                   (dispatch_function_t)&_finalized);
+}
+
+
+static hd_uring_ctx_t *_ctx(HDStream *self) {
+  hd_uring_ctx_t *ctx = (hd_uring_ctx_t*)self->backendContext_;
+  if (ctx) return ctx;
+  ctx = (hd_uring_ctx_t*)calloc(1, sizeof(hd_uring_ctx_t));
+  ctx->readOp.complete = &_read_complete;
+  ctx->readOp.stream = self;
+  ctx->readOp.bufIndex = -1;
+  ctx->writeOp.complete = &_write_complete;
+  ctx->writeOp.stream = self;
+  ctx->writeOp.bufIndex = -1;
+  if (!h_casptr(&self->backendContext_, NULL, ctx)) {
+    free(ctx); // someone beat us to it
+    return (hd_uring_ctx_t*)self->backendContext_;
+  }
+  // in-flight I/O keeps the stream alive until it's canceled, just like a
+  // dispatch source would
+  [self retain];
+  return ctx;
+}
+
+
+// Account for a new submission. Returns NO if the stream has been canceled.
+static BOOL _op_begin(hd_uring_ctx_t *ctx) {
+  h_atomic_inc(&ctx->inflight);
+  if (ctx->canceled) {
+    h_atomic_dec(&ctx->inflight);
+    return NO;
+  }
+  return YES;
+}
+
+
+// A submission has been handled completely
+static void _op_end(HDStream *self, hd_uring_ctx_t *ctx) {
+  if (h_atomic_dec(&ctx->inflight) == 0 && ctx->canceled)
+    _finalize(self, ctx);
+}
+
+
+/*
+ * Called with gSubmitLock held, after _op_begin and before submitting. If the
+ * stream was canceled in between, _uring_cancel might already have submitted
+ * its cancel requests, which would miss the op we're about to submit -- so we
+ * back out instead. Releases gSubmitLock and |owner| if so.
+ */
+static BOOL _canceled_before_submit(HDStream *self, hd_uring_ctx_t *ctx,
+                                    volatile int32_t *owner) {
+  if (!ctx->canceled)
+    return NO;
+  pthread_mutex_unlock(&gSubmitLock);
+  *owner = 0;
+  _op_end(self, ctx);
+  return YES;
+}
+
+
+static inline BOOL _is_suspended(HDStream *self) {
+  return HAFLAG_TEST(&(self->flags_), kFlagSuspended);
+}
+
+// ----------------------------------------------------------------------------
+// Reading
+
+
+static void _kick_read(HDStream *self, hd_uring_ctx_t *ctx) {
+  if (!_is_suspended(self) && !ctx->canceled &&
+      h_atomic_cas(&ctx->reading, 0, 1)) {
+    _submit_read(self, ctx);
+  }
+}
+
+
+// Caller owns ctx->reading
+static void _submit_read(HDStream *self, hd_uring_ctx_t *ctx) {
+  if (_is_suspended(self) || !_op_begin(ctx)) {
+    ctx->reading = 0;
+    h_atomic_barrier();
+    // we might have been resumed after we looked at the flag
+    _kick_read(self, ctx);
+    return;
+  }
+  hd_uring_op_t *op = &ctx->readOp;
+  pthread_mutex_lock(&gSubmitLock);
+  if (_canceled_before_submit(self, ctx, &ctx->reading))
+    return;
+  struct io_uring_sqe *sqe = _sqe_get();
+  if (op->polling) {
+    io_uring_prep_poll_add(sqe, self->fd_, POLLIN);
+  } else if (gFreeBufferCount && !self->onSlice_) {
+    op->bufIndex = gFreeBuffers[--gFreeBufferCount];
+    op->buf = gBuffers + (op->bufIndex * kRegisteredBufferSize);
+    // -1 to leave room for the extra byte promised by |onData|
+    io_uring_prep_read_fixed(sqe, self->fd_, op->buf, kRegisteredBufferSize-1,
+                             -1, op->bufIndex);
+  } else {
+    op->slice = [[HDBufferPool sharedPool] newSliceWithCapacity:
+                 kRegisteredBufferSize-1];
+    op->buf = op->slice.mutableBytes;
+    io_uring_prep_read(sqe, self->fd_, op->buf, kRegisteredBufferSize-1, -1);
+  }
+  io_uring_sqe_set_data(sqe, op);
+  io_uring_submit(&gRing);
+  pthread_mutex_unlock(&gSubmitLock);
+}
+
+
+static void _release_read_buffer(hd_uring_op_t *op) {
+  if (op->bufIndex != -1) {
+    pthread_mutex_lock(&gSubmitLock);
+    gFreeBuffers[gFreeBufferCount++] = op->bufIndex;
+    pthread_mutex_unlock(&gSubmitLock);
+    op->bufIndex = -1;
+  }
+  if (op->slice) {
+    [op->slice release];
+    op->slice = nil;
+  }
+  op->buf = NULL;
+}
+
+
+// Called on the stream's dispatch queue
+static void _read_deliver(hd_uring_op_t *op) {
+  NSAutoreleasePool *pool = [NSAutoreleasePool new];
+  HDStream *self = op->stream;
+  hd_uring_ctx_t *ctx = (hd_uring_ctx_t*)self->backendContext_;
+  int res = op->res;
+
+  if (res > 0) {
+    @try {
+      [op->slice setLength:res];
+      NSError *error = hd_stream_deliver(self, op->buf, res, op->slice);
+      if (error) {
+        // "close" follows once in-flight I/O has drained
+        hd_stream_emit_error(self, error);
+        [self cancel];
+      }
+    } @catch (NSException * e) {
+      NSLog(@"%@: exception while invoking callback: %@", self, e);
+    }
+  } else if (res == 0) {
+    // EOF
+    if (self->readTransform_) {
+      @try {
+        NSError *error = hd_stream_deliver(self, NULL, 0, nil);
+        if (error)
+          hd_stream_emit_error(self, error);
+      } @catch (NSException * e) {
+        NSLog(@"%@: exception while invoking callback: %@", self, e);
+      }
+    }
+    hd_stream_emit_close(self);
+    [self cancel];
+  } else if (res != -ECANCELED && res != -EINTR) {
+    NSLog(@"%@: read(): [%d] %s -- closing the file descriptor", self, -res,
+          strerror(-res));
+    hd_stream_emit_error(self, hd_posix_error(-res));
+    [self cancel];
+  }
+
+  _release_read_buffer(op);
+  ctx->reading = 0;
+  h_atomic_barrier();
+  _kick_read(self, ctx);
+  _op_end(self, ctx);
+  [pool drain];
+}
+
+
+static void _read_complete(hd_uring_op_t *op) {
+  HDStream *self = op->stream;
+  hd_uring_ctx_t *ctx = (hd_uring_ctx_t*)self->backendContext_;
+  if (op->polling && op->res >= 0) {
+    // readable -- now read
+    op->polling = NO;
+    _submit_read(self, ctx);
+    _op_end(self, ctx);
+  } else if (op->res == -EAGAIN) {
+    // nothing to read -- wait until there is
+    _release_read_buffer(op);
+    op->polling = YES;
+    _submit_read(self, ctx);
+    _op_end(self, ctx);
+  } else {
+    op->polling = NO;
+    dispatch_async_f(self->dispatchQueue_, op,
+                     (dispatch_function_t)&_read_deliver);
+  }
+}
+
+// ----------------------------------------------------------------------------
+// Writing
+
+
+static void _kick_write(HDStream *self, hd_uring_ctx_t *ctx) {
+  if (!_is_suspended(self) && !ctx->canceled &&
+      h_atomic_cas(&ctx->writing, 0, 1)) {
+    _submit_write(self, ctx);
+  }
+}
+
+
+// Caller owns ctx->writing
+static void _submit_write(HDStream *self, hd_uring_ctx_t *ctx) {
+  OSSpinLockLock(&(self->writeSpinLock_));
+  wbuf_t *wbuf = self->wbufTail_;
+  OSSpinLockUnlock(&(self->writeSpinLock_));
+  if (!wbuf || _is_suspended(self) || !_op_begin(ctx)) {
+    ctx->writing = 0;
+    h_atomic_barrier();
+    // a buffer might have been queued after we looked at the chain
+    if (!wbuf || _is_suspended(self)) {
+      OSSpinLockLock(&(self->writeSpinLock_));
+      BOOL pending = self->wbufTail_ != NULL;
+      OSSpinLockUnlock(&(self->writeSpinLock_));
+      if (pending) _kick_write(self, ctx);
+    }
+    return;
+  }
+  hd_uring_op_t *op = &ctx->writeOp;
+  pthread_mutex_lock(&gSubmitLock);
+  if (_canceled_before_submit(self, ctx, &ctx->writing))
+    return;
+  struct io_uring_sqe *sqe = _sqe_get();
+  if (op->polling) {
+    io_uring_prep_poll_add(sqe, self->fd_, POLLOUT);
+  } else {
+    const char *buf = (const char*)[wbuf->data bytes];
+    size_t len = [wbuf->data length] - wbuf->offset;
+    io_uring_prep_write(sqe, self->fd_, &buf[wbuf->offset], len, -1);
+  }
+  io_uring_sqe_set_data(sqe, op);
+  io_uring_submit(&gRing);
+  pthread_mutex_unlock(&gSubmitLock);
+}
+
+
+static void _write_complete(hd_uring_op_t *op) {
+  HDStream *self = op->stream;
+  hd_uring_ctx_t *ctx = (hd_uring_ctx_t*)self->backendContext_;
+  int res = op->res;
+
+  if ((op->polling && res >= 0) || res == -EAGAIN || res == -EINTR) {
+    // writable (or need to wait until we are) -- try again
+    op->polling = (res == -EAGAIN);
+    _submit_write(self, ctx);
+    _op_end(self, ctx);
+    return;
+  }
+  op->polling = NO;
+
+  if (res < 0) {
+    switch (-res) {
+      // Gracefully cancel, closing fd:
+      case ECANCELED: // we canceled it
+      case EBADF:     // Bad file descriptor
+      case EPIPE:     // Broken pipe
+      case EIO:       // Generic input/output error
+        break;
+      // Other errors are considered serious and are logged
+      default: {
+        NSAutoreleasePool *pool = [NSAutoreleasePool new];
+        NSLog(@"%@: write(): [%d] %s -- closing the file descriptor", self,
+              -res, strerror(-res));
+        [pool drain];
+      }
+    }
+    if (res != -ECANCELED) {
+      // emitted on the stream's queue, ahead of "close"
+      dispatch_async(self->dispatchQueue_, ^{
+        NSAutoreleasePool *pool = [NSAutoreleasePool new];
+        hd_stream_emit_error(self, hd_posix_error(-res));
+        [pool drain];
+      });
+    }
+    ctx->writing = 0;
+    [self cancel];
+    _op_end(self, ctx);
+    return;
+  }
+
+  // Note: no need for locking here since we are the only ones dealing with
+  //       the tail
+  wbuf_t *wbuf = self->wbufTail_;
+  wbuf->offset += res;
+  if (wbuf->offset == [wbuf->data length]) {
+    // buffer emptied -- advance the chain
+    OSSpinLockLock(&(self->writeSpinLock_));
+    if (wbuf->next == NULL) {
+      self->wbufTail_ = self->wbufHead_ = NULL;
+    } else {
+      self->wbufTail_ = wbuf->next;
+    }
+    OSSpinLockUnlock(&(self->writeSpinLock_));
+    wbuf_free(wbuf);
+  }
+  // continue with the next buffer (or the rest of this one)
+  _submit_write(self, ctx);
+  _op_end(self, ctx);
+}
+
+// ----------------------------------------------------------------------------
+// Backend interface
+
+
+static void _uring_resume(HDStream *self) {
+  hd_uring_ctx_t *ctx = _ctx(self);
+  if (HAFLAG_TEST(&(self->flags_), kFlagReadable))
+    _kick_read(self, ctx);
+  _kick_write(self, ctx);
+}
+
+
+static void _uring_suspend(HDStream *self) {
+  // nothing to do -- in-flight operations complete and are not resubmitted
+  // while the suspended flag is set
+}
+
+
+static void _uring_cancel(HDStream *self) {
+  hd_uring_ctx_t *ctx = _ctx(self);
+  if (!h_atomic_cas(&ctx->canceled, 0, 1))
+    return;
+  if (ctx->reading || ctx->writing) {
+    pthread_mutex_lock(&gSubmitLock);
+    struct io_uring_sqe *sqe;
+    if (ctx->reading) {
+      sqe = _sqe_get();
+      io_uring_prep_cancel(sqe, &ctx->readOp, 0);
+      io_uring_sqe_set_data(sqe, NULL);
+    }
+    if (ctx->writing) {
+      sqe = _sqe_get();
+      io_uring_prep_cancel(sqe, &ctx->writeOp, 0);
+      io_uring_sqe_set_data(sqe, NULL);
+    }
+    io_uring_submit(&gRing);
+    pthread_mutex_unlock(&gSubmitLock);
+  }
+  if (ctx->inflight == 0)
+    _finalize(self, ctx);
+}
+
+
+static void _uring_write(HDStream *self) {
+  _kick_write(self, _ctx(self));
+}
+
+
+static void _uring_dispose(HDStream *self) {
+  hd_uring_ctx_t *ctx = (hd_uring_ctx_t*)self->backendContext_;
+  free(ctx);
+  self->backendContext_ = NULL;
+}
+
+
+const hd_io_backend_t hd_uring_backend = {
+  HDStreamIOBackendURing,
+  &_uring_is_available,
+  &_uring_resume,
+  &_uring_suspend,
+  &_uring_cancel,
+  &_uring_write,
+  &_uring_dispose,
+};
+
+#endif // HD_USE_URING
@@ -5,16 +5,31 @@
  * @discussion
  * - All operations are thread safe unless otherwise noted.
  * - New streams are suspended by default and need to be resumed before used.
+ * - Events (see HEventEmitter.h), emitted on |dispatchQueue|:
+ *   - "error" (HDStream *self, NSError *error) -- a read, write or transform
+ *     error (NSPOSIXErrorDomain for I/O errors). The stream is closed after.
+ *   - "close" (HDStream *self) -- the stream was closed, at EOF, after an
+ *     error or after |cancel|. Emitted only once.
  *
  */
 #import <Foundation/Foundation.h>
 #import <dispatch/dispatch.h>
-#import <libkern/OSAtomic.h>
+#import "hatomic.h"
 
 // Block type for data events
-@class HDStream;
+@class HDStream, HDSemaphore, HDSlice;
+@protocol HDStreamTransform;
 typedef void (^HDStreamBlock)(const void *bytes, size_t length);
 
+// Block type for data events delivered as retainable slices (see onSlice)
+typedef void (^HDSliceBlock)(HDSlice *slice);
+
+// I/O backends (see +setDefaultIOBackend:)
+typedef enum {
+  HDStreamIOBackendDispatch = 0, // dispatch sources + read(2)/write(2)
+  HDStreamIOBackendURing,        // io_uring with registered buffers (Linux)
+} HDStreamIOBackend;
+
 @interface HDStream : NSObject<NSCopying,NSMutableCopying> {
 // sizeof = 384 bytes (including NSObject with its Class pointer, for 64-bit)
 @public
@@ -25,10 +40,15 @@ typedef void (^HDStreamBlock)(const void *bytes, size_t length);
   dispatch_source_t readSource_;
   dispatch_source_t writeSource_;
   HDStreamBlock onData_;
-  NSMutableData *readBuffer_;
+  HDSliceBlock onSlice_;
   OSSpinLock writeSpinLock_;
   struct wbuf *wbufHead_;
   struct wbuf *wbufTail_;
+  const struct hd_io_backend *backend_; // NULL for dispatch sources
+  void *backendContext_;
+  id<HDStreamTransform> readTransform_;
+  id<HDStreamTransform> writeTransform_;
+  HDSemaphore *writeTransformSemaphore_;
 }
 
 // The underlying file descriptor
@@ -54,16 +74,73 @@ typedef void (^HDStreamBlock)(const void *bytes, size_t length);
  * (|length| + 1) which allows you to use that last extra byte for e.g. null
  * termination. Note that |bytes| is only valid within the calling scope -- it
  * will become invalid when the onData block returns, so if you need to keep a
- * reference to the bytes you must make a copy.
+ * reference to the bytes you must make a copy (or use onSlice instead).
  */
 @property(copy) HDStreamBlock onData; // (const void *bytes, size_t length)
 
+/*!
+ * Called when data arrives on a readable stream, with the data in an HDSlice
+ * (see HDBufferPool.h).
+ *
+ * @discussion
+ * Unlike the bytes passed to onData, a slice stays valid for as long as it is
+ * retained, so consumers which hold on to data don't need to copy it. Reads go
+ * straight into slices taken from the shared HDBufferPool, which get their
+ * buffers back when released. Streams don't keep a read buffer of their own,
+ * so idle streams hold no buffer memory.
+ *
+ * If both onSlice and onData are set, onSlice is called first, followed by
+ * onData with the same bytes.
+ */
+@property(copy) HDSliceBlock onSlice; // (HDSlice *slice)
+
 // The dispatch queue on which this stream should schedule on
 @property dispatch_queue_t dispatchQueue;
 
+// The I/O backend used by this stream
+@property(readonly) HDStreamIOBackend IOBackend;
+
+/*!
+ * Optional transform (see HDStreamTransform.h) applied to data read from the
+ * file descriptor before it is passed to |onData|. At EOF, the transform is
+ * finished before the "close" event is emitted. If the transform fails, its
+ * error is emitted as an "error" event and the stream is closed (emitting
+ * "close"). Should be set before the stream is resumed. A transform instance
+ * must not be shared between streams.
+ */
+@property(retain) id<HDStreamTransform> readTransform;
+
+/*!
+ * Optional transform applied to each chunk passed to writeData: and friends
+ * before it is queued for writing. Writes are serialized while a transform is
+ * set, so chunks are transformed and queued in the order they were written.
+ * Should be set before anything is written.
+ *
+ * Not applied by writeAllUnbufferedBytes:length: or writeFileDescriptors:...
+ */
+@property(retain) id<HDStreamTransform> writeTransform;
+
 
 #pragma mark Creation and Initialization
 
+/*!
+ * Select the I/O backend used by streams initialized after this call.
+ *
+ * @discussion
+ * The default is HDStreamIOBackendDispatch. Returns NO and leaves the default
+ * unchanged if |backend| is not available at runtime (e.g. io_uring on a
+ * kernel without support for it, or on a system other than Linux).
+ *
+ * With HDStreamIOBackendURing, reads and writes are submitted to a shared
+ * io_uring instance and completions are delivered to |onData| and the "close"
+ * event on |dispatchQueue|, just like with dispatch sources.
+ */
++ (BOOL)setDefaultIOBackend:(HDStreamIOBackend)backend;
++ (HDStreamIOBackend)defaultIOBackend;
+
+// Test if |backend| can be used on this system
++ (BOOL)isIOBackendAvailable:(HDStreamIOBackend)backend;
+
 // A new autoreleased stream of the receiving type
 + (id)stream;
 
@@ -103,7 +180,8 @@ typedef void (^HDStreamBlock)(const void *bytes, size_t length);
 
 #pragma mark Deriving new streams
 
-// Create a copy of this stream but with a custom file descriptor
+// Create a copy of this stream but with a custom file descriptor. Transforms
+// are not copied since they hold per-stream state (e.g. a z_stream).
 - (HDStream*)copyWithFileDescriptor:(int)fd
                             disableReading:(BOOL)disableReading
                             disableWriting:(BOOL)disableWriting;
@@ -128,6 +206,12 @@ typedef void (^HDStreamBlock)(const void *bytes, size_t length);
 // Write complete |string| encoded as UTF-8
 - (void)writeString:(NSString*)string;
 
+/*!
+ * Finish |writeTransform| and write its final output (e.g. a gzip trailer),
+ * leaving it ready to start over. No-op if there's no write transform.
+ */
+- (void)finishWriteTransform;
+
 /**
  * Send a file descriptor using sendmsg(2).
  *
@@ -138,6 +222,11 @@ typedef void (^HDStreamBlock)(const void *bytes, size_t length);
  */
 - (BOOL)writeFileDescriptor:(int)fd name:(NSString*)name;
 
+// Send |count| file descriptors (at most 16) together in a single message
+- (BOOL)writeFileDescriptors:(const int*)fds
+                       count:(NSUInteger)count
+                        name:(NSString*)name;
+
 
 @end
 
@@ -1,7 +1,9 @@
 #import "HDStream.h"
+#import "HDStream-private.h"
 #import "HEventEmitter.h"
+#import "HDSemaphore.h"
 #import "hcommon.h"
-#import <libkern/OSAtomic.h>
+#import "hatomic.h"
 #import <fcntl.h>
 #import <sys/socket.h>
 
@@ -9,43 +11,6 @@
  TODO: suspend read source while there is no onData listener
 */
 
-// ----------------------------------------------------------------------------
-// flags
-
-enum { // [0-31]
-  kFlagSuspended = 0,
-  kFlagSuspendedWrite,
-  kFlagReadable,
-  kFlagWritable,
-};
-
-// types are: volatile uint32_t *flags, uint32_t flag
-
-// Set |flag| in |flags| unless already set. Returns true if set.
-#define HAFLAG_SET(flags, flag) !OSAtomicTestAndSetBarrier(flag, flags)
-
-// Clear |flag| in |flags| if set. Returns false if |flag| was not set (no-op).
-#define HAFLAG_CLEAR(flags, flag) OSAtomicTestAndClearBarrier(flag, flags)
-
-// Test if |flag| is set in |flags|. True if set.
-#define HAFLAG_TEST(flags, flag) \
-  (!!(  ( *((char*)(flags)+((flag) >> 3)) ) & (0x80 >> ((flag) & 7))  ))
-
-
-// instance-local macros
-#define FLAG_SET(flag) HAFLAG_SET(&flags_, flag)
-#define FLAG_CLEAR(flag) HAFLAG_CLEAR(&flags_, flag)
-#define FLAG_TEST(flag) HAFLAG_TEST(&flags_, flag)
-
-// ----------------------------------------------------------------------------
-// Write buffer chain
-
-typedef struct wbuf {
-  struct wbuf *next; // a more recent buffer (closer to wbufHead_)
-  NSData *data;
-  size_t offset;
-} wbuf_t;
-
 // ----------------------------------------------------------------------------
 
 
@@ -60,30 +25,38 @@ static void _read(HDStream *self) {
   // EOF
   if (estimatedSize == 0) {
     dispatch_source_cancel(self->readSource_);
-    [self emitEvent:@"close" argument:self];
-    [self->readBuffer_ setLength:0];
+    if (self->readTransform_) {
+      @try {
+        NSError *error = hd_stream_deliver(self, NULL, 0, nil);
+        if (error)
+          hd_stream_emit_error(self, error);
+      } @catch (NSException * e) {
+        NSLog(@"%@: exception while invoking callback: %@", self, e);
+      }
+    }
+    hd_stream_emit_close(self);
     [pool drain];
     return;
   }
 
-  // read buffer (safe since reads as serial)
-  size_t bufsizeNeeded = estimatedSize+1; // +1 for user use, e.g. sentinel
-  if (!self->readBuffer_) {
-    self->readBuffer_ = [[NSMutableData alloc] initWithCapacity:bufsizeNeeded];
-  } else {
-    // increase buffer size if needed
-    if (self->readBuffer_.length < bufsizeNeeded)
-      [self->readBuffer_ setLength:bufsizeNeeded];
-  }
+  // Read into a slice from the shared pool rather than a buffer of our own, so
+  // that idle streams hold no buffer memory and onSlice consumers can keep the
+  // data as is. Reads larger than the pool's largest size class are split.
+  HDBufferPool *bufferPool = [HDBufferPool sharedPool];
+  size_t maxSize = bufferPool.maximumSize - 1; // -1 for user use, e.g. sentinel
+  HDSlice *slice = [bufferPool newSliceWithCapacity:
+      (estimatedSize < maxSize ? estimatedSize : maxSize)];
 
   int fd = dispatch_source_get_handle(self->readSource_);
-  buf = [self->readBuffer_ mutableBytes];
-  length = read(fd, buf, estimatedSize);
+  buf = slice.mutableBytes;
+  length = read(fd, buf, slice.capacity);
   if (length == -1) {
     if (errno != EAGAIN) {
-      NSLog(@"%@: read(): [%d] %s -- closing the file descriptor", self, errno,
-            strerror(errno));
+      int code = errno;
+      NSLog(@"%@: read(): [%d] %s -- closing the file descriptor", self, code,
+            strerror(code));
       dispatch_source_cancel(self->readSource_);
+      hd_stream_emit_error(self, hd_posix_error(code));
     }
   } else {
     #if 0  // debug
@@ -93,28 +66,46 @@ static void _read(HDStream *self) {
     #endif
     //printf("%d DID READ \"%*s\"\n",
     //       dispatch_source_get_handle(self->readSource_), length, buf);
-    if (self->onData_) {
-      @try {
-        self->onData_(buf, length);
-      } @catch (NSException * e) {
-        NSLog(@"%@: exception while invoking callback: %@", self, e);
+    [slice setLength:length];
+    @try {
+      NSError *error = hd_stream_deliver(self, buf, length, slice);
+      if (error) {
+        // "close" follows once the source has been canceled
+        dispatch_source_cancel(self->readSource_);
+        hd_stream_emit_error(self, error);
       }
+    } @catch (NSException * e) {
+      NSLog(@"%@: exception while invoking callback: %@", self, e);
     }
   }
 
+  [slice release];
   [pool drain];
 }
 
 
-static void _read_finalize(HDStream *self) {
-  int fd = dispatch_source_get_handle(self->readSource_);
-  close(fd);
+/*
+ * Called from the cancel handlers of both sources once they have released
+ * theirs. The file descriptor is shared by the sources, so it's closed (and
+ * "close" emitted, unless already done at EOF) when the last one is gone.
+ */
+static void _source_finalized(HDStream *self) {
+  if (self->readSource_ || self->writeSource_)
+    return;
+  int fd = self->fd_;
+  if (fd != -1 && h_atomic_cas(&self->fd_, fd, -1))
+    close(fd);
+  NSAutoreleasePool *pool = [NSAutoreleasePool new];
+  hd_stream_emit_close(self);
+  [pool drain];
+}
 
+
+static void _read_finalize(HDStream *self) {
   dispatch_source_t oldSource = self->readSource_;
   if (h_casptr(&self->readSource_, oldSource, nil))
     dispatch_release(oldSource);
-
-  self->fd_ = -1;
+  _source_finalized(self);
   [self release];
 }
 
@@ -153,8 +144,9 @@ static void _write(HDStream *self) {
 
     // handle result
     if (written < 0) {
-      ldprintf("write() error: [%d] %s", errno, strerror(errno));
-      switch (errno) {
+      int code = errno;
+      ldprintf("write() error: [%d] %s", code, strerror(code));
+      switch (code) {
         // try-again "errors":
         case EINTR:  // write syscall interrupted
         case EAGAIN: // fd temporarily unavailable
@@ -171,9 +163,12 @@ static void _write(HDStream *self) {
         // Other errors are considered serious and are logged
         default:
           NSLog(@"%@: write(): [%d] %s -- closing the file descriptor", self,
-                errno, strerror(errno));
+                code, strerror(code));
       }
-      dispatch_source_cancel(self->writeSource_);
+      // the descriptor is closed once both sources are canceled, so the
+      // reading side goes too
+      hd_stream_emit_error(self, hd_posix_error(code));
+      [self cancel];
       break;
     } else if (written < len) {
       // there's still data on this buffer that need to be written
@@ -200,8 +195,7 @@ static void _write(HDStream *self) {
       }
       // at this point, we know no one else is referring to wbuf, so we can
       // safely discard of it
-      [wbuf->data release];
-      CFAllocatorDeallocate(NULL, wbuf);
+      wbuf_free(wbuf);
 
       // break if input is empty
       if (self->wbufTail_ == NULL)
@@ -216,26 +210,37 @@ static void _write(HDStream *self) {
 
 
 static void _write_finalize(HDStream *self) {
-  int fd = dispatch_source_get_handle(self->writeSource_);
-  close(fd);
-
   dispatch_source_t oldSource = self->writeSource_;
   if (h_casptr(&self->writeSource_, oldSource, nil))
     dispatch_release(oldSource);
-
-  self->fd_ = -1;
+  _source_finalized(self);
   [self release];
 }
 
 
 // ----------------------------------------------------------------------------
 
-@interface HDStream (Private)
-- (void)_createReadSource;
-- (void)_createWriteSource;
-@end
+// Backend used for new streams, or NULL for dispatch sources
+static const hd_io_backend_t *gDefaultBackend = NULL;
+
+static const hd_io_backend_t *_backend_for_type(HDStreamIOBackend type) {
+  switch (type) {
+    #if HD_USE_URING
+    case HDStreamIOBackendURing: return &hd_uring_backend;
+    #endif
+    default: return NULL;
+  }
+}
+
+// ----------------------------------------------------------------------------
+
 @implementation HDStream (Private)
 
++ (const hd_io_backend_t*)_IOBackend {
+  return gDefaultBackend;
+}
+
+
 - (void)_createReadSource {
   assert(readSource_ == nil);
   assert(dispatchQueue_ != nil);
@@ -268,18 +273,82 @@ static void _write_finalize(HDStream *self) {
 }
 
 
+- (void)_enqueueWriteBuffer:(wbuf_t*)wbuf {
+  OSSpinLockLock(&writeSpinLock_);
+  if (wbufHead_) {
+    // there's already a buffer chain -- push_front
+    wbufHead_->next = wbuf;
+    wbufHead_ = wbuf;
+  } else {
+    // first link in chain
+    wbufHead_ = wbuf;
+    wbufTail_ = wbuf;
+  }
+
+  // let the backend pick up the chain
+  if (backend_) {
+    OSSpinLockUnlock(&writeSpinLock_);
+    if (!FLAG_TEST(kFlagSuspended))
+      backend_->write(self);
+    return;
+  }
+
+  // create write source if needed
+  if (!writeSource_) {
+    [self _createWriteSource];
+    OSSpinLockUnlock(&writeSpinLock_);
+    if (!FLAG_TEST(kFlagSuspended)) {
+      dispatch_resume(writeSource_);
+    } else {
+      // important to balance resume/suspend calls, so record writer state
+      uint32_t unused = FLAG_SET(kFlagSuspendedWrite);
+    }
+  } else {
+    OSSpinLockUnlock(&writeSpinLock_);
+    if (!FLAG_TEST(kFlagSuspended) && FLAG_CLEAR(kFlagSuspendedWrite)) {
+      // we are not explicitly suspended, but the writer was suspended due to
+      // empty buffer, but we now have a buffer so resume it
+      dispatch_resume(writeSource_);
+    }
+  }
+}
+
+
 @end
 
 // ----------------------------------------------------------------------------
 
 @implementation HDStream
 
-@synthesize onData = onData_;
+@synthesize onData = onData_,
+            onSlice = onSlice_,
+            readTransform = readTransform_;
 
 
 #pragma mark Creation and Initialization
 
 
++ (BOOL)setDefaultIOBackend:(HDStreamIOBackend)backend {
+  if (![self isIOBackendAvailable:backend])
+    return NO;
+  gDefaultBackend = _backend_for_type(backend);
+  return YES;
+}
+
+
++ (HDStreamIOBackend)defaultIOBackend {
+  return gDefaultBackend ? gDefaultBackend->type : HDStreamIOBackendDispatch;
+}
+
+
++ (BOOL)isIOBackendAvailable:(HDStreamIOBackend)backend {
+  if (backend == HDStreamIOBackendDispatch)
+    return YES;
+  const hd_io_backend_t *b = _backend_for_type(backend);
+  return b && b->isAvailable();
+}
+
+
 + (id)stream {
   return [[self new] autorelease];
 }
@@ -343,8 +412,9 @@ static void _write_finalize(HDStream *self) {
   dispatchQueue_ = dispatchQueue ? dispatchQueue :
       dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
 
-  // setup read source
-  if (FLAG_TEST(kFlagReadable))
+  // setup read source, unless an alternate backend takes care of reading
+  backend_ = [isa _IOBackend];
+  if (FLAG_TEST(kFlagReadable) && !backend_)
     [self _createReadSource];
 
   // future: setup write source
@@ -376,10 +446,13 @@ static void _write_finalize(HDStream *self) {
     [onData_ release];
     onData_ = nil;
   }
-  if (readBuffer_) {
-    [readBuffer_ release];
-    readBuffer_ = nil;
+  if (onSlice_) {
+    [onSlice_ release];
+    onSlice_ = nil;
   }
+  [readTransform_ release];
+  [writeTransform_ release];
+  [writeTransformSemaphore_ release];
   if (readSource_) {
     dispatch_release(readSource_);
     readSource_ = nil;
@@ -388,13 +461,15 @@ static void _write_finalize(HDStream *self) {
     dispatch_release(dispatchQueue_);
     dispatchQueue_ = nil;
   }
+  if (backendContext_)
+    backend_->dispose(self);
   [super dealloc];
 }
 
 
 - (void)finalize {
   onData_ = nil;
-  readBuffer_ = nil;
+  onSlice_ = nil;
   readSource_ = nil;
   dispatchQueue_ = nil;
 }
@@ -404,6 +479,8 @@ static void _write_finalize(HDStream *self) {
 
 
 - (int)fileDescriptor {
+  if (backend_)
+    return fd_;
   if (readSource_)
     return dispatch_source_get_handle(readSource_);
   return -1;
@@ -414,6 +491,10 @@ static void _write_finalize(HDStream *self) {
 - (BOOL)isWritable { return FLAG_TEST(kFlagWritable); }
 - (BOOL)isReadable { return FLAG_TEST(kFlagReadable); }
 
+- (HDStreamIOBackend)IOBackend {
+  return backend_ ? backend_->type : HDStreamIOBackendDispatch;
+}
+
 - (BOOL)isValid {
   if ( (fd_ == -1) ||
        (readSource_ && dispatch_source_testcancel(readSource_) != 0) ) {
@@ -423,6 +504,15 @@ static void _write_finalize(HDStream *self) {
 }
 
 
+- (id<HDStreamTransform>)writeTransform { return writeTransform_; }
+
+- (void)setWriteTransform:(id<HDStreamTransform>)transform {
+  if (transform && !writeTransformSemaphore_)
+    writeTransformSemaphore_ = [[HDSemaphore alloc] initWithValue:1];
+  h_swapid(&writeTransform_, transform);
+}
+
+
 - (dispatch_queue_t)dispatchQueue { return dispatchQueue_; }
 
 - (void)setDispatchQueue:(dispatch_queue_t)dispatchQueue {
@@ -445,6 +535,10 @@ static void _write_finalize(HDStream *self) {
 
 
 - (void)cancel {
+  if (backend_) {
+    backend_->cancel(self);
+    return;
+  }
   if (readSource_) dispatch_source_cancel(readSource_);
   if (writeSource_) dispatch_source_cancel(writeSource_);
   // need to resume or will never cancel
@@ -452,6 +546,11 @@ static void _write_finalize(HDStream *self) {
 }
 
 - (void)suspend {
+  if (backend_) {
+    if (FLAG_SET(kFlagSuspended))
+      backend_->suspend(self);
+    return;
+  }
   if (FLAG_SET(kFlagSuspended))
     if (readSource_) dispatch_suspend(readSource_);
   if (FLAG_SET(kFlagSuspendedWrite))
@@ -459,6 +558,11 @@ static void _write_finalize(HDStream *self) {
 }
 
 - (void)resume {
+  if (backend_) {
+    if (FLAG_CLEAR(kFlagSuspended))
+      backend_->resume(self);
+    return;
+  }
   if (FLAG_CLEAR(kFlagSuspended))
     if (readSource_) dispatch_resume(readSource_);
   if (FLAG_CLEAR(kFlagSuspendedWrite))
@@ -477,6 +581,9 @@ static void _write_finalize(HDStream *self) {
                   disableWriting:disableWriting dispatchQueue:dispatchQueue_];
   if (onData_)
     stream.onData = onData_;
+  if (onSlice_)
+    stream.onSlice = onSlice_;
+  // transforms are not copied since they carry per-stream state
   if (!self.isSuspended)
     [stream resume];
   return stream;
@@ -500,50 +607,69 @@ static void _write_finalize(HDStream *self) {
 #pragma mark Writing
 
 
-- (void)writeData:(NSData*)data {
-  wbuf_t *wbuf = CFAllocatorAllocate(NULL, sizeof(wbuf_t), 0);
-  wbuf->data = [data retain];
-  wbuf->next = NULL;
-  wbuf->offset = 0;
-
-  OSSpinLockLock(&writeSpinLock_);
-  if (wbufHead_) {
-    // there's already a buffer chain -- push_front
-    wbufHead_->next = wbuf;
-    wbufHead_ = wbuf;
-  } else {
-    // first link in chain
-    wbufHead_ = wbuf;
-    wbufTail_ = wbuf;
-  }
-
-  // create write source if needed
-  if (!writeSource_) {
-    [self _createWriteSource];
-    OSSpinLockUnlock(&writeSpinLock_);
-    if (!FLAG_TEST(kFlagSuspended)) {
-      dispatch_resume(writeSource_);
+// Transform a chunk through writeTransform_ and queue the result
+- (void)_writeTransformedBytes:(const void*)bytes
+                        length:(size_t)length
+                        finish:(BOOL)finish {
+  NSError *error = nil;
+  [writeTransformSemaphore_ get];
+  @try {
+    id<HDStreamTransform> transform = writeTransform_;
+    if ([transform respondsToSelector:
+         @selector(transformedDataWithBytes:length:finish:error:)]) {
+      // output goes straight into the buffer the wbuf takes over
+      NSData *output = [transform transformedDataWithBytes:bytes length:length
+                                                    finish:finish
+                                                     error:&error];
+      if (output.length)
+        [self _enqueueWriteBuffer:wbuf_alloc(output, nil)];
     } else {
-      // important to balance resume/suspend calls, so record writer state
-      uint32_t unused = FLAG_SET(kFlagSuspendedWrite);
-    }
-  } else {
-    OSSpinLockUnlock(&writeSpinLock_);
-    if (!FLAG_TEST(kFlagSuspended) && FLAG_CLEAR(kFlagSuspendedWrite)) {
-      // we are not explicitly suspended, but the writer was suspended due to
-      // empty buffer, but we now have a buffer so resume it
-      dispatch_resume(writeSource_);
+      NSMutableData *output = [[NSMutableData alloc] initWithCapacity:
+          [transform estimatedOutputLengthForInputLength:length]];
+      error = [transform transformBytes:bytes length:length finish:finish
+                                 output:^(const void *b, size_t n) {
+        [output appendBytes:b length:n];
+      }];
+      if (!error && output.length)
+        [self _enqueueWriteBuffer:wbuf_alloc(output, nil)];
+      [output release];
     }
+  } @finally {
+    [writeTransformSemaphore_ put];
+  }
+  if (error) {
+    [NSException raise:NSInternalInconsistencyException
+                format:@"write transform: %@", [error localizedDescription]];
   }
 }
 
 
+- (void)writeData:(NSData*)data {
+  if (writeTransform_) {
+    [self _writeTransformedBytes:[data bytes] length:[data length] finish:NO];
+    return;
+  }
+  [self _enqueueWriteBuffer:wbuf_alloc(data, nil)];
+}
+
+
 - (void)writeBytes:(const void*)bytes length:(size_t)length {
   if (!length) return;
+  if (writeTransform_) {
+    // no need for an intermediate copy
+    [self _writeTransformedBytes:bytes length:length finish:NO];
+    return;
+  }
   [self writeData:[NSData dataWithBytes:bytes length:length]];
 }
 
 
+- (void)finishWriteTransform {
+  if (writeTransform_)
+    [self _writeTransformedBytes:NULL length:0 finish:YES];
+}
+
+
 - (void)writeAllUnbufferedBytes:(const void*)bytes length:(size_t)length {
   ssize_t bw, totalbw = 0;
   do {
@@ -590,6 +716,17 @@ static void _write_finalize(HDStream *self) {
 // This will raise NSInvalidArgumentException if the underlying file descriptor
 // does not refer to a UNIX socket.
 - (BOOL)writeFileDescriptor:(int)fd name:(NSString*)name {
+  return [self writeFileDescriptors:&fd count:1 name:name];
+}
+
+
+- (BOOL)writeFileDescriptors:(const int*)fds
+                       count:(NSUInteger)count
+                        name:(NSString*)name {
+  if (count == 0 || count > 16) {
+    [NSException raise:NSInvalidArgumentException
+                format:@"can not send %lu file descriptors", (unsigned long)count];
+  }
   struct iovec iov;
   const char *buffer_data = name ? [name UTF8String] : NULL;
   size_t buffer_length = buffer_data ? strlen(buffer_data) : 0;
@@ -602,7 +739,10 @@ static void _write_finalize(HDStream *self) {
   int flags = 0;
 
   struct msghdr msg;
-  char scratch[64];
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(16 * sizeof(int))];
+  } scratch;
 
   msg.msg_iov = &iov;
   msg.msg_iovlen = 1;
@@ -614,15 +754,15 @@ static void _write_finalize(HDStream *self) {
 
   struct cmsghdr *cmsg;
 
-  msg.msg_control = (void*)scratch;
-  msg.msg_controllen = CMSG_LEN(sizeof(fd));
+  msg.msg_control = (void*)scratch.buf;
+  msg.msg_controllen = CMSG_LEN(sizeof(int) * count);
 
   cmsg = CMSG_FIRSTHDR(&msg);
   if (cmsg) {
     cmsg->cmsg_level = SOL_SOCKET;
     cmsg->cmsg_type = SCM_RIGHTS;
     cmsg->cmsg_len = msg.msg_controllen;
-    *(int*)CMSG_DATA(cmsg) = fd;
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
   }
 
   ssize_t written = sendmsg(fd_, &msg, flags);
@@ -0,0 +1,103 @@
+/*!
+ * Transform stages for HDStream, e.g. compression.
+ *
+ * @discussion
+ * A stream can have a read transform, which is applied to data read from the
+ * file descriptor before it is passed to onData, and a write transform, which
+ * is applied to each chunk passed to writeData: (and friends) before it is
+ * queued for writing. See -[HDStream readTransform].
+ *
+ * Example of a compressed channel:
+ *
+ *    stream.writeTransform = [HDZlibTransform compressorWithFormat:
+ *                             HDZlibFormatZlib level:1];
+ *    stream.readTransform = [HDZlibTransform decompressorWithFormat:
+ *                            HDZlibFormatZlib];
+ *
+ */
+#import "HDStream.h"
+
+@protocol HDStreamTransform <NSObject>
+
+/*!
+ * Transform |length| bytes at |bytes|, passing any output to |output|, which
+ * may be called zero or more times. The buffer passed to |output| has room for
+ * one extra byte after its length, like the one passed to onData.
+ *
+ * All output which can be produced from the input received so far must be
+ * passed to |output| before returning, so that the receiving end can act on
+ * each chunk as it arrives.
+ *
+ * If |finish| is true, this is the last input (|length| might be zero) and the
+ * transform should be reset to its initial state after producing its final
+ * output.
+ *
+ * Returns nil on success or an error if the input is invalid. Transforms are
+ * never called concurrently.
+ */
+- (NSError*)transformBytes:(const void*)bytes
+                    length:(size_t)length
+                    finish:(BOOL)finish
+                    output:(HDStreamBlock)output;
+
+// Expected upper bound of output produced for |length| bytes of input
+- (size_t)estimatedOutputLengthForInputLength:(size_t)length;
+
+// Discard any state and start over
+- (void)reset;
+
+@optional
+
+/*!
+ * Like transformBytes:length:finish:output:, but returns all output as one
+ * NSData (possibly empty), or nil with |error| set on failure. Transforms
+ * which can produce their output directly in a buffer of their own allocation
+ * implement this to save writers a copy; HDStream prefers it for its
+ * writeTransform.
+ */
+- (NSData*)transformedDataWithBytes:(const void*)bytes
+                             length:(size_t)length
+                             finish:(BOOL)finish
+                              error:(NSError**)error;
+
+@end
+
+
+// Error domain of errors returned by HDZlibTransform (code is a zlib Z_ code)
+extern NSString * const HDZlibTransformErrorDomain;
+
+typedef enum {
+  HDZlibFormatZlib = 0, // RFC 1950
+  HDZlibFormatGzip,     // RFC 1952 (multiple members are decompressed)
+  HDZlibFormatRaw,      // RFC 1951 deflate without header or checksum
+} HDZlibFormat;
+
+/*!
+ * Deflate/inflate transform using zlib.
+ *
+ * Each call to transformBytes:... is flushed with Z_SYNC_FLUSH, so every
+ * chunk written to a compressing stream can be decompressed as soon as it has
+ * been received. The z_stream and output buffer are allocated once and reused
+ * for all calls. When compressing through transformedDataWithBytes:..., output
+ * is deflated directly into a new buffer sized with deflateBound, which the
+ * returned NSData owns.
+ */
+@interface HDZlibTransform : NSObject <HDStreamTransform> {
+  void *zstream_; // z_stream
+  char *outbuf_;
+  size_t outbufSize_;
+  HDZlibFormat format_;
+  int level_;
+  BOOL compress_;
+}
+@property(readonly) HDZlibFormat format;
+@property(readonly) BOOL isCompressor;
+
+// Compression level 0-9, or -1 for zlib's default
++ (HDZlibTransform*)compressorWithFormat:(HDZlibFormat)format level:(int)level;
++ (HDZlibTransform*)decompressorWithFormat:(HDZlibFormat)format;
+
+- (id)initWithFormat:(HDZlibFormat)format
+            compress:(BOOL)compress
+               level:(int)level;
+@end
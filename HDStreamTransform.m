@@ -0,0 +1,225 @@
+#import "HDStreamTransform.h"
+#import <zlib.h>
+
+NSString * const HDZlibTransformErrorDomain = @"HDZlibTransform";
+
+#define ZS ((z_stream*)zstream_)
+
+static int _window_bits(HDZlibFormat format) {
+  switch (format) {
+    case HDZlibFormatGzip: return MAX_WBITS + 16;
+    case HDZlibFormatRaw: return -MAX_WBITS;
+    default: return MAX_WBITS;
+  }
+}
+
+
+@implementation HDZlibTransform
+
+@synthesize format = format_, isCompressor = compress_;
+
+
++ (HDZlibTransform*)compressorWithFormat:(HDZlibFormat)format level:(int)level {
+  return [[[self alloc] initWithFormat:format compress:YES level:level]
+          autorelease];
+}
+
+
++ (HDZlibTransform*)decompressorWithFormat:(HDZlibFormat)format {
+  return [[[self alloc] initWithFormat:format compress:NO
+                                 level:Z_DEFAULT_COMPRESSION] autorelease];
+}
+
+
+- (id)initWithFormat:(HDZlibFormat)format
+            compress:(BOOL)compress
+               level:(int)level {
+  if ((self = [super init])) {
+    format_ = format;
+    compress_ = compress;
+    level_ = level;
+    zstream_ = calloc(1, sizeof(z_stream));
+    int r = compress ?
+        deflateInit2(ZS, level, Z_DEFLATED, _window_bits(format), 8,
+                     Z_DEFAULT_STRATEGY) :
+        inflateInit2(ZS, _window_bits(format));
+    if (r != Z_OK) {
+      free(zstream_);
+      zstream_ = NULL;
+      [self release];
+      return nil;
+    }
+    outbufSize_ = 64*1024;
+    outbuf_ = (char*)malloc(outbufSize_ + 1); // +1 for onData's extra byte
+  }
+  return self;
+}
+
+
+- (void)dealloc {
+  if (zstream_) {
+    if (compress_) deflateEnd(ZS); else inflateEnd(ZS);
+    free(zstream_);
+  }
+  free(outbuf_);
+  [super dealloc];
+}
+
+
+- (void)reset {
+  if (compress_) deflateReset(ZS); else inflateReset(ZS);
+}
+
+
+- (size_t)estimatedOutputLengthForInputLength:(size_t)length {
+  if (compress_) {
+    // deflateBound does not include the sync flush marker
+    return deflateBound(ZS, (uLong)length) + 6;
+  }
+  return length * 4;
+}
+
+
+- (NSError*)_errorWithCode:(int)code {
+  NSString *msg = ZS->msg ? [NSString stringWithUTF8String:ZS->msg] :
+                            [NSString stringWithFormat:@"zlib error %d", code];
+  [self reset];
+  return [NSError errorWithDomain:HDZlibTransformErrorDomain code:code
+      userInfo:[NSDictionary dictionaryWithObject:msg
+                                           forKey:NSLocalizedDescriptionKey]];
+}
+
+
+- (NSError*)transformBytes:(const void*)bytes
+                    length:(size_t)length
+                    finish:(BOOL)finish
+                    output:(HDStreamBlock)output {
+  z_stream *zs = ZS;
+  zs->next_in = (Bytef*)bytes;
+  zs->avail_in = (uInt)length;
+  int r;
+
+  if (compress_) {
+    int flush = finish ? Z_FINISH : Z_SYNC_FLUSH;
+    do {
+      zs->next_out = (Bytef*)outbuf_;
+      zs->avail_out = (uInt)outbufSize_;
+      r = deflate(zs, flush);
+      if (r == Z_STREAM_ERROR)
+        return [self _errorWithCode:r];
+      size_t produced = outbufSize_ - zs->avail_out;
+      if (produced)
+        output(outbuf_, produced);
+      // the flush is complete when deflate leaves room in the output buffer
+    } while (zs->avail_out == 0 || (finish && r != Z_STREAM_END));
+    if (finish)
+      deflateReset(zs);
+    return nil;
+  }
+
+  while (1) {
+    zs->next_out = (Bytef*)outbuf_;
+    zs->avail_out = (uInt)outbufSize_;
+    r = inflate(zs, Z_SYNC_FLUSH);
+    size_t produced = outbufSize_ - zs->avail_out;
+    if (produced)
+      output(outbuf_, produced);
+    if (r == Z_STREAM_END) {
+      // start over on the next member (gzip) or stream
+      inflateReset(zs);
+      if (zs->avail_in == 0)
+        break;
+    } else if (r == Z_BUF_ERROR) {
+      // no progress possible -- need more input
+      break;
+    } else if (r != Z_OK) {
+      return [self _errorWithCode:r];
+    } else if (zs->avail_in == 0 && zs->avail_out != 0) {
+      break;
+    }
+  }
+  if (finish) {
+    // input ended in the middle of a stream
+    BOOL truncated = (zs->total_in != 0);
+    inflateReset(zs);
+    if (truncated) {
+      return [NSError errorWithDomain:HDZlibTransformErrorDomain
+          code:Z_DATA_ERROR userInfo:[NSDictionary dictionaryWithObject:
+          @"truncated input" forKey:NSLocalizedDescriptionKey]];
+    }
+  }
+  return nil;
+}
+
+
+- (NSData*)transformedDataWithBytes:(const void*)bytes
+                             length:(size_t)length
+                             finish:(BOOL)finish
+                              error:(NSError**)error {
+  if (!compress_) {
+    // inflated output has no useful bound, so collect it from outbuf_
+    NSMutableData *data = [NSMutableData dataWithCapacity:
+        [self estimatedOutputLengthForInputLength:length]];
+    NSError *e = [self transformBytes:bytes length:length finish:finish
+                               output:^(const void *b, size_t n) {
+      [data appendBytes:b length:n];
+    }];
+    if (e) {
+      if (error) *error = e;
+      return nil;
+    }
+    return data;
+  }
+
+  z_stream *zs = ZS;
+  size_t capacity = [self estimatedOutputLengthForInputLength:length];
+  char *buf = (char*)malloc(capacity);
+  if (!buf) {
+    [NSException raise:NSMallocException
+                format:@"failed to allocate %zu bytes", capacity];
+  }
+  zs->next_in = (Bytef*)bytes;
+  zs->avail_in = (uInt)length;
+  zs->next_out = (Bytef*)buf;
+  zs->avail_out = (uInt)capacity;
+  int flush = finish ? Z_FINISH : Z_SYNC_FLUSH, r;
+  while (1) {
+    r = deflate(zs, flush);
+    if (r == Z_STREAM_ERROR) {
+      free(buf);
+      if (error) *error = [self _errorWithCode:r];
+      return nil;
+    }
+    // the flush is complete when deflate leaves room in the output buffer
+    if (zs->avail_out != 0 && (!finish || r == Z_STREAM_END))
+      break;
+    if (zs->avail_out == 0) {
+      // not expected since the buffer is sized with deflateBound
+      size_t used = capacity;
+      capacity *= 2;
+      char *newbuf = (char*)realloc(buf, capacity);
+      if (!newbuf) {
+        free(buf);
+        [NSException raise:NSMallocException
+                    format:@"failed to allocate %zu bytes", capacity];
+      }
+      buf = newbuf;
+      zs->next_out = (Bytef*)(buf + used);
+      zs->avail_out = (uInt)(capacity - used);
+    }
+  }
+  if (finish)
+    deflateReset(zs);
+  return [NSData dataWithBytesNoCopy:buf length:capacity - zs->avail_out
+                        freeWhenDone:YES];
+}
+
+
+- (NSString*)description {
+  static const char *formats[] = {"zlib", "gzip", "raw"};
+  return [NSString stringWithFormat:@"<%@@%p %s %s>",
+          NSStringFromClass([self class]), self, formats[format_],
+          compress_ ? "compress" : "decompress"];
+}
+
+@end
@@ -8,6 +8,40 @@
   #endif
 #endif
 
+// Operations recorded in a binary trace
+typedef enum {
+  HRefcountOpInit = 1,
+  HRefcountOpRetain,
+  HRefcountOpRelease,
+  HRefcountOpDealloc,
+} HRefcountOp;
+
+#define H_REFCOUNT_TRACE_MAX_FRAMES 16
+
+// A binary trace record. All records have the same size.
+typedef struct {
+  uint64_t timestamp;   // mach_absolute_time()
+  uint64_t thread;      // mach thread port of the calling thread
+  uint64_t object;      // address of the logger
+  uint32_t op;          // HRefcountOp
+  uint32_t refcount;    // retain count before the operation
+  uint32_t serial;      // serialNumber of the logger
+  uint32_t frameCount;  // number of valid entries in |frames|
+  uint64_t frames[H_REFCOUNT_TRACE_MAX_FRAMES]; // return addresses
+} HRefcountTraceRecord;
+
+/*!
+ * An object which logs its retain, release and dealloc messages.
+ *
+ * @discussion
+ * By default each message is logged with NSLog along with a condensed stack
+ * trace, which is very slow. After calling +startTracingWithRecordsPerThread:
+ * all loggers instead write a HRefcountTraceRecord to a per-thread ring buffer
+ * (no locks, no allocations, no symbolization), which is cheap enough to leave
+ * enabled under load. The most recent records of each thread can then be
+ * written to a file with +writeTraceToPath: (or automatically at exit) and
+ * decoded later with +decodeTraceAtPath:.
+ */
 @interface HRefcountLogger : NSObject {
   uint32_t serialNumber_;
   NSString *name_;
@@ -25,4 +59,33 @@
 - (id)initWithName:(NSString*)name WARN_UNUSED;
 - (id)init WARN_UNUSED;
 - (void)noop;
+
+/*!
+ * Switch all loggers to binary tracing, keeping the last |capacity| records
+ * (rounded up to a power of two) of each thread. Returns NO if tracing is
+ * already enabled.
+ */
++ (BOOL)startTracingWithRecordsPerThread:(NSUInteger)capacity;
+
+// Switch back to NSLog. Recorded traces are kept and can still be written.
++ (void)stopTracing;
+
++ (BOOL)isTracing;
+
+/*!
+ * Write all recorded traces to |path| together with the information needed to
+ * symbolize them (loaded images and logger names). Returns NO on I/O error.
+ */
++ (BOOL)writeTraceToPath:(NSString*)path;
+
+// Write recorded traces to |path| when the process exits. nil disables.
++ (void)setTraceDumpPathAtExit:(NSString*)path;
+
+/*!
+ * Decode a file written by +writeTraceToPath: into the same text format as
+ * logged by NSLog mode, ordered by time. Decode on the same system (with the
+ * same binaries) as the trace was recorded. Returns nil if the file could not
+ * be read.
+ */
++ (NSString*)decodeTraceAtPath:(NSString*)path;
 @end
@@ -1,10 +1,140 @@
 #import "HRefcountLogger.h"
 #import "NSThread-condensedStackTrace.h"
+#import "hcommon.h"
 #import <libkern/OSAtomic.h>
+#import <mach/mach_time.h>
+#import <mach-o/dyld.h>
+#import <pthread.h>
+#import <dlfcn.h>
 
 
 uint32_t nextSerialNumber = 0;
 
+// ----------------------------------------------------------------------------
+// Binary tracing
+//
+// Each thread which records a trace gets its own ring buffer, found through a
+// pthread key. Rings are linked into a global list (lock-free push) and never
+// freed, so that the records of exited threads can still be written. Only the
+// owning thread writes to a ring; a writer of the trace file copies records
+// concurrently and discards the ones which might have been overwritten while
+// copying.
+//
+// Trace file layout (native byte order):
+//
+//   hrc_file_header_t
+//   imageCount x { uint64_t base; uint32_t pathlen; char path[pathlen]; }
+//   nameCount  x { uint32_t serial; uint32_t len; char utf8[len]; }
+//   recordCount x HRefcountTraceRecord
+
+typedef struct hrc_ring {
+  struct hrc_ring *next;
+  uint64_t thread;
+  uint64_t mask;
+  volatile uint64_t head; // total number of records written
+  HRefcountTraceRecord records[];
+} hrc_ring_t;
+
+typedef struct {
+  char magic[4]; // "HRCT"
+  uint32_t version;
+  uint32_t recordSize;
+  uint32_t timebaseNumer;
+  uint32_t timebaseDenom;
+  uint32_t imageCount;
+  uint32_t nameCount;
+  uint32_t reserved;
+  uint64_t recordCount;
+} hrc_file_header_t;
+
+static volatile BOOL gTracing = NO;
+static pthread_key_t gRingKey;
+static hrc_ring_t * volatile gRings = NULL;
+static uint64_t gRingCapacity = 0;
+static NSMutableDictionary *gNames = nil; // serial => name
+static NSString *gDumpPathAtExit = nil;
+
+
+static hrc_ring_t *_hrc_ring_create() {
+  hrc_ring_t *ring = (hrc_ring_t*)calloc(1, sizeof(hrc_ring_t) +
+      (size_t)gRingCapacity * sizeof(HRefcountTraceRecord));
+  if (!ring) return NULL;
+  ring->thread = pthread_mach_thread_np(pthread_self());
+  ring->mask = gRingCapacity - 1;
+  do {
+    ring->next = gRings;
+  } while (!h_casptr(&gRings, ring->next, ring));
+  pthread_setspecific(gRingKey, ring);
+  return ring;
+}
+
+
+static void __attribute__((noinline))
+_hrc_trace(HRefcountLogger *logger, uint32_t serial, HRefcountOp op) {
+  hrc_ring_t *ring = (hrc_ring_t*)pthread_getspecific(gRingKey);
+  if (!ring && !(ring = _hrc_ring_create()))
+    return;
+  HRefcountTraceRecord *r = &ring->records[ring->head & ring->mask];
+  r->timestamp = mach_absolute_time();
+  r->thread = ring->thread;
+  r->object = (uint64_t)(uintptr_t)logger;
+  r->op = op;
+  r->refcount = (uint32_t)[logger retainCount];
+  r->serial = serial;
+  // skip this function so that the first frame is the traced method
+  void *frames[H_REFCOUNT_TRACE_MAX_FRAMES];
+  NSUInteger i, n = h_stack_capture(frames, H_REFCOUNT_TRACE_MAX_FRAMES, 1);
+  r->frameCount = (uint32_t)n;
+  for (i = 0; i < n; i++)
+    r->frames[i] = (uint64_t)(uintptr_t)frames[i];
+  // publish the record
+  OSMemoryBarrier();
+  ring->head++;
+}
+
+
+static void _hrc_dump_at_exit() {
+  if (gDumpPathAtExit)
+    [HRefcountLogger writeTraceToPath:gDumpPathAtExit];
+}
+
+
+static NSString *_hrc_opname(uint32_t op) {
+  switch (op) {
+    case HRefcountOpInit: return @"init";
+    case HRefcountOpRetain: return @"retain";
+    case HRefcountOpRelease: return @"release";
+    case HRefcountOpDealloc: return @"dealloc";
+  }
+  return @"?";
+}
+
+
+// Find the base address of the image at |path| in this process, loading it if
+// needed. Returns 0 if the image can not be loaded.
+static uintptr_t _hrc_image_base(const char *path) {
+  int pass;
+  for (pass = 0; pass < 2; pass++) {
+    uint32_t i, count = _dyld_image_count();
+    for (i = 0; i < count; i++) {
+      if (strcmp(_dyld_get_image_name(i), path) == 0)
+        return (uintptr_t)_dyld_get_image_header(i);
+    }
+    if (pass == 0 && !dlopen(path, RTLD_LAZY|RTLD_LOCAL))
+      break;
+  }
+  return 0;
+}
+
+
+static int _hrc_record_cmp(const void *a, const void *b) {
+  uint64_t ta = ((const HRefcountTraceRecord*)a)->timestamp;
+  uint64_t tb = ((const HRefcountTraceRecord*)b)->timestamp;
+  return ta < tb ? -1 : (ta > tb ? 1 : 0);
+}
+
+// ----------------------------------------------------------------------------
+
 @implementation HRefcountLogger
 
 @synthesize name = name_, logRetain = logRetain_, logRelease = logRelease_,
@@ -25,13 +155,25 @@ uint32_t nextSerialNumber = 0;
 - (id)initWithName:(NSString*)name {
   self = [self _init];
   name_ = [name retain];
-  NSLog(@"%@ init (%lu)", self, [self retainCount]);
+  if (gTracing) {
+    if (name) {
+      @synchronized(gNames) {
+        [gNames setObject:name forKey:[NSNumber numberWithUnsignedInt:serialNumber_]];
+      }
+    }
+    _hrc_trace(self, serialNumber_, HRefcountOpInit);
+  } else {
+    NSLog(@"%@ init (%lu)", self, [self retainCount]);
+  }
   return self;
 }
 
 - (id)init {
   self = [self _init];
-  NSLog(@"%@ init (%lu)", self, [self retainCount]);
+  if (gTracing)
+    _hrc_trace(self, serialNumber_, HRefcountOpInit);
+  else
+    NSLog(@"%@ init (%lu)", self, [self retainCount]);
   return self;
 }
 
@@ -46,22 +188,34 @@ uint32_t nextSerialNumber = 0;
 - (void)noop {}
 
 - (id)retain {
-  if (logRetain_)
+  if (logRetain_) {
+    if (gTracing)
+      _hrc_trace(self, serialNumber_, HRefcountOpRetain);
+    else
       NSLog(@"%@ retain (before: %lu)\n%@", self, [self retainCount],
             [NSThread condensedStackTrace]);
+  }
   return [super retain];
 }
 
 - (void)release {
-  if (logRelease_)
-    NSLog(@"%@ release (before: %lu)\n%@", self, [self retainCount],
-          [NSThread condensedStackTrace]);
+  if (logRelease_) {
+    if (gTracing)
+      _hrc_trace(self, serialNumber_, HRefcountOpRelease);
+    else
+      NSLog(@"%@ release (before: %lu)\n%@", self, [self retainCount],
+            [NSThread condensedStackTrace]);
+  }
   [super release];
 }
 
 - (void)dealloc {
-  if (logDealloc_)
-    NSLog(@"%@ dealloc\n%@", self, [NSThread condensedStackTrace]);
+  if (logDealloc_) {
+    if (gTracing)
+      _hrc_trace(self, serialNumber_, HRefcountOpDealloc);
+    else
+      NSLog(@"%@ dealloc\n%@", self, [NSThread condensedStackTrace]);
+  }
   [name_ release];
   [super dealloc];
 }
@@ -75,4 +229,218 @@ uint32_t nextSerialNumber = 0;
   }
 }
 
+
+#pragma mark -
+#pragma mark Binary tracing
+
+
++ (BOOL)startTracingWithRecordsPerThread:(NSUInteger)capacity {
+  @synchronized(self) {
+    if (gTracing)
+      return NO;
+    if (gRingCapacity == 0) {
+      // the ring size can only be set once since rings are never freed
+      uint64_t n = 1;
+      while (n < capacity) n <<= 1;
+      gRingCapacity = n;
+      gNames = [[NSMutableDictionary alloc] init];
+      pthread_key_create(&gRingKey, NULL);
+      atexit(&_hrc_dump_at_exit);
+    }
+    OSMemoryBarrier();
+    gTracing = YES;
+  }
+  return YES;
+}
+
+
++ (void)stopTracing {
+  gTracing = NO;
+}
+
+
++ (BOOL)isTracing {
+  return gTracing;
+}
+
+
++ (void)setTraceDumpPathAtExit:(NSString*)path {
+  @synchronized(self) {
+    NSString *old = gDumpPathAtExit;
+    gDumpPathAtExit = [path copy];
+    [old release];
+  }
+}
+
+
++ (BOOL)writeTraceToPath:(NSString*)path {
+  NSMutableData *records = [NSMutableData data];
+  hrc_ring_t *ring;
+  for (ring = gRings; ring; ring = ring->next) {
+    uint64_t capacity = ring->mask + 1;
+    uint64_t head = ring->head;
+    OSMemoryBarrier();
+    uint64_t start = head > capacity ? head - capacity : 0;
+    NSUInteger offset = [records length];
+    uint64_t i;
+    for (i = start; i < head; i++) {
+      [records appendBytes:&ring->records[i & ring->mask]
+                    length:sizeof(HRefcountTraceRecord)];
+    }
+    // The owning thread might have overwritten the oldest records while we
+    // copied them. The slot of record |i| is reused by record |i+capacity|,
+    // which may have been in the process of being written at |head2|.
+    OSMemoryBarrier();
+    uint64_t head2 = ring->head;
+    if (head2 + 1 > start + capacity) {
+      uint64_t dropped = MIN(head2 + 1 - capacity - start, head - start);
+      [records replaceBytesInRange:NSMakeRange(offset,
+          (NSUInteger)dropped * sizeof(HRefcountTraceRecord))
+                         withBytes:NULL length:0];
+    }
+  }
+
+  NSMutableData *file = [NSMutableData data];
+  hrc_file_header_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, "HRCT", 4);
+  hdr.version = 1;
+  hdr.recordSize = sizeof(HRefcountTraceRecord);
+  mach_timebase_info_data_t tb;
+  mach_timebase_info(&tb);
+  hdr.timebaseNumer = tb.numer;
+  hdr.timebaseDenom = tb.denom;
+  hdr.imageCount = _dyld_image_count();
+  hdr.recordCount = [records length] / sizeof(HRefcountTraceRecord);
+  NSDictionary *names;
+  @synchronized(gNames) {
+    names = [[gNames copy] autorelease];
+  }
+  hdr.nameCount = (uint32_t)[names count];
+  [file appendBytes:&hdr length:sizeof(hdr)];
+
+  uint32_t i;
+  for (i = 0; i < hdr.imageCount; i++) {
+    uint64_t base = (uint64_t)(uintptr_t)_dyld_get_image_header(i);
+    const char *imagePath = _dyld_get_image_name(i);
+    uint32_t len = imagePath ? (uint32_t)strlen(imagePath) : 0;
+    [file appendBytes:&base length:sizeof(base)];
+    [file appendBytes:&len length:sizeof(len)];
+    [file appendBytes:imagePath length:len];
+  }
+  for (NSNumber *serial in names) {
+    NSData *utf8 = [[names objectForKey:serial]
+                    dataUsingEncoding:NSUTF8StringEncoding];
+    uint32_t n = [serial unsignedIntValue], len = (uint32_t)[utf8 length];
+    [file appendBytes:&n length:sizeof(n)];
+    [file appendBytes:&len length:sizeof(len)];
+    [file appendData:utf8];
+  }
+  [file appendData:records];
+  return [file writeToFile:path atomically:NO];
+}
+
+
++ (NSString*)decodeTraceAtPath:(NSString*)path {
+  NSData *file = [NSData dataWithContentsOfFile:path
+                                        options:NSDataReadingMapped error:nil];
+  const uint8_t *p = (const uint8_t*)[file bytes];
+  const uint8_t *end = p + [file length];
+  hrc_file_header_t hdr;
+  if ((size_t)(end - p) < sizeof(hdr)) return nil;
+  memcpy(&hdr, p, sizeof(hdr));
+  p += sizeof(hdr);
+  if (memcmp(hdr.magic, "HRCT", 4) != 0 || hdr.version != 1 ||
+      hdr.recordSize != sizeof(HRefcountTraceRecord)) {
+    return nil;
+  }
+
+  #define READ(dst, len) do { \
+    if ((size_t)(end - p) < (size_t)(len)) return nil; \
+    memcpy((dst), p, (len)); p += (len); \
+  } while (0)
+
+  // images, sorted by their base address in the traced process
+  uint64_t *bases = (uint64_t*)[[NSMutableData dataWithLength:
+      sizeof(uint64_t) * hdr.imageCount] mutableBytes];
+  NSMutableArray *paths = [NSMutableArray arrayWithCapacity:hdr.imageCount];
+  uint32_t i, j;
+  for (i = 0; i < hdr.imageCount; i++) {
+    uint32_t len;
+    READ(&bases[i], sizeof(uint64_t));
+    READ(&len, sizeof(len));
+    if ((size_t)(end - p) < len) return nil;
+    [paths addObject:[[[NSString alloc] initWithBytes:p length:len
+        encoding:NSUTF8StringEncoding] autorelease]];
+    p += len;
+  }
+  NSMutableDictionary *names = [NSMutableDictionary dictionary];
+  for (i = 0; i < hdr.nameCount; i++) {
+    uint32_t serial, len;
+    READ(&serial, sizeof(serial));
+    READ(&len, sizeof(len));
+    if ((size_t)(end - p) < len) return nil;
+    NSString *name = [[[NSString alloc] initWithBytes:p length:len
+        encoding:NSUTF8StringEncoding] autorelease];
+    p += len;
+    if (name)
+      [names setObject:name forKey:[NSNumber numberWithUnsignedInt:serial]];
+  }
+  #undef READ
+
+  uint64_t count = MIN(hdr.recordCount,
+                       (uint64_t)(end - p) / sizeof(HRefcountTraceRecord));
+  HRefcountTraceRecord *records = (HRefcountTraceRecord*)[[NSMutableData
+      dataWithBytes:p length:sizeof(HRefcountTraceRecord) * count] mutableBytes];
+  qsort(records, count, sizeof(HRefcountTraceRecord), &_hrc_record_cmp);
+
+  // map images of the traced process to this process
+  uintptr_t *localBases = (uintptr_t*)[[NSMutableData dataWithLength:
+      sizeof(uintptr_t) * hdr.imageCount] mutableBytes];
+  for (i = 0; i < hdr.imageCount; i++) {
+    localBases[i] = _hrc_image_base([[paths objectAtIndex:i]
+                                     fileSystemRepresentation]);
+  }
+
+  NSMutableString *out = [NSMutableString string];
+  uint64_t t0 = count ? records[0].timestamp : 0;
+  uint64_t n;
+  for (n = 0; n < count; n++) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    HRefcountTraceRecord *r = &records[n];
+    // translate addresses to this process
+    void *frames[H_REFCOUNT_TRACE_MAX_FRAMES];
+    NSUInteger frameCount = MIN(r->frameCount, H_REFCOUNT_TRACE_MAX_FRAMES);
+    for (i = 0; i < frameCount; i++) {
+      uint64_t addr = r->frames[i];
+      // find the image with the highest base address not above |addr|
+      int image = -1;
+      for (j = 0; j < hdr.imageCount; j++) {
+        if (bases[j] <= addr && (image == -1 || bases[j] > bases[image]))
+          image = j;
+      }
+      if (image != -1 && localBases[image])
+        addr = localBases[image] + (addr - bases[image]);
+      frames[i] = (void*)(uintptr_t)addr;
+    }
+
+    NSString *name = [names objectForKey:[NSNumber numberWithUnsignedInt:r->serial]];
+    NSString *desc = name ? [NSString stringWithFormat:@"⚑ %@", name] :
+        [NSString stringWithFormat:@"⚑ %@#%u", NSStringFromClass(self), r->serial];
+    double secs = (double)((r->timestamp - t0) * hdr.timebaseNumer /
+                           hdr.timebaseDenom) / 1e9;
+    [out appendFormat:@"[+%.6f thread 0x%llx 0x%llx] %@ %@", secs, r->thread,
+         r->object, desc, _hrc_opname(r->op)];
+    if (r->op == HRefcountOpRetain || r->op == HRefcountOpRelease)
+      [out appendFormat:@" (before: %u)", r->refcount];
+    else if (r->op == HRefcountOpInit)
+      [out appendFormat:@" (%u)", r->refcount];
+    [out appendFormat:@"\n%@\n", [NSThread condensedStackTraceWithAddresses:frames
+                                                                count:frameCount]];
+    [pool drain];
+  }
+
+  return out;
+}
+
 @end
@@ -0,0 +1,81 @@
+/*!
+ * An in-process sampling CPU profiler.
+ *
+ * @discussion
+ * While running, the process receives SIGPROF |frequency| times per second of
+ * consumed CPU time (setitimer(ITIMER_PROF)). The signal handler walks the
+ * interrupted thread's frame pointers and stores the return addresses in a
+ * buffer preallocated for that thread -- it neither allocates, locks nor
+ * symbolizes, so it is async-signal safe. Samples are symbolized and
+ * aggregated (using h_stack_symbolize) only when the output is requested.
+ *
+ * Output is in the "folded stacks" format understood by flamegraph tools, one
+ * line per unique stack with frames from the outermost to the innermost:
+ *
+ *    start;main;-[HDStream _read];-[Foo onData:] 42
+ *
+ * Only one profiler can run at a time since SIGPROF is process-wide. The
+ * SIGPROF handler is installed by the first -start and left in place after
+ * -stop (ignoring the signal while no profiler runs), replacing any handler
+ * the process had. Stacks are walked using frame pointers, so code compiled
+ * with -fomit-frame-pointer will appear truncated.
+ *
+ * Example:
+ *
+ *    HSamplingProfiler *profiler = [HSamplingProfiler new];
+ *    [profiler start];
+ *    // ... work ...
+ *    [profiler stop];
+ *    [profiler writeFoldedStacksToPath:@"/tmp/profile.folded"];
+ *    [profiler release];
+ *
+ */
+#import <Foundation/Foundation.h>
+
+@interface HSamplingProfiler : NSObject {
+  NSUInteger frequency_;
+  NSUInteger maximumThreads_;
+  NSUInteger bufferSizePerThread_;
+  struct hsp_state *state_;
+}
+
+// Samples per second of CPU time. Defaults to 100.
+@property NSUInteger frequency;
+
+/*!
+ * Maximum number of distinct threads which are sampled. Threads are registered
+ * (and their stack bounds looked up) outside of the signal handler: those
+ * running when the profiler starts and, on Darwin, those started while it's
+ * running. Samples from other threads are counted as dropped. Defaults to 64.
+ */
+@property NSUInteger maximumThreads;
+
+/*!
+ * Size in bytes of each thread's sample buffer. Defaults to 1 MB (around 3000
+ * samples with 40 frames each on 64-bit). Buffers are reserved when the
+ * profiler starts but memory is only committed as it's used. Samples which do
+ * not fit are counted as dropped.
+ */
+@property NSUInteger bufferSizePerThread;
+
+@property(readonly) BOOL isRunning;
+@property(readonly) NSUInteger sampleCount;
+@property(readonly) NSUInteger droppedSampleCount;
+
+/*!
+ * Start sampling. Discards any previously recorded samples. Returns NO if this
+ * or another profiler is already running or if the buffers could not be
+ * reserved.
+ */
+- (BOOL)start;
+
+// Stop sampling. Recorded samples are kept until the next start.
+- (void)stop;
+
+// Recorded samples in folded stacks format
+- (NSString*)foldedStacks;
+
+// Write foldedStacks to |path|
+- (BOOL)writeFoldedStacksToPath:(NSString*)path;
+
+@end
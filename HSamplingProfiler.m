@@ -0,0 +1,368 @@
+#import "HSamplingProfiler.h"
+#import "NSThread-condensedStackTrace.h"
+#import "hcommon.h"
+#import <libkern/OSAtomic.h>
+#import <sys/time.h>
+#import <sys/mman.h>
+#import <pthread.h>
+#import <signal.h>
+#import <sys/ucontext.h>
+#import <errno.h>
+#if __APPLE__
+  #import <mach/mach.h>
+  #if defined(__has_include) && __has_include(<pthread/introspection.h>)
+    #import <pthread/introspection.h>
+    #define HSP_USE_INTROSPECTION 1
+  #endif
+#endif
+
+#define HSP_MAX_FRAMES 128
+
+// Per-thread sample buffer. A sample is stored as a count followed by that
+// many return addresses, innermost first.
+typedef struct {
+  pthread_t thread;        // NULL until claimed
+  uintptr_t stackLow;
+  uintptr_t stackHigh;
+  uintptr_t *buf;
+  size_t capacity;         // in words
+  volatile size_t used;    // in words
+} hsp_thread_t;
+
+typedef struct hsp_state {
+  hsp_thread_t *threads;
+  uint32_t maxThreads;
+  volatile uint32_t claimedThreads;
+  volatile int32_t samples;
+  volatile int32_t dropped;
+  void *mem;               // mmap'ed sample buffers
+  size_t memSize;
+  struct itimerval oldTimer;
+  BOOL running;
+} hsp_state_t;
+
+// The state of the running profiler, read by the signal handler
+static hsp_state_t * volatile gState = NULL;
+
+// Signal handlers and thread hooks which might be using gState. Incremented
+// before gState is read, so once gState has been cleared and this drops to
+// zero, nobody is using the old state.
+static volatile int32_t gActive = 0;
+
+
+/*
+ * Claim a slot for |thread| and cache its stack bounds. Looking up the bounds
+ * is not async-signal safe, so this is never called from the signal handler:
+ * threads are registered when the profiler starts and, while it's running, as
+ * they start.
+ */
+static void _hsp_register_thread(hsp_state_t *st, pthread_t thread) {
+  uint32_t i = h_atomic_inc_and_return_prev(&st->claimedThreads);
+  if (i >= st->maxThreads)
+    return;
+  hsp_thread_t *t = &st->threads[i];
+  #if __APPLE__
+  t->stackHigh = (uintptr_t)pthread_get_stackaddr_np(thread);
+  t->stackLow = t->stackHigh - pthread_get_stacksize_np(thread);
+  #endif
+  OSMemoryBarrier();
+  t->thread = thread;
+}
+
+
+// Register all threads of the process
+static void _hsp_register_threads(hsp_state_t *st) {
+  #if __APPLE__
+  thread_act_array_t list;
+  mach_msg_type_number_t count, i;
+  if (task_threads(mach_task_self(), &list, &count) != KERN_SUCCESS)
+    return;
+  for (i = 0; i < count; i++) {
+    pthread_t thread = pthread_from_mach_thread_np(list[i]);
+    if (thread)
+      _hsp_register_thread(st, thread);
+    mach_port_deallocate(mach_task_self(), list[i]);
+  }
+  vm_deallocate(mach_task_self(), (vm_address_t)list,
+                count * sizeof(thread_act_t));
+  #else
+  _hsp_register_thread(st, pthread_self());
+  #endif
+}
+
+
+#if HSP_USE_INTROSPECTION
+static pthread_introspection_hook_t gPrevThreadHook = NULL;
+
+// Registers threads started while the profiler is running
+static void _hsp_thread_hook(unsigned int event, pthread_t thread, void *addr,
+                             size_t size) {
+  if (event == PTHREAD_INTROSPECTION_THREAD_START) {
+    h_atomic_inc(&gActive);
+    hsp_state_t *st = gState;
+    if (st && st->running)
+      _hsp_register_thread(st, thread);
+    h_atomic_dec(&gActive);
+  }
+  if (gPrevThreadHook)
+    gPrevThreadHook(event, thread, addr, size);
+}
+
+static void _hsp_install_thread_hook(void *unused) {
+  gPrevThreadHook = pthread_introspection_hook_install(&_hsp_thread_hook);
+}
+#endif
+
+
+// Find the slot of a registered thread. Async-signal safe.
+static hsp_thread_t *_hsp_thread(hsp_state_t *st, pthread_t self) {
+  uint32_t i, claimed = MIN(st->claimedThreads, st->maxThreads);
+  for (i = 0; i < claimed; i++) {
+    if (st->threads[i].thread && pthread_equal(st->threads[i].thread, self))
+      return &st->threads[i];
+  }
+  return NULL;
+}
+
+
+// Fetch pc and frame pointer of the interrupted context
+static BOOL _hsp_context(void *uctx, uintptr_t *pc, uintptr_t *fp) {
+  #if __APPLE__
+    ucontext_t *uc = (ucontext_t*)uctx;
+    #if defined(__x86_64__)
+      *pc = uc->uc_mcontext->__ss.__rip;
+      *fp = uc->uc_mcontext->__ss.__rbp;
+    #elif defined(__i386__)
+      *pc = uc->uc_mcontext->__ss.__eip;
+      *fp = uc->uc_mcontext->__ss.__ebp;
+    #elif defined(__arm64__)
+      *pc = uc->uc_mcontext->__ss.__pc;
+      *fp = uc->uc_mcontext->__ss.__fp;
+    #else
+      return NO;
+    #endif
+    return YES;
+  #else
+    return NO;
+  #endif
+}
+
+
+static void _hsp_sigprof(int sig, siginfo_t *info, void *uctx) {
+  int savedErrno = errno;
+  h_atomic_inc(&gActive);
+  hsp_state_t *st = gState;
+  if (!st)
+    goto done;
+  hsp_thread_t *t;
+  uintptr_t pc, fp;
+  if (!st->running || !(t = _hsp_thread(st, pthread_self())) ||
+      !_hsp_context(uctx, &pc, &fp)) {
+    h_atomic_inc(&st->dropped);
+    goto done;
+  }
+
+  // walk the frame pointer chain
+  uintptr_t pcs[HSP_MAX_FRAMES];
+  size_t n = 0;
+  pcs[n++] = pc;
+  while (n < HSP_MAX_FRAMES && (fp & (sizeof(uintptr_t)-1)) == 0 &&
+         fp >= t->stackLow && fp + 2*sizeof(uintptr_t) <= t->stackHigh) {
+    uintptr_t next = ((uintptr_t*)fp)[0];
+    uintptr_t ret = ((uintptr_t*)fp)[1];
+    if (ret == 0) break;
+    pcs[n++] = ret;
+    if (next <= fp) break; // stacks grow down, so callers are above us
+    fp = next;
+  }
+
+  if (t->used + n + 1 > t->capacity) {
+    h_atomic_inc(&st->dropped);
+    goto done;
+  }
+  t->buf[t->used] = n;
+  memcpy(&t->buf[t->used + 1], pcs, n * sizeof(uintptr_t));
+  OSMemoryBarrier();
+  t->used += n + 1;
+  h_atomic_inc(&st->samples);
+
+done:
+  h_atomic_dec(&gActive);
+  errno = savedErrno;
+}
+
+
+/*
+ * Installed by the first -start and never removed: a SIGPROF can still be
+ * pending when -stop returns, and restoring the default action would let it
+ * terminate the process. Without a running profiler the handler does nothing.
+ */
+static void _hsp_install_handler(void *unused) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = &_hsp_sigprof;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGPROF, &sa, NULL);
+}
+
+
+static void _hsp_state_free(hsp_state_t *st) {
+  if (!st) return;
+  if (st->mem) munmap(st->mem, st->memSize);
+  free(st->threads);
+  free(st);
+}
+
+
+@implementation HSamplingProfiler
+
+@synthesize frequency = frequency_,
+            maximumThreads = maximumThreads_,
+            bufferSizePerThread = bufferSizePerThread_;
+
+- (id)init {
+  if ((self = [super init])) {
+    frequency_ = 100;
+    maximumThreads_ = 64;
+    bufferSizePerThread_ = 1024*1024;
+  }
+  return self;
+}
+
+
+- (void)dealloc {
+  [self stop];
+  _hsp_state_free(state_);
+  [super dealloc];
+}
+
+
+- (BOOL)isRunning {
+  return state_ && state_->running;
+}
+
+
+- (NSUInteger)sampleCount {
+  return state_ ? state_->samples : 0;
+}
+
+
+- (NSUInteger)droppedSampleCount {
+  return state_ ? state_->dropped : 0;
+}
+
+
+- (BOOL)start {
+  if (self.isRunning || gState)
+    return NO;
+  _hsp_state_free(state_);
+  state_ = NULL;
+
+  hsp_state_t *st = (hsp_state_t*)calloc(1, sizeof(hsp_state_t));
+  st->maxThreads = (uint32_t)maximumThreads_;
+  st->threads = (hsp_thread_t*)calloc(st->maxThreads, sizeof(hsp_thread_t));
+  size_t words = bufferSizePerThread_ / sizeof(uintptr_t);
+  st->memSize = words * sizeof(uintptr_t) * st->maxThreads;
+  st->mem = mmap(NULL, st->memSize, PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANON, -1, 0);
+  if (st->mem == MAP_FAILED) {
+    st->mem = NULL;
+    _hsp_state_free(st);
+    return NO;
+  }
+  uint32_t i;
+  for (i = 0; i < st->maxThreads; i++) {
+    st->threads[i].buf = (uintptr_t*)st->mem + (words * i);
+    st->threads[i].capacity = words;
+  }
+  if (!h_casptr(&gState, NULL, st)) {
+    _hsp_state_free(st);
+    return NO;
+  }
+  state_ = st;
+  st->running = YES;
+  #if HSP_USE_INTROSPECTION
+  static dispatch_once_t once;
+  dispatch_once_f(&once, NULL, &_hsp_install_thread_hook);
+  #endif
+  _hsp_register_threads(st);
+
+  static dispatch_once_t handlerOnce;
+  dispatch_once_f(&handlerOnce, NULL, &_hsp_install_handler);
+
+  struct itimerval timer;
+  long usec = 1000000 / (long)MAX(frequency_, 1);
+  timer.it_interval.tv_sec = usec / 1000000;
+  timer.it_interval.tv_usec = usec % 1000000;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, &st->oldTimer);
+  return YES;
+}
+
+
+- (void)stop {
+  hsp_state_t *st = state_;
+  if (!st || !st->running)
+    return;
+  setitimer(ITIMER_PROF, &st->oldTimer, NULL);
+  st->running = NO;
+  // handlers which run from now on find no state; wait for the ones which
+  // might already have picked it up
+  h_casptr(&gState, st, NULL);
+  OSMemoryBarrier();
+  while (gActive)
+    pthread_yield_np();
+  // the SIGPROF handler stays installed (see _hsp_install_handler)
+}
+
+
+- (NSString*)foldedStacks {
+  hsp_state_t *st = state_;
+  if (!st)
+    return @"";
+  NSCountedSet *stacks = [[NSCountedSet alloc] init];
+  NSMutableArray *frames = [NSMutableArray arrayWithCapacity:HSP_MAX_FRAMES];
+  uint32_t i, claimed = MIN(st->claimedThreads, st->maxThreads);
+  for (i = 0; i < claimed; i++) {
+    hsp_thread_t *t = &st->threads[i];
+    size_t used = t->used;
+    OSMemoryBarrier();
+    size_t pos = 0;
+    while (pos < used) {
+      NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+      size_t n = t->buf[pos], j;
+      [frames removeAllObjects];
+      // outermost first
+      for (j = n; j > 0; j--) {
+        uintptr_t pc = t->buf[pos + j];
+        // return addresses point after the call, so look up the call itself
+        const void *addr = (const void*)(j > 1 ? pc - 1 : pc);
+        const char *image = NULL, *symbol = NULL;
+        h_stack_symbolize(addr, &image, &symbol);
+        if (symbol) {
+          [frames addObject:[NSString stringWithUTF8String:symbol]];
+        } else {
+          [frames addObject:[NSString stringWithFormat:@"%s`%p",
+                             image ? image : "???", addr]];
+        }
+      }
+      [stacks addObject:[frames componentsJoinedByString:@";"]];
+      pos += n + 1;
+      [pool drain];
+    }
+  }
+  NSMutableString *out = [NSMutableString string];
+  for (NSString *stack in stacks)
+    [out appendFormat:@"%@ %lu\n", stack, (unsigned long)[stacks countForObject:stack]];
+  [stacks release];
+  return out;
+}
+
+
+- (BOOL)writeFoldedStacksToPath:(NSString*)path {
+  return [[self foldedStacks] writeToFile:path atomically:NO
+                                 encoding:NSUTF8StringEncoding error:nil];
+}
+
+@end
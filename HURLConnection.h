@@ -1,14 +1,22 @@
+#import "HURLResponseSink.h"
+
 /*!
  * A URL connection which uses block handlers.
  *
  * Note: a connection object holds a reference to itself while active which is
  * released after the connection has completed (i.e. you don't need to handle
  * reference counting with respect to the connection lifetime).
+ *
+ * The response body is handed to |sink| as it arrives and whatever the sink
+ * returns when closed is passed as data to onComplete. When neither |sink| nor
+ * |onData| is set, the body is accumulated by a HURLDataSink (presized from
+ * the response's expected content length).
  */
 @interface HURLConnection : NSURLConnection {
   NSError*(^onResponse_)(NSURLResponse *response);
   NSError*(^onData_)(NSData *data);
   void(^onComplete_)(NSError *err, NSData *data);
+  id<HURLResponseSink> sink_;
   BOOL didRetainSelf_;
 }
 
@@ -16,12 +24,21 @@
 @property(copy) NSError* (^onData)(NSData *data);
 @property(copy) void     (^onComplete)(NSError *err, NSData *data);
 
+// Where the response body goes. Must be set before the response arrives.
+@property(retain) id<HURLResponseSink> sink;
+
 + (HURLConnection*)connectionWithRequest:(NSURLRequest*)request
                          onResponseBlock:(NSError*(^)(NSURLResponse *response))onResponse
                              onDataBlock:(NSError*(^)(NSData *data))onData
                          onCompleteBlock:(void(^)(NSError *err, NSData *data))onComplete
                         startImmediately:(BOOL)startImmediately;
 
++ (HURLConnection*)connectionWithRequest:(NSURLRequest*)request
+                                    sink:(id<HURLResponseSink>)sink
+                         onResponseBlock:(NSError*(^)(NSURLResponse *response))onResponse
+                         onCompleteBlock:(void(^)(NSError *err, NSData *data))onComplete
+                        startImmediately:(BOOL)startImmediately;
+
 - (id)initWithRequest:(NSURLRequest *)request
       onResponseBlock:(NSError*(^)(NSURLResponse *response))onResponse
           onDataBlock:(NSError*(^)(NSData *data))onData
@@ -41,4 +58,9 @@
                              onCompleteBlock:(void(^)(NSError *err, NSData *data))onComplete
                             startImmediately:(BOOL)startImmediately;
 
+- (HURLConnection*)fetchToSink:(id<HURLResponseSink>)sink
+               onResponseBlock:(NSError*(^)(NSURLResponse *response))onResponse
+               onCompleteBlock:(void(^)(NSError *err, NSData *data))onComplete
+              startImmediately:(BOOL)startImmediately;
+
 @end
\ No newline at end of file
@@ -1,55 +1,67 @@
 #import "HURLConnection.h"
 
 @interface _HURLConnectionDelegate : NSObject {
-  NSMutableData *receivedData_;
+  id<HURLResponseSink> sink_;
+  BOOL completed_;
 }
 @end
 @implementation _HURLConnectionDelegate
 
 - (void)dealloc {
-  if (receivedData_) [receivedData_ release];
+  if (sink_) [sink_ release];
   [super dealloc];
 }
 
 - (void)_onComplete:(HURLConnection*)c error:(NSError*)err cancel:(BOOL)cancel {
+  completed_ = YES;
   if (cancel)
     [c cancel];
+  NSData *data = sink_ ? [sink_ closeWithError:err] : nil;
   if (c.onComplete)
-    c.onComplete(err, receivedData_);
+    c.onComplete(err, data);
   [c release];
   [self release];
 }
 
 - (void)connection:(HURLConnection*)c didReceiveResponse:(NSURLResponse *)re {
   assert([c isKindOfClass:[HURLConnection class]]);
-  if (c.onResponse) {
-    NSError *error = c.onResponse(re);
-    if (error) [self _onComplete:c error:error cancel:YES];
+  if (completed_) return;
+  NSError *error = nil;
+  if (c.onResponse && (error = c.onResponse(re))) {
+    [self _onComplete:c error:error cancel:YES];
+    return;
   }
-  if (!c.onData && !receivedData_) {
-    receivedData_ = [[NSMutableData alloc] init];
-  } else if (receivedData_) {
-    [receivedData_ setLength:0];
+  if (!sink_) {
+    if (c.sink)
+      sink_ = [c.sink retain];
+    else if (!c.onData)
+      sink_ = [[HURLDataSink alloc] init];
   }
+  if (sink_ && (error = [sink_ openWithResponse:re]))
+    [self _onComplete:c error:error cancel:YES];
 }
 
 - (void)connection:(HURLConnection *)c didReceiveData:(NSData *)data {
   assert([c isKindOfClass:[HURLConnection class]]);
-  if (c.onData) {
-    NSError *error = c.onData(data);
-    if (error) [self _onComplete:c error:error cancel:YES];
+  if (completed_) return;
+  NSError *error = nil;
+  if (c.onData && (error = c.onData(data))) {
+    [self _onComplete:c error:error cancel:YES];
+    return;
   }
-  if (receivedData_)
-    [receivedData_ appendData:data];
+  if (sink_ && (error = [sink_ writeData:data]))
+    [self _onComplete:c error:error cancel:YES];
 }
 
 - (void)connection:(HURLConnection *)c didFailWithError:(NSError *)error {
   assert([c isKindOfClass:[HURLConnection class]]);
+  if (completed_) return;
   [self _onComplete:c error:error cancel:NO];
 }
 
 - (void)connectionDidFinishLoading:(HURLConnection *)c {
   assert([c isKindOfClass:[HURLConnection class]]);
+  if (completed_) return;
   [self _onComplete:c error:nil cancel:NO];
 }
 
@@ -61,7 +73,8 @@
 
 @synthesize onResponse = onResponse_,
             onData = onData_,
-            onComplete = onComplete_;
+            onComplete = onComplete_,
+            sink = sink_;
 
 
 + (HURLConnection*)connectionWithRequest:(NSURLRequest*)request
@@ -78,6 +91,23 @@
 }
 
 
++ (HURLConnection*)connectionWithRequest:(NSURLRequest*)request
+                                    sink:(id<HURLResponseSink>)sink
+                         onResponseBlock:(NSError*(^)(NSURLResponse *response))onResponse
+                         onCompleteBlock:(void(^)(NSError *err, NSData *data))onComplete
+                        startImmediately:(BOOL)startImmediately {
+  HURLConnection *conn = [[self alloc] initWithRequest:request
+                                       onResponseBlock:onResponse
+                                           onDataBlock:nil
+                                       onCompleteBlock:onComplete
+                                      startImmediately:NO];
+  conn.sink = sink;
+  if (startImmediately)
+    [conn start];
+  return [conn autorelease];
+}
+
+
 - (id)initWithRequest:(NSURLRequest *)request
       onResponseBlock:(NSError*(^)(NSURLResponse *response))onResponse
           onDataBlock:(NSError*(^)(NSData *data))onData
@@ -126,6 +156,7 @@
   if (onResponse_) { [onResponse_ release]; onResponse_ = nil; }
   if (onData_) { [onData_ release]; onData_ = nil; }
   if (onComplete_) { [onComplete_ release]; onComplete_ = nil; }
+  if (sink_) { [sink_ release]; sink_ = nil; }
   [super dealloc];
 }
 
@@ -159,4 +190,19 @@
                        startImmediately:startImmediately];
 }
 
+- (HURLConnection*)fetchToSink:(id<HURLResponseSink>)sink
+               onResponseBlock:(NSError*(^)(NSURLResponse *response))onResponse
+               onCompleteBlock:(void(^)(NSError *err, NSData *data))onComplete
+              startImmediately:(BOOL)startImmediately {
+  NSURLRequest *req =
+      [NSURLRequest requestWithURL:self
+                       cachePolicy:NSURLRequestUseProtocolCachePolicy
+                   timeoutInterval:60.0];
+  return [HURLConnection connectionWithRequest:req
+                                          sink:sink
+                               onResponseBlock:onResponse
+                               onCompleteBlock:onComplete
+                              startImmediately:startImmediately];
+}
+
 @end
\ No newline at end of file
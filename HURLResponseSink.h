@@ -0,0 +1,126 @@
+/*!
+ * Response sinks consume the body of a HURLConnection as it arrives, instead
+ * of the whole body being accumulated in memory.
+ *
+ * @discussion
+ * A sink receives -openWithResponse: when a response arrives, -writeData: for
+ * each piece of the body and finally -closeWithError: which returns the data
+ * passed on to the connection's onComplete block. -openWithResponse: might be
+ * called more than once for the same connection (e.g. for multipart responses)
+ * in which case the sink should discard what it has received so far.
+ *
+ * Returning an error from -openWithResponse: or -writeData: cancels the
+ * connection and the error is passed to onComplete.
+ */
+#import <Foundation/Foundation.h>
+
+@class HDStream;
+
+@protocol HURLResponseSink <NSObject>
+- (NSError*)openWithResponse:(NSURLResponse*)response;
+- (NSError*)writeData:(NSData*)data;
+- (NSData*)closeWithError:(NSError*)error;
+@end
+
+// ----------------------------------------------------------------------------
+
+/*!
+ * Accumulates the body in memory. The buffer is presized from the response's
+ * expected content length (up to |maximumPresize| bytes) so that a body with a
+ * known length is received without reallocation. This is what HURLConnection
+ * uses when neither |sink| nor |onData| is set.
+ */
+@interface HURLDataSink : NSObject <HURLResponseSink> {
+  NSMutableData *data_;
+  NSUInteger maximumPresize_;
+}
+// Accumulated data (reset for each response)
+@property(readonly) NSMutableData *data;
+// Largest expected content length to trust for presizing. Defaults to 64 MB.
+@property NSUInteger maximumPresize;
++ (id)sink;
+@end
+
+// ----------------------------------------------------------------------------
+
+/*!
+ * Writes the body to a file descriptor as it arrives. Writes are synchronous,
+ * so memory use is bounded to a single received chunk regardless of the size
+ * of the body. Passes nil data to onComplete.
+ */
+@interface HURLFileDescriptorSink : NSObject <HURLResponseSink> {
+  int fd_;
+  BOOL closeWhenDone_;
+  off_t startOffset_; // -1 if the fd is not seekable
+  unsigned long long bytesWritten_;
+}
+@property(readonly) int fileDescriptor;
+@property(readonly) unsigned long long bytesWritten;
+
+// Write to |fd|, optionally closing it when the connection completes
++ (id)sinkWithFileDescriptor:(int)fd closeWhenDone:(BOOL)closeWhenDone;
+- (id)initWithFileDescriptor:(int)fd closeWhenDone:(BOOL)closeWhenDone;
+
+// Create (or truncate) the file at |path| and write to it. Returns nil on error.
+- (id)initWithPath:(NSString*)path;
+@end
+
+// ----------------------------------------------------------------------------
+
+/*!
+ * Writes the body to a HDStream. Note that HDStream writes are buffered; when
+ * the stream can not keep up with the connection, buffered data grows. Passes
+ * nil data to onComplete.
+ */
+@interface HURLStreamSink : NSObject <HURLResponseSink> {
+  HDStream *stream_;
+}
+@property(readonly) HDStream *stream;
++ (id)sinkWithStream:(HDStream*)stream;
+- (id)initWithStream:(HDStream*)stream;
+@end
+
+// ----------------------------------------------------------------------------
+
+typedef enum {
+  HURLDigestMD5 = 0,
+  HURLDigestSHA1,
+  HURLDigestSHA256,
+} HURLDigestAlgorithm;
+
+/*!
+ * Computes a digest of the body on the fly. The raw digest bytes are passed as
+ * data to onComplete.
+ */
+@interface HURLDigestSink : NSObject <HURLResponseSink> {
+  HURLDigestAlgorithm algorithm_;
+  void *context_;
+  NSData *digest_;
+}
+// The digest, available after the connection completed
+@property(readonly) NSData *digest;
++ (id)sinkWithAlgorithm:(HURLDigestAlgorithm)algorithm;
+- (id)initWithAlgorithm:(HURLDigestAlgorithm)algorithm;
+@end
+
+// ----------------------------------------------------------------------------
+
+/*!
+ * Passes the body through a transform block before handing it to another sink.
+ *
+ * @discussion
+ * |transform| is called with each piece of the body and returns the data to
+ * write to |sink| (or nil to write nothing). When the connection completes,
+ * |transform| is called once more with nil data to flush anything it has
+ * buffered.
+ */
+@interface HURLTransformSink : NSObject <HURLResponseSink> {
+  id<HURLResponseSink> sink_;
+  NSData*(^transform_)(NSData *data);
+}
+@property(readonly) id<HURLResponseSink> sink;
++ (id)sinkWithSink:(id<HURLResponseSink>)sink
+    transformBlock:(NSData*(^)(NSData *data))transform;
+- (id)initWithSink:(id<HURLResponseSink>)sink
+    transformBlock:(NSData*(^)(NSData *data))transform;
+@end
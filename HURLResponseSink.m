@@ -0,0 +1,294 @@
+#import "HURLResponseSink.h"
+#import "HDStream.h"
+#import <CommonCrypto/CommonDigest.h>
+#import <fcntl.h>
+#import <unistd.h>
+
+static NSError *_posix_error(int errnum) {
+  return [NSError errorWithDomain:NSPOSIXErrorDomain code:errnum userInfo:nil];
+}
+
+// ----------------------------------------------------------------------------
+
+@implementation HURLDataSink
+
+@synthesize data = data_, maximumPresize = maximumPresize_;
+
++ (id)sink {
+  return [[self new] autorelease];
+}
+
+- (id)init {
+  if ((self = [super init])) {
+    maximumPresize_ = 64*1024*1024;
+  }
+  return self;
+}
+
+- (void)dealloc {
+  [data_ release];
+  [super dealloc];
+}
+
+- (NSError*)openWithResponse:(NSURLResponse*)response {
+  long long expected = [response expectedContentLength];
+  NSUInteger capacity = 0;
+  if (expected > 0 && (unsigned long long)expected <= maximumPresize_)
+    capacity = (NSUInteger)expected;
+  if (data_ && [data_ length] == 0 && capacity == 0) {
+    // nothing received yet and no size hint -- keep what we have
+    return nil;
+  }
+  [data_ release];
+  data_ = [[NSMutableData alloc] initWithCapacity:capacity];
+  return nil;
+}
+
+- (NSError*)writeData:(NSData*)data {
+  if (!data_)
+    data_ = [[NSMutableData alloc] init];
+  [data_ appendData:data];
+  return nil;
+}
+
+- (NSData*)closeWithError:(NSError*)error {
+  return data_;
+}
+
+@end
+
+// ----------------------------------------------------------------------------
+
+@implementation HURLFileDescriptorSink
+
+@synthesize fileDescriptor = fd_, bytesWritten = bytesWritten_;
+
++ (id)sinkWithFileDescriptor:(int)fd closeWhenDone:(BOOL)closeWhenDone {
+  return [[[self alloc] initWithFileDescriptor:fd
+                                 closeWhenDone:closeWhenDone] autorelease];
+}
+
+- (id)initWithFileDescriptor:(int)fd closeWhenDone:(BOOL)closeWhenDone {
+  if ((self = [super init])) {
+    fd_ = fd;
+    closeWhenDone_ = closeWhenDone;
+    startOffset_ = lseek(fd, 0, SEEK_CUR);
+  }
+  return self;
+}
+
+- (id)initWithPath:(NSString*)path {
+  int fd = open([path fileSystemRepresentation], O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd == -1) {
+    [self release];
+    return nil;
+  }
+  return [self initWithFileDescriptor:fd closeWhenDone:YES];
+}
+
+- (void)dealloc {
+  if (closeWhenDone_ && fd_ != -1)
+    close(fd_);
+  [super dealloc];
+}
+
+- (NSError*)openWithResponse:(NSURLResponse*)response {
+  if (bytesWritten_ != 0) {
+    // discard the previous response if we can
+    if (startOffset_ == -1)
+      return _posix_error(ESPIPE);
+    if (ftruncate(fd_, startOffset_) == -1 ||
+        lseek(fd_, startOffset_, SEEK_SET) == -1) {
+      return _posix_error(errno);
+    }
+    bytesWritten_ = 0;
+  }
+  return nil;
+}
+
+- (NSError*)writeData:(NSData*)data {
+  const char *buf = (const char*)[data bytes];
+  size_t len = [data length];
+  while (len) {
+    ssize_t n = write(fd_, buf, len);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return _posix_error(errno);
+    }
+    buf += n;
+    len -= n;
+    bytesWritten_ += n;
+  }
+  return nil;
+}
+
+- (NSData*)closeWithError:(NSError*)error {
+  if (closeWhenDone_ && fd_ != -1) {
+    close(fd_);
+    fd_ = -1;
+  }
+  return nil;
+}
+
+@end
+
+// ----------------------------------------------------------------------------
+
+@implementation HURLStreamSink
+
+@synthesize stream = stream_;
+
++ (id)sinkWithStream:(HDStream*)stream {
+  return [[[self alloc] initWithStream:stream] autorelease];
+}
+
+- (id)initWithStream:(HDStream*)stream {
+  if ((self = [super init])) {
+    stream_ = [stream retain];
+  }
+  return self;
+}
+
+- (void)dealloc {
+  [stream_ release];
+  [super dealloc];
+}
+
+- (NSError*)openWithResponse:(NSURLResponse*)response {
+  return nil;
+}
+
+- (NSError*)writeData:(NSData*)data {
+  if (!stream_.isWritable)
+    return _posix_error(EPIPE);
+  [stream_ writeData:data];
+  return nil;
+}
+
+- (NSData*)closeWithError:(NSError*)error {
+  return nil;
+}
+
+@end
+
+// ----------------------------------------------------------------------------
+
+typedef union {
+  CC_MD5_CTX md5;
+  CC_SHA1_CTX sha1;
+  CC_SHA256_CTX sha256;
+} _hurl_digest_ctx_t;
+
+@implementation HURLDigestSink
+
+@synthesize digest = digest_;
+
++ (id)sinkWithAlgorithm:(HURLDigestAlgorithm)algorithm {
+  return [[[self alloc] initWithAlgorithm:algorithm] autorelease];
+}
+
+- (id)initWithAlgorithm:(HURLDigestAlgorithm)algorithm {
+  if ((self = [super init])) {
+    algorithm_ = algorithm;
+    context_ = malloc(sizeof(_hurl_digest_ctx_t));
+  }
+  return self;
+}
+
+- (void)dealloc {
+  free(context_);
+  [digest_ release];
+  [super dealloc];
+}
+
+- (NSError*)openWithResponse:(NSURLResponse*)response {
+  _hurl_digest_ctx_t *ctx = (_hurl_digest_ctx_t*)context_;
+  switch (algorithm_) {
+    case HURLDigestMD5: CC_MD5_Init(&ctx->md5); break;
+    case HURLDigestSHA1: CC_SHA1_Init(&ctx->sha1); break;
+    case HURLDigestSHA256: CC_SHA256_Init(&ctx->sha256); break;
+  }
+  return nil;
+}
+
+- (NSError*)writeData:(NSData*)data {
+  _hurl_digest_ctx_t *ctx = (_hurl_digest_ctx_t*)context_;
+  const void *bytes = [data bytes];
+  CC_LONG len = (CC_LONG)[data length];
+  switch (algorithm_) {
+    case HURLDigestMD5: CC_MD5_Update(&ctx->md5, bytes, len); break;
+    case HURLDigestSHA1: CC_SHA1_Update(&ctx->sha1, bytes, len); break;
+    case HURLDigestSHA256: CC_SHA256_Update(&ctx->sha256, bytes, len); break;
+  }
+  return nil;
+}
+
+- (NSData*)closeWithError:(NSError*)error {
+  if (error) return nil;
+  _hurl_digest_ctx_t *ctx = (_hurl_digest_ctx_t*)context_;
+  unsigned char md[CC_SHA256_DIGEST_LENGTH];
+  NSUInteger len = 0;
+  switch (algorithm_) {
+    case HURLDigestMD5:
+      CC_MD5_Final(md, &ctx->md5); len = CC_MD5_DIGEST_LENGTH; break;
+    case HURLDigestSHA1:
+      CC_SHA1_Final(md, &ctx->sha1); len = CC_SHA1_DIGEST_LENGTH; break;
+    case HURLDigestSHA256:
+      CC_SHA256_Final(md, &ctx->sha256); len = CC_SHA256_DIGEST_LENGTH; break;
+  }
+  [digest_ release];
+  digest_ = [[NSData alloc] initWithBytes:md length:len];
+  return digest_;
+}
+
+@end
+
+// ----------------------------------------------------------------------------
+
+@implementation HURLTransformSink
+
+@synthesize sink = sink_;
+
++ (id)sinkWithSink:(id<HURLResponseSink>)sink
+    transformBlock:(NSData*(^)(NSData *data))transform {
+  return [[[self alloc] initWithSink:sink transformBlock:transform] autorelease];
+}
+
+- (id)initWithSink:(id<HURLResponseSink>)sink
+    transformBlock:(NSData*(^)(NSData *data))transform {
+  if ((self = [super init])) {
+    sink_ = [sink retain];
+    transform_ = [transform copy];
+  }
+  return self;
+}
+
+- (void)dealloc {
+  [sink_ release];
+  [transform_ release];
+  [super dealloc];
+}
+
+- (NSError*)openWithResponse:(NSURLResponse*)response {
+  return [sink_ openWithResponse:response];
+}
+
+- (NSError*)writeData:(NSData*)data {
+  NSData *output = transform_(data);
+  if (output && [output length])
+    return [sink_ writeData:output];
+  return nil;
+}
+
+- (NSData*)closeWithError:(NSError*)error {
+  if (!error) {
+    NSData *output = transform_(nil);
+    if (output && [output length]) {
+      NSError *err = [sink_ writeData:output];
+      if (err) error = err;
+    }
+  }
+  return [sink_ closeWithError:error];
+}
+
+@end
@@ -1,8 +1,38 @@
 #import <Cocoa/Cocoa.h>
 
+/*!
+ * Capture up to |maxCount| return addresses of the calling thread's stack into
+ * |addresses|, innermost first, skipping the |skip| innermost frames (the
+ * frame of h_stack_capture itself is never included). Returns the number of
+ * addresses stored. No symbolization is done, so this is cheap.
+ */
+NSUInteger h_stack_capture(void **addresses, NSUInteger maxCount,
+                           NSUInteger skip);
+
+/*!
+ * Resolve |address| to the name of its image (last path component) and the
+ * name of the nearest preceding symbol. Either might be set to NULL if unknown.
+ * Returns NO if the address is not inside any loaded image.
+ *
+ * Results are cached by address, so resolving a stack which has been seen
+ * before costs one hash lookup per frame. Returned strings are valid for as
+ * long as the image they belong to is loaded. Thread safe.
+ */
+BOOL h_stack_symbolize(const void *address, const char **image,
+                       const char **symbol);
+
+
 @interface NSThread (HCondensedStackTrace)
 
 // A condensed, formatted stack trace suitable for logging and debugging
 + (NSString*)condensedStackTrace;
 
+/*!
+ * A condensed stack trace of previously captured |addresses|, where the first
+ * address is the frame which is considered the "own" frame (e.g. the caller of
+ * h_stack_capture).
+ */
++ (NSString*)condensedStackTraceWithAddresses:(void* const*)addresses
+                                        count:(NSUInteger)count;
+
 @end
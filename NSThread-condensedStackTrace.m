@@ -1,43 +1,157 @@
 #import "NSThread-condensedStackTrace.h"
+#import <libkern/OSAtomic.h>
+#import <execinfo.h>
+#import <dlfcn.h>
+
+#define H_STACK_CAPTURE_MAX 256
+
+// Symbol cache: an open addressing hash table keyed by address
+typedef struct {
+  const void *address; // NULL for empty slots
+  const char *image;
+  const char *symbol;
+  BOOL found;
+} h_symcache_entry_t;
+
+static h_symcache_entry_t *gSymCache = NULL;
+static size_t gSymCacheMask = 0;
+static size_t gSymCacheCount = 0;
+static OSSpinLock gSymCacheLock = OS_SPINLOCK_INIT;
+
+
+// 64-bit finalizer from MurmurHash3, also on 32-bit targets where uintptr_t
+// is too narrow for it
+static inline size_t _symcache_hash(const void *address) {
+  uint64_t h = (uint64_t)(uintptr_t)address;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return (size_t)h;
+}
+
+
+static h_symcache_entry_t *_symcache_slot(h_symcache_entry_t *table,
+                                          size_t mask, const void *address) {
+  size_t i = _symcache_hash(address) & mask;
+  while (table[i].address && table[i].address != address)
+    i = (i + 1) & mask;
+  return &table[i];
+}
+
+
+// Must be called with gSymCacheLock held
+static void _symcache_grow() {
+  size_t i, size = gSymCacheMask ? (gSymCacheMask + 1) * 2 : 1024;
+  h_symcache_entry_t *table =
+      (h_symcache_entry_t*)calloc(size, sizeof(h_symcache_entry_t));
+  for (i = 0; gSymCache && i <= gSymCacheMask; i++) {
+    if (gSymCache[i].address)
+      *_symcache_slot(table, size - 1, gSymCache[i].address) = gSymCache[i];
+  }
+  free(gSymCache);
+  gSymCache = table;
+  gSymCacheMask = size - 1;
+}
+
+
+NSUInteger __attribute__((noinline))
+h_stack_capture(void **addresses, NSUInteger maxCount, NSUInteger skip) {
+  void *frames[H_STACK_CAPTURE_MAX];
+  skip++; // our own frame
+  int n = backtrace(frames, (int)MIN(maxCount + skip, H_STACK_CAPTURE_MAX));
+  if (n <= (int)skip)
+    return 0;
+  NSUInteger count = MIN((NSUInteger)n - skip, maxCount);
+  memcpy(addresses, frames + skip, count * sizeof(void*));
+  return count;
+}
+
+
+BOOL h_stack_symbolize(const void *address, const char **image,
+                       const char **symbol) {
+  OSSpinLockLock(&gSymCacheLock);
+  if (gSymCache) {
+    h_symcache_entry_t *e = _symcache_slot(gSymCache, gSymCacheMask, address);
+    if (e->address) {
+      if (image) *image = e->image;
+      if (symbol) *symbol = e->symbol;
+      BOOL found = e->found;
+      OSSpinLockUnlock(&gSymCacheLock);
+      return found;
+    }
+  }
+  OSSpinLockUnlock(&gSymCacheLock);
+
+  // resolve outside of the lock since dladdr might take a while
+  h_symcache_entry_t entry = { address, NULL, NULL, NO };
+  Dl_info info;
+  if (dladdr(address, &info)) {
+    entry.found = YES;
+    if (info.dli_fname) {
+      const char *slash = strrchr(info.dli_fname, '/');
+      entry.image = slash ? slash + 1 : info.dli_fname;
+    }
+    entry.symbol = info.dli_sname;
+  }
+
+  OSSpinLockLock(&gSymCacheLock);
+  if (gSymCacheCount * 2 >= gSymCacheMask)
+    _symcache_grow();
+  h_symcache_entry_t *e = _symcache_slot(gSymCache, gSymCacheMask, address);
+  if (!e->address) {
+    *e = entry;
+    gSymCacheCount++;
+  }
+  OSSpinLockUnlock(&gSymCacheLock);
+
+  if (image) *image = entry.image;
+  if (symbol) *symbol = entry.symbol;
+  return entry.found;
+}
+
 
 @implementation NSThread (HCondensedStackTrace)
 
 + (NSString*)condensedStackTrace {
+  void *addresses[128];
+  // skip this method so that addresses[0] is its caller
+  NSUInteger count = h_stack_capture(addresses, 128, 1);
+  return [self condensedStackTraceWithAddresses:addresses count:count];
+}
+
+
++ (NSString*)condensedStackTraceWithAddresses:(void* const*)addresses
+                                        count:(NSUInteger)count {
   NSMutableArray *syms = [NSMutableArray array];
-  @try {
-    NSArray *stackSymbols = [NSThread callStackSymbols];
-    NSString *ownSource = nil;
-    NSUInteger i, lastAddedIndex = 9, count = [stackSymbols count];
-    NSCharacterSet *whitespace = [NSCharacterSet whitespaceCharacterSet];
-    for (i = 1; i < count; i++) {
-      NSString *entry = [stackSymbols objectAtIndex:i];
-      NSScanner *scanner = [NSScanner scannerWithString:entry];
-      [scanner setCharactersToBeSkipped:whitespace];
-      NSString *source = nil, *symbol = nil;
-      // 4  libSystem.B.dylib  0x00007fff84f8cc30  _Block_object_assign + 326
-      if (![scanner scanInt:nil]) continue;
-      if (![scanner scanUpToCharactersFromSet:whitespace intoString:&source])
-        continue;
-      if (![scanner scanUpToCharactersFromSet:whitespace intoString:nil])
-        continue;
-      [scanner scanUpToString:@" + " intoString:&symbol];
-      NSString *prefix = (i > lastAddedIndex+1) ? @"  .." :
-                         (i == 2 ? @"  ↑ " : @"    ");
-      if (i == 1) {
-        if (!ownSource) ownSource = source;
-      } else if (ownSource && [ownSource isEqualToString:source]) {
-        [syms addObject:[NSString stringWithFormat:@"%@%d %@", prefix, i-1,
-                         symbol]];
-        lastAddedIndex = i;
-        if (i+2 >= count) break;
-      } else if ((i == 2) || (i+2 >= count)) { // top caller or end
-        [syms addObject:[NSString stringWithFormat:@"%@%d %@  <%@>", prefix,
-                         i-1, symbol, source]];
-        lastAddedIndex = i;
-        if (i+2 >= count) break;
+  const char *ownSource = NULL;
+  NSUInteger i, lastAddedIndex = 9;
+  // |i| counts frames the way callStackSymbols would, where frame 0 is the
+  // function producing the trace and frame 1 is addresses[0]
+  count++;
+  for (i = 1; i < count; i++) {
+    const void *address = addresses[i-1];
+    const char *source = NULL, *symbol = NULL;
+    h_stack_symbolize(address, &source, &symbol);
+    if (!source) source = "???";
+    NSString *prefix = (i > lastAddedIndex+1) ? @"  .." :
+                       (i == 2 ? @"  ↑ " : @"    ");
+    BOOL isOwn = ownSource && strcmp(ownSource, source) == 0;
+    if (i == 1) {
+      if (!ownSource) ownSource = source;
+    } else if (isOwn || (i == 2) || (i+2 >= count)) {
+      NSString *sym = symbol ? [NSString stringWithUTF8String:symbol] :
+                      [NSString stringWithFormat:@"%p", address];
+      if (isOwn) {
+        [syms addObject:[NSString stringWithFormat:@"%@%lu %@", prefix,
+                         (unsigned long)i-1, sym]];
+      } else { // top caller or end
+        [syms addObject:[NSString stringWithFormat:@"%@%lu %@  <%s>", prefix,
+                         (unsigned long)i-1, sym, source]];
       }
+      lastAddedIndex = i;
+      if (i+2 >= count) break;
     }
-  } @catch(id e) { }
+  }
   return [syms componentsJoinedByString:@"\n"];
 }
 
@@ -0,0 +1,93 @@
+/*
+ * Measures the overhead of HAllocationCensus and prints what a census looks
+ * like.
+ *
+ * usage: allocation-census [threads [iterations]]
+ *
+ * Each of |threads| threads allocates and releases |iterations| objects of a
+ * small class hierarchy -- first untracked, then tracked, then tracked with
+ * allocation sites -- and the cost per alloc+release is printed. Finally a
+ * few objects are leaked between two snapshots and the difference is shown.
+ */
+#import "HAllocationCensus.h"
+#import <mach/mach_time.h>
+
+@interface CensusBase : NSObject { int a_; }
+@end
+@implementation CensusBase
+- (void)dealloc { [super dealloc]; }
+@end
+
+@interface CensusChild : CensusBase { char buf_[100]; }
+@end
+@implementation CensusChild
++ (id)allocWithZone:(NSZone*)zone { return [super allocWithZone:zone]; }
+- (void)dealloc { [super dealloc]; }
+@end
+
+// Not tracked itself, so attributed to CensusChild
+@interface CensusGrandChild : CensusChild
+@end
+@implementation CensusGrandChild
+@end
+
+static double _now() {
+  static mach_timebase_info_data_t tb;
+  if (tb.denom == 0) mach_timebase_info(&tb);
+  return (double)(mach_absolute_time() * tb.numer / tb.denom) / 1e9;
+}
+
+static void __attribute__((noinline)) _allocate(Class cls) {
+  [[cls alloc] release];
+}
+
+static double _run(size_t threads, size_t iterations) {
+  dispatch_group_t group = dispatch_group_create();
+  dispatch_queue_t queue = dispatch_get_global_queue(0, 0);
+  double start = _now();
+  size_t t;
+  for (t = 0; t < threads; t++) {
+    dispatch_group_async(group, queue, ^{
+      Class classes[] = {[CensusBase class], [CensusChild class],
+                         [CensusGrandChild class]};
+      size_t i;
+      for (i = 0; i < iterations; i++)
+        _allocate(classes[i % 3]);
+    });
+  }
+  dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+  dispatch_release(group);
+  // nanoseconds per alloc+release
+  return (_now() - start) * 1e9 / (double)(threads * iterations);
+}
+
+
+int main(int argc, const char * argv[]) {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  size_t threads = argc > 1 ? strtoul(argv[1], NULL, 10) : 4;
+  size_t iterations = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+
+  printf("untracked        %8.1f ns\n", _run(threads, iterations));
+  [HAllocationCensus trackClass:[CensusBase class]];
+  [HAllocationCensus trackClass:[CensusChild class]];
+  printf("tracked          %8.1f ns\n", _run(threads, iterations));
+  [HAllocationCensus setRecordsAllocationSites:YES];
+  printf("tracked + sites  %8.1f ns\n", _run(threads, iterations / 10));
+
+  HAllocationCensusSnapshot *before = [HAllocationCensus snapshot];
+  NSMutableArray *leaked = [NSMutableArray array];
+  int i;
+  for (i = 0; i < 10; i++) {
+    [leaked addObject:[[[CensusGrandChild alloc] init] autorelease]];
+    if (i % 2 == 0)
+      [leaked addObject:[[[CensusBase alloc] init] autorelease]];
+  }
+  HAllocationCensusSnapshot *diff =
+      [[HAllocationCensus snapshot] snapshotBySubtracting:before];
+  printf("\ntotals:\n%s\n", [[[HAllocationCensus snapshot] description] UTF8String]);
+  printf("\nchanges:\n%s\n", [[diff description] UTF8String]);
+  for (HAllocationCensusRecord *r in diff.records)
+    NSLog(@"%@ allocation sites: %@", r.trackedClass, r.allocationSites);
+  [pool drain];
+  return 0;
+}
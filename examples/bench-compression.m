@@ -0,0 +1,134 @@
+/*
+ * Measures HDZlibTransform throughput and compression ratio.
+ *
+ * usage: bench-compression [megabytes [chunksize]]
+ *
+ * Generates log-like text and first runs it through a compressor and a
+ * decompressor in memory, |chunksize| (default 64 kB) bytes at a time, for a
+ * few levels. Then the same data is sent over a socketpair between two
+ * HDStreams, with and without a zlib transform, and the end-to-end throughput
+ * is printed.
+ */
+#import "HDStreamTransform.h"
+#import <sys/socket.h>
+#import <mach/mach_time.h>
+
+static double _now() {
+  static mach_timebase_info_data_t tb;
+  if (tb.denom == 0) mach_timebase_info(&tb);
+  return (double)(mach_absolute_time() * tb.numer / tb.denom) / 1e9;
+}
+
+static NSData *_logdata(size_t size) {
+  static const char *levels[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+  static const char *words[] = {"request", "stream", "process", "channel",
+                                "timeout", "connected", "closed", "bytes"};
+  NSMutableData *data = [NSMutableData dataWithCapacity:size + 256];
+  char line[256];
+  unsigned i = 0;
+  while (data.length < size) {
+    int n = snprintf(line, sizeof(line),
+                     "2010-12-%02u 12:%02u:%02u.%03u [%s] %s %s id=%u %u\n",
+                     1 + i % 28, i / 3600 % 60, i / 60 % 60, i % 1000,
+                     levels[(i * 7) % 4], words[(i * 13) % 8],
+                     words[(i * 5) % 8], i * 2654435761u % 100000, i);
+    [data appendBytes:line length:n];
+    i++;
+  }
+  [data setLength:size];
+  return data;
+}
+
+static void bench_memory(NSData *input, size_t chunk, HDZlibFormat format,
+                         int level) {
+  HDZlibTransform *compressor =
+      [HDZlibTransform compressorWithFormat:format level:level];
+  HDZlibTransform *decompressor =
+      [HDZlibTransform decompressorWithFormat:format];
+  NSMutableData *compressed = [NSMutableData dataWithCapacity:input.length];
+  const char *bytes = (const char*)input.bytes;
+  size_t offset;
+
+  double start = _now();
+  for (offset = 0; offset < input.length; offset += chunk) {
+    [compressor transformBytes:bytes + offset
+                        length:MIN(chunk, input.length - offset) finish:NO
+                        output:^(const void *b, size_t n) {
+      [compressed appendBytes:b length:n];
+    }];
+  }
+  double compressTime = _now() - start;
+
+  __block size_t decompressedLength = 0;
+  start = _now();
+  for (offset = 0; offset < compressed.length; offset += chunk) {
+    [decompressor transformBytes:(const char*)compressed.bytes + offset
+                          length:MIN(chunk, compressed.length - offset)
+                          finish:NO output:^(const void *b, size_t n) {
+      decompressedLength += n;
+    }];
+  }
+  double decompressTime = _now() - start;
+  assert(decompressedLength == input.length);
+
+  double mb = input.length / (1024.0 * 1024.0);
+  printf("%-4s level %d  ratio %5.2f  compress %7.1f MB/s  "
+         "decompress %7.1f MB/s\n",
+         format == HDZlibFormatGzip ? "gzip" : "zlib", level,
+         (double)input.length / compressed.length, mb / compressTime,
+         mb / decompressTime);
+}
+
+static void bench_stream(NSData *input, size_t chunk, BOOL compress) {
+  int fds[2];
+  socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  HDStream *writer = [HDStream streamWithFileDescriptor:fds[0]];
+  HDStream *reader = [HDStream streamWithFileDescriptor:fds[1]];
+  if (compress) {
+    writer.writeTransform =
+        [HDZlibTransform compressorWithFormat:HDZlibFormatZlib level:1];
+    reader.readTransform =
+        [HDZlibTransform decompressorWithFormat:HDZlibFormatZlib];
+  }
+  dispatch_semaphore_t done = dispatch_semaphore_create(0);
+  __block size_t received = 0;
+  size_t total = input.length;
+  reader.onData = ^(const void *bytes, size_t length) {
+    received += length;
+    if (received == total)
+      dispatch_semaphore_signal(done);
+  };
+  [reader resume];
+  [writer resume];
+
+  double start = _now();
+  size_t offset;
+  for (offset = 0; offset < input.length; offset += chunk) {
+    [writer writeBytes:(const char*)input.bytes + offset
+                length:MIN(chunk, input.length - offset)];
+  }
+  dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+  double elapsed = _now() - start;
+  printf("socketpair %-6s %7.1f MB/s\n", compress ? "zlib 1" : "plain",
+         input.length / (1024.0 * 1024.0) / elapsed);
+  [writer cancel];
+  [reader cancel];
+  dispatch_release(done);
+}
+
+
+int main(int argc, const char * argv[]) {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+  size_t chunk = argc > 2 ? strtoul(argv[2], NULL, 10) : 64*1024;
+  NSData *input = _logdata(megabytes * 1024 * 1024);
+
+  bench_memory(input, chunk, HDZlibFormatZlib, 1);
+  bench_memory(input, chunk, HDZlibFormatZlib, 6);
+  bench_memory(input, chunk, HDZlibFormatZlib, 9);
+  bench_memory(input, chunk, HDZlibFormatGzip, 6);
+  bench_stream(input, chunk, NO);
+  bench_stream(input, chunk, YES);
+  [pool drain];
+  return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * Measures HDDatagramStream throughput in packets per second over loopback UDP.
+ *
+ * usage: bench-datagram [count [size]]
+ *
+ * Runs the same transfer twice: once with batchSize=1 (one syscall per message,
+ * like a plain recvfrom/sendto loop) and once with the default batch size.
+ *
+ * Only Linux has recvmmsg/sendmmsg. Elsewhere HDDatagramStream emulates them
+ * with one syscall per message, so the comparison then only measures the
+ * emulation loop and not batching -- the output says which one is in effect.
+ */
+#import "HDDatagramStream.h"
+#import <netinet/in.h>
+#import <arpa/inet.h>
+#import <time.h>
+
+static double _now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int _udp_socket(struct sockaddr_in *addr) {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  int rcvbuf = 8*1024*1024;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(*addr);
+  bind(fd, (struct sockaddr*)addr, len);
+  getsockname(fd, (struct sockaddr*)addr, &len);
+  return fd;
+}
+
+static void bench(NSUInteger batchSize, NSUInteger count, size_t size) {
+  struct sockaddr_in raddr, saddr;
+  int rfd = _udp_socket(&raddr);
+  int sfd = _udp_socket(&saddr);
+  connect(sfd, (struct sockaddr*)&raddr, sizeof(raddr));
+
+  dispatch_queue_t rq = dispatch_queue_create("bench.recv", NULL);
+  dispatch_queue_t sq = dispatch_queue_create("bench.send", NULL);
+  HDDatagramStream *receiver =
+      [[HDDatagramStream alloc] initWithFileDescriptor:rfd disableReading:NO
+                                        disableWriting:YES dispatchQueue:rq];
+  HDDatagramStream *sender =
+      [[HDDatagramStream alloc] initWithFileDescriptor:sfd disableReading:YES
+                                        disableWriting:NO dispatchQueue:sq];
+  receiver.batchSize = batchSize;
+  sender.batchSize = batchSize;
+
+  __block NSUInteger received = 0;
+  __block double lastReceived = 0.0;
+  receiver.onDatagram = ^(const void *bytes, size_t length,
+                          const struct sockaddr *address, socklen_t addrlen) {
+    received++;
+    lastReceived = _now();
+  };
+  [receiver resume];
+  [sender resume];
+
+  char *payload = (char*)calloc(1, size);
+  NSData *message = [NSData dataWithBytesNoCopy:payload length:size
+                                   freeWhenDone:YES];
+  double start = _now();
+  NSUInteger i;
+  for (i = 0; i < count; i++)
+    [sender writeData:message];
+
+  // wait for the transfer to go quiet (UDP may drop under pressure)
+  NSUInteger prev = (NSUInteger)-1;
+  while (prev != received) {
+    prev = received;
+    usleep(200000);
+  }
+
+  double elapsed = received ? lastReceived - start : 0.0;
+  printf("batch %2lu: %lu/%lu packets of %lu bytes in %.3fs -- %.0f pps\n",
+         (unsigned long)batchSize, (unsigned long)received,
+         (unsigned long)count, (unsigned long)size, elapsed,
+         elapsed > 0.0 ? (double)received / elapsed : 0.0);
+
+  [sender cancel];
+  [receiver cancel];
+  [sender release];
+  [receiver release];
+  dispatch_release(rq);
+  dispatch_release(sq);
+}
+
+
+int main(int argc, const char * argv[]) {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  NSUInteger count = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  size_t size = argc > 2 ? strtoul(argv[2], NULL, 10) : 64;
+  #if defined(__linux__) && defined(MSG_WAITFORONE)
+  printf("using recvmmsg/sendmmsg\n");
+  #else
+  printf("recvmmsg/sendmmsg not available -- batches are emulated with one "
+         "syscall per message\n");
+  #endif
+  bench(1, count, size);
+  bench(HD_DATAGRAM_BATCH_MAX, count, size);
+  [pool drain];
+  return 0;
+}
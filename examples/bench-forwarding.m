@@ -0,0 +1,70 @@
+/*
+ * Measures the cost of forwarding a message to a member object.
+ *
+ * usage: bench-forwarding [iterations]
+ *
+ * Sends -add: (a message taking and returning an integer) to:
+ *
+ *   direct      the target itself
+ *   invocation  a wrapper using H_FORWARD_INVOCATION_TO_MEMBER_IMPL
+ *   fast        a wrapper using H_FORWARD_TO_MEMBER_IMPL
+ */
+#import "hcommon.h"
+#import <mach/mach_time.h>
+
+@interface Counter : NSObject { NSUInteger value_; }
+- (NSUInteger)add:(NSUInteger)n;
+@end
+@implementation Counter
+- (NSUInteger)add:(NSUInteger)n { return value_ += n; }
+@end
+
+@interface InvocationWrapper : NSObject { Counter *counter_; }
+@end
+@implementation InvocationWrapper
+- (id)init {
+  if ((self = [super init])) counter_ = [Counter new];
+  return self;
+}
+- (void)dealloc { [counter_ release]; [super dealloc]; }
+H_FORWARD_INVOCATION_TO_MEMBER_IMPL(counter_)
+@end
+
+@interface FastWrapper : NSObject { Counter *counter_; }
+@end
+@implementation FastWrapper
+- (id)init {
+  if ((self = [super init])) counter_ = [Counter new];
+  return self;
+}
+- (void)dealloc { [counter_ release]; [super dealloc]; }
+H_FORWARD_TO_MEMBER_IMPL(counter_)
+@end
+
+static double _now() {
+  static mach_timebase_info_data_t tb;
+  if (tb.denom == 0) mach_timebase_info(&tb);
+  return (double)(mach_absolute_time() * tb.numer / tb.denom) / 1e9;
+}
+
+static void bench(const char *name, id target, NSUInteger iterations) {
+  NSUInteger i, sum = 0;
+  double start = _now();
+  for (i = 0; i < iterations; i++)
+    sum = [(Counter*)target add:1];
+  double elapsed = _now() - start;
+  assert(sum == iterations);
+  printf("%-12s %8.1f ns per message\n", name, elapsed * 1e9 / iterations);
+}
+
+
+int main(int argc, const char * argv[]) {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  NSUInteger iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  Counter *counter = [[Counter new] autorelease];
+  bench("direct", counter, iterations * 100);
+  bench("invocation", [[InvocationWrapper new] autorelease], iterations);
+  bench("fast", [[FastWrapper new] autorelease], iterations * 10);
+  [pool drain];
+  return 0;
+}
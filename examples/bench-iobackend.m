@@ -0,0 +1,73 @@
+/*
+ * A/B benchmark of the HDStream I/O backends.
+ *
+ * usage: bench-iobackend [megabytes [chunksize]]
+ *
+ * Transfers |megabytes| over a socketpair, written in |chunksize| writeData:
+ * calls and read through onData, once per available backend.
+ */
+#import "HDStream.h"
+#import <sys/socket.h>
+#import <time.h>
+
+// Not mach_absolute_time since io_uring is only available on Linux
+static double _now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void bench(HDStreamIOBackend backend, const char *name,
+                  size_t total, size_t chunksize) {
+  if (![HDStream setDefaultIOBackend:backend]) {
+    printf("%-8s unavailable -- skipped\n", name);
+    return;
+  }
+
+  int fds[2];
+  socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  HDStream *reader = [[HDStream alloc] initWithFileDescriptor:fds[0]];
+  HDStream *writer = [[HDStream alloc] initWithFileDescriptor:fds[1]];
+
+  dispatch_semaphore_t done = dispatch_semaphore_create(0);
+  __block size_t received = 0;
+  __block NSUInteger callbacks = 0;
+  reader.onData = ^(const void *bytes, size_t length) {
+    callbacks++;
+    received += length;
+    if (received == total)
+      dispatch_semaphore_signal(done);
+  };
+  [reader resume];
+  [writer resume];
+
+  NSData *chunk = [NSMutableData dataWithLength:chunksize];
+  double start = _now();
+  size_t sent;
+  for (sent = 0; sent < total; sent += chunksize)
+    [writer writeData:chunk];
+  dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+  double elapsed = _now() - start;
+
+  printf("%-8s %lu MB in %.3fs -- %.1f MB/s, %lu onData calls\n", name,
+         (unsigned long)(total >> 20), elapsed,
+         (double)total / (1024.0*1024.0) / elapsed, (unsigned long)callbacks);
+
+  [writer cancel];
+  [reader cancel];
+  [writer release];
+  [reader release];
+  dispatch_release(done);
+}
+
+
+int main(int argc, const char * argv[]) {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 1024;
+  size_t chunksize = argc > 2 ? strtoul(argv[2], NULL, 10) : 64*1024;
+  size_t total = (megabytes << 20) / chunksize * chunksize;
+  bench(HDStreamIOBackendDispatch, "dispatch", total, chunksize);
+  bench(HDStreamIOBackendURing, "io_uring", total, chunksize);
+  [pool drain];
+  return 0;
+}
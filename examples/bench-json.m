@@ -0,0 +1,102 @@
+/*
+ * Compares whole-body JSON parsing with incremental parsing.
+ *
+ * usage: bench-json string|stream|element [megabytes]
+ *
+ * A JSON array of |megabytes| (default 64) worth of objects is written to a
+ * temporary file and then read back in 16 kB chunks, simulating a response
+ * arriving over the network:
+ *
+ *   string   accumulate the body, decode it into a NSString and parse that
+ *            (the shape of the old HUWebServiceProxy path; NSJSONSerialization
+ *            stands in for the JSON framework which is not part of this tree)
+ *   stream   feed each chunk to HUJSONStreamParser as it arrives
+ *   element  like stream, but in element mode (elements are not retained)
+ *
+ * Peak RSS is process-wide, so run one mode per invocation.
+ */
+#import "HUJSONStreamParser.h"
+#import <sys/resource.h>
+#import <mach/mach_time.h>
+#import <fcntl.h>
+
+static double _now() {
+  static mach_timebase_info_data_t tb;
+  if (tb.denom == 0) mach_timebase_info(&tb);
+  return (double)(mach_absolute_time() * tb.numer / tb.denom) / 1e9;
+}
+
+static size_t _write_payload(const char *path, size_t size) {
+  FILE *f = fopen(path, "w");
+  size_t written = 0, i = 0;
+  written += fprintf(f, "[");
+  while (written < size) {
+    written += fprintf(f, "%s{\"id\":%lu,\"name\":\"item \\u00e5 %lu\","
+                       "\"score\":%.3f,\"tags\":[\"a\",\"b\",\"c\"],\"ok\":true}",
+                       i ? "," : "", (unsigned long)i, (unsigned long)i, i * 0.5);
+    i++;
+  }
+  written += fprintf(f, "]");
+  fclose(f);
+  return written;
+}
+
+
+int main(int argc, const char * argv[]) {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  const char *mode = argc > 1 ? argv[1] : "stream";
+  size_t size = (argc > 2 ? strtoul(argv[2], NULL, 10) : 64) << 20;
+
+  char path[] = "/tmp/bench-json.XXXXXX";
+  close(mkstemp(path));
+  size = _write_payload(path, size);
+  int fd = open(path, O_RDONLY);
+  unlink(path);
+
+  char chunk[16384];
+  ssize_t n;
+  __block NSUInteger count = 0;
+  double start = _now();
+
+  if (strcmp(mode, "string") == 0) {
+    NSMutableData *body = [NSMutableData data];
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+      [body appendBytes:chunk length:n];
+    NSString *s = [[NSString alloc] initWithData:body encoding:NSUTF8StringEncoding];
+    id obj = [NSJSONSerialization JSONObjectWithData:[s dataUsingEncoding:NSUTF8StringEncoding]
+                                             options:0 error:nil];
+    count = [obj count];
+    [s release];
+  } else {
+    HUJSONStreamParser *parser = [[HUJSONStreamParser alloc] init];
+    if (strcmp(mode, "element") == 0) {
+      parser.elementBlock = ^(id element) {
+        count++;
+      };
+    }
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+      NSAutoreleasePool *pool2 = [[NSAutoreleasePool alloc] init];
+      [parser parseBytes:chunk length:n];
+      [pool2 drain];
+    }
+    if (![parser finish]) {
+      NSLog(@"parse error: %@", parser.error);
+      return 1;
+    }
+    if (!parser.elementBlock)
+      count = [parser.rootObject count];
+    [parser release];
+  }
+
+  double elapsed = _now() - start;
+  close(fd);
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  printf("%-8s %.1f MB, %lu elements in %.3fs -- %.1f MB/s, peak RSS %.1f MB\n",
+         mode, (double)size / (1024.0*1024.0), (unsigned long)count, elapsed,
+         (double)size / (1024.0*1024.0) / elapsed,
+         (double)ru.ru_maxrss / (1024.0*1024.0)); // bytes on Darwin
+
+  [pool drain];
+  return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * Measures the throughput of a three stage process pipeline.
+ *
+ * usage: bench-pipeline [megabytes]
+ *
+ * Runs "dd if=/dev/zero bs=1m count=N | cat | wc -c" twice:
+ *
+ *   relay   the previous approach -- each stage's stdout is read into this
+ *           process through onStdout and written to the next stage's stdin
+ *   direct  HDProcessPipeline, where stages are connected by pipes
+ *
+ * and prints the throughput together with the CPU time used by this process.
+ */
+#import "HDProcess.h"
+#import <mach/mach_time.h>
+#import <sys/resource.h>
+
+static double _now() {
+  static mach_timebase_info_data_t tb;
+  if (tb.denom == 0) mach_timebase_info(&tb);
+  return (double)(mach_absolute_time() * tb.numer / tb.denom) / 1e9;
+}
+
+static double _cpu() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+         ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static NSArray *_stages(unsigned megabytes) {
+  return [NSArray arrayWithObjects:
+          [HDProcess start:@"dd", @"if=/dev/zero", @"bs=1048576",
+           [NSString stringWithFormat:@"count=%u", megabytes], nil],
+          [HDProcess start:@"cat", nil],
+          [HDProcess start:@"wc", @"-c", nil], nil];
+}
+
+static void _report(const char *name, unsigned megabytes, double start,
+                    double cpuStart) {
+  double elapsed = _now() - start;
+  printf("%-8s %8.1f MB/s  %6.2f s CPU in parent\n", name,
+         megabytes / elapsed, _cpu() - cpuStart);
+}
+
+static void bench_relay(unsigned megabytes) {
+  NSArray *stages = _stages(megabytes);
+  dispatch_semaphore_t done = dispatch_semaphore_create(0);
+  NSUInteger i;
+  for (i = 0; i < stages.count; i++) {
+    HDProcess *process = [stages objectAtIndex:i];
+    if (i+1 < stages.count) {
+      HDProcess *next = [stages objectAtIndex:i+1];
+      process.onStdout = ^(const void *bytes, size_t length) {
+        if (length == 0) {
+          [next.stdin cancel];
+        } else {
+          [next.stdin writeBytes:bytes length:length];
+        }
+      };
+    } else {
+      [process on:@"exit", ^(HDProcess *p) {
+        dispatch_semaphore_signal(done);
+      }];
+    }
+  }
+  double start = _now(), cpuStart = _cpu();
+  // start from the end so that no output is written to an unstarted stage
+  for (i = stages.count; i > 0; i--) {
+    [[stages objectAtIndex:i-1] start];
+  }
+  dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+  _report("relay", megabytes, start, cpuStart);
+  dispatch_release(done);
+}
+
+static void bench_direct(unsigned megabytes) {
+  HDProcessPipeline *pipeline =
+      [[[HDProcessPipeline alloc] initWithProcesses:_stages(megabytes)] autorelease];
+  dispatch_semaphore_t done = dispatch_semaphore_create(0);
+  [pipeline on:@"exit", ^(HDProcessPipeline *p) {
+    dispatch_semaphore_signal(done);
+  }];
+  double start = _now(), cpuStart = _cpu();
+  [pipeline start];
+  dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+  _report("direct", megabytes, start, cpuStart);
+  dispatch_release(done);
+}
+
+
+int main(int argc, const char * argv[]) {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  unsigned megabytes = argc > 1 ? (unsigned)strtoul(argv[1], NULL, 10) : 1024;
+  bench_relay(megabytes);
+  bench_direct(megabytes);
+  [pool drain];
+  return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * Measures the overhead of HSamplingProfiler.
+ *
+ * usage: bench-profiler [frequency [threads]]
+ *
+ * Runs a CPU-bound workload on |threads| threads (default 4) with and without
+ * the profiler sampling at |frequency| Hz (default 100) and prints the
+ * overhead together with the hottest folded stacks.
+ */
+#import "HSamplingProfiler.h"
+#import <mach/mach_time.h>
+
+static double _now() {
+  static mach_timebase_info_data_t tb;
+  if (tb.denom == 0) mach_timebase_info(&tb);
+  return (double)(mach_absolute_time() * tb.numer / tb.denom) / 1e9;
+}
+
+static double __attribute__((noinline)) _leaf(double x, int n) {
+  int i;
+  for (i = 0; i < n; i++)
+    x = x * 1.0000001 + 0.5 / (x + 1.0);
+  return x;
+}
+
+static double __attribute__((noinline)) _middle(double x) {
+  return _leaf(x, 2000) + _leaf(x, 500);
+}
+
+static double _workload(size_t threads, size_t iterations) {
+  dispatch_group_t group = dispatch_group_create();
+  dispatch_queue_t queue = dispatch_get_global_queue(0, 0);
+  double start = _now();
+  __block volatile double sink = 0;
+  size_t t;
+  for (t = 0; t < threads; t++) {
+    dispatch_group_async(group, queue, ^{
+      double x = 1.0;
+      size_t i;
+      for (i = 0; i < iterations; i++)
+        x = _middle(x);
+      sink += x;
+    });
+  }
+  dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+  dispatch_release(group);
+  return _now() - start;
+}
+
+
+int main(int argc, const char * argv[]) {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  NSUInteger frequency = argc > 1 ? strtoul(argv[1], NULL, 10) : 100;
+  size_t threads = argc > 2 ? strtoul(argv[2], NULL, 10) : 4;
+  size_t iterations = 200000;
+
+  _workload(threads, iterations / 10); // warm up
+  double base = _workload(threads, iterations);
+
+  HSamplingProfiler *profiler = [[HSamplingProfiler alloc] init];
+  profiler.frequency = frequency;
+  [profiler start];
+  double profiled = _workload(threads, iterations);
+  [profiler stop];
+
+  printf("%.3fs without, %.3fs with profiler at %lu Hz -- %.2f%% overhead, "
+         "%lu samples (%lu dropped)\n", base, profiled,
+         (unsigned long)frequency, (profiled - base) / base * 100.0,
+         (unsigned long)profiler.sampleCount,
+         (unsigned long)profiler.droppedSampleCount);
+
+  double start = _now();
+  NSString *folded = [profiler foldedStacks];
+  printf("aggregated in %.3fs\n", _now() - start);
+  NSArray *lines = [[folded componentsSeparatedByString:@"\n"]
+      sortedArrayUsingComparator:^(id a, id b) {
+    long ca = [[[a componentsSeparatedByString:@" "] lastObject] integerValue];
+    long cb = [[[b componentsSeparatedByString:@" "] lastObject] integerValue];
+    return ca > cb ? NSOrderedAscending : (ca < cb ? NSOrderedDescending : NSOrderedSame);
+  }];
+  NSUInteger i;
+  for (i = 0; i < 5 && i < [lines count]; i++)
+    printf("  %s\n", [[lines objectAtIndex:i] UTF8String]);
+
+  [profiler release];
+  [pool drain];
+  return 0;
+}
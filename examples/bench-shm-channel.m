@@ -0,0 +1,100 @@
+/*
+ * Measures the round-trip latency of HDProcess channels.
+ *
+ * usage: bench-shm-channel <path to shm-channel-client> [messages [size]]
+ *
+ * Starts the reference client (examples/shm-channel-client.c) twice: once
+ * with a socketpair channel (createChannel:) and once with a shared memory
+ * channel (createSharedMemoryChannel:). Each time, |messages| (default
+ * 100000) messages of |size| (default 64) bytes are sent one at a time, each
+ * one after the echo of the previous one has been received, and latency
+ * percentiles are printed.
+ */
+#import "HDProcess.h"
+#import "HDShmChannel.h"
+#import <mach/mach_time.h>
+
+static uint64_t _ns(uint64_t t) {
+  static mach_timebase_info_data_t tb;
+  if (tb.denom == 0) mach_timebase_info(&tb);
+  return t * tb.numer / tb.denom;
+}
+
+static int _cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void _report(const char *name, uint64_t *samples, NSUInteger count) {
+  qsort(samples, count, sizeof(uint64_t), _cmp);
+  printf("%-10s p50 %6.1f us  p99 %6.1f us  p99.9 %6.1f us\n", name,
+         _ns(samples[count / 2]) / 1e3, _ns(samples[count * 99 / 100]) / 1e3,
+         _ns(samples[count * 999 / 1000]) / 1e3);
+}
+
+static void bench(NSString *client, BOOL shm, NSUInteger messages,
+                  size_t size) {
+  HDProcess *process = [HDProcess processWithProgram:client];
+  uint64_t *samples = (uint64_t*)calloc(messages, sizeof(uint64_t));
+  char *message = (char*)malloc(size);
+  memset(message, 'x', size);
+  dispatch_semaphore_t done = dispatch_semaphore_create(0);
+  __block NSUInteger received = 0;
+  __block size_t partial = 0;
+  __block uint64_t sentAt = 0;
+  __block id writer = nil;
+
+  // send the next message when the previous one has come back
+  void (^onMessage)(size_t) = ^(size_t length) {
+    partial += length;
+    if (partial < size) return; // socketpairs don't preserve boundaries
+    partial = 0;
+    samples[received++] = mach_absolute_time() - sentAt;
+    if (received == messages) {
+      dispatch_semaphore_signal(done);
+      return;
+    }
+    sentAt = mach_absolute_time();
+    [writer writeBytes:message length:size];
+  };
+
+  if (shm) {
+    HDShmChannel *channel = [process createSharedMemoryChannel:@"bench"];
+    channel.onData = ^(const void *bytes, size_t length) { onMessage(length); };
+    writer = channel;
+  } else {
+    HDNamedStream *channel = [process createChannel:@"bench"];
+    channel.onData = ^(const void *bytes, size_t length) { onMessage(length); };
+    writer = channel;
+  }
+  [process start];
+  [writer resume];
+
+  sentAt = mach_absolute_time();
+  [writer writeBytes:message length:size];
+  dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+  _report(shm ? "shm" : "socketpair", samples, messages);
+
+  [writer cancel];
+  [process terminate];
+  dispatch_release(done);
+  free(message);
+  free(samples);
+}
+
+
+int main(int argc, const char * argv[]) {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <shm-channel-client> [messages [size]]\n",
+            argv[0]);
+    return 1;
+  }
+  NSString *client = [NSString stringWithUTF8String:argv[1]];
+  NSUInteger messages = argc > 2 ? strtoul(argv[2], NULL, 10) : 100000;
+  size_t size = argc > 3 ? strtoul(argv[3], NULL, 10) : 64;
+  bench(client, NO, messages, size);
+  bench(client, YES, messages, size);
+  [pool drain];
+  return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * Measures the cost of capturing a condensed stack trace.
+ *
+ * usage: bench-stacktrace [iterations [depth]]
+ *
+ * Each capture is made |depth| (default 20) frames deep and compared across:
+ *
+ *   callStackSymbols  the previous implementation (symbolize every frame via
+ *                     callStackSymbols, then parse each line with NSScanner)
+ *   condensed         +[NSThread condensedStackTrace] (raw capture + cached
+ *                     dladdr symbolization)
+ *   capture           h_stack_capture only
+ */
+#import "NSThread-condensedStackTrace.h"
+#import <mach/mach_time.h>
+
+static double _now() {
+  static mach_timebase_info_data_t tb;
+  if (tb.denom == 0) mach_timebase_info(&tb);
+  return (double)(mach_absolute_time() * tb.numer / tb.denom) / 1e9;
+}
+
+// The previous implementation of +[NSThread condensedStackTrace]
+static NSString *_condensed_via_callStackSymbols() {
+  NSMutableArray *syms = [NSMutableArray array];
+  NSArray *stackSymbols = [NSThread callStackSymbols];
+  NSString *ownSource = nil;
+  NSUInteger i, lastAddedIndex = 9, count = [stackSymbols count];
+  NSCharacterSet *whitespace = [NSCharacterSet whitespaceCharacterSet];
+  for (i = 1; i < count; i++) {
+    NSString *entry = [stackSymbols objectAtIndex:i];
+    NSScanner *scanner = [NSScanner scannerWithString:entry];
+    [scanner setCharactersToBeSkipped:whitespace];
+    NSString *source = nil, *symbol = nil;
+    if (![scanner scanInt:nil]) continue;
+    if (![scanner scanUpToCharactersFromSet:whitespace intoString:&source])
+      continue;
+    if (![scanner scanUpToCharactersFromSet:whitespace intoString:nil])
+      continue;
+    [scanner scanUpToString:@" + " intoString:&symbol];
+    NSString *prefix = (i > lastAddedIndex+1) ? @"  .." :
+                       (i == 2 ? @"  ↑ " : @"    ");
+    if (i == 1) {
+      if (!ownSource) ownSource = source;
+    } else if (ownSource && [ownSource isEqualToString:source]) {
+      [syms addObject:[NSString stringWithFormat:@"%@%d %@", prefix, i-1,
+                       symbol]];
+      lastAddedIndex = i;
+      if (i+2 >= count) break;
+    } else if ((i == 2) || (i+2 >= count)) {
+      [syms addObject:[NSString stringWithFormat:@"%@%d %@  <%@>", prefix,
+                       i-1, symbol, source]];
+      lastAddedIndex = i;
+      if (i+2 >= count) break;
+    }
+  }
+  return [syms componentsJoinedByString:@"\n"];
+}
+
+typedef enum { kOld, kCondensed, kCapture } mode_t_;
+
+static NSUInteger __attribute__((noinline))
+_recurse(int depth, mode_t_ mode, NSUInteger iterations) {
+  if (depth > 0)
+    return _recurse(depth - 1, mode, iterations) + 1;
+  NSUInteger i, total = 0;
+  void *addresses[128];
+  for (i = 0; i < iterations; i++) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    switch (mode) {
+      case kOld: total += [_condensed_via_callStackSymbols() length]; break;
+      case kCondensed: total += [[NSThread condensedStackTrace] length]; break;
+      case kCapture: total += h_stack_capture(addresses, 128, 0); break;
+    }
+    [pool drain];
+  }
+  return total;
+}
+
+static void bench(const char *name, mode_t_ mode, NSUInteger iterations,
+                  int depth) {
+  double start = _now();
+  _recurse(depth, mode, iterations);
+  double elapsed = _now() - start;
+  printf("%-18s %8.2f us per capture\n", name, elapsed * 1e6 / iterations);
+}
+
+
+int main(int argc, const char * argv[]) {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  NSUInteger iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000;
+  int depth = argc > 2 ? atoi(argv[2]) : 20;
+  bench("callStackSymbols", kOld, iterations, depth);
+  bench("condensed", kCondensed, iterations, depth);
+  bench("capture", kCapture, iterations * 100, depth);
+  [pool drain];
+  return 0;
+}
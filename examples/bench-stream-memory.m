@@ -0,0 +1,111 @@
+/*
+ * Measures the memory held by many idle HDStreams after a burst of reads.
+ *
+ * usage: bench-stream-memory [streams [burst]]
+ *
+ * Creates |streams| (default 100000) pipes with an HDStream on each read end,
+ * writes |burst| (default 16384) bytes to every pipe and waits until all of it
+ * has been delivered to onData, leaving the streams idle. Resident memory and
+ * HDBufferPool usage are printed before and after, along with what the
+ * per-stream read buffers used before HDBufferPool (which grew to the largest
+ * read and were kept for the life of the stream) would have held.
+ *
+ * Needs two file descriptors per stream; the count is lowered if the
+ * RLIMIT_NOFILE hard limit does not allow that many.
+ */
+#import "HDStream.h"
+#import "HDBufferPool.h"
+#import <mach/mach.h>
+#import <sys/resource.h>
+
+static double _rss_mb() {
+  struct mach_task_basic_info info;
+  mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+  if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info,
+                &count) != KERN_SUCCESS) {
+    return 0.0;
+  }
+  return (double)info.resident_size / (1024.0*1024.0);
+}
+
+static void _report(const char *when) {
+  HDBufferPool *bufferPool = [HDBufferPool sharedPool];
+  printf("%-12s RSS %8.1f MB  pool %6.1f MB allocated, %6.1f MB in use\n",
+         when, _rss_mb(),
+         (double)bufferPool.bytesAllocated / (1024.0*1024.0),
+         (double)bufferPool.bytesInUse / (1024.0*1024.0));
+}
+
+
+int main(int argc, const char * argv[]) {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  NSUInteger count = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+  size_t burst = argc > 2 ? strtoul(argv[2], NULL, 10) : 16384;
+
+  struct rlimit rl;
+  getrlimit(RLIMIT_NOFILE, &rl);
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rl);
+  getrlimit(RLIMIT_NOFILE, &rl);
+  if (rl.rlim_cur != RLIM_INFINITY && count * 2 + 64 > rl.rlim_cur) {
+    count = (rl.rlim_cur - 64) / 2;
+    printf("RLIMIT_NOFILE is %llu -- using %lu streams\n",
+           (unsigned long long)rl.rlim_cur, (unsigned long)count);
+  }
+
+  _report("start");
+
+  HDStream **streams = (HDStream**)calloc(count, sizeof(HDStream*));
+  int *writeFds = (int*)calloc(count, sizeof(int));
+  dispatch_semaphore_t done = dispatch_semaphore_create(0);
+  __block volatile int64_t remaining = (int64_t)(count * burst);
+  HDStreamBlock onData = ^(const void *bytes, size_t length) {
+    if (__sync_sub_and_fetch(&remaining, (int64_t)length) == 0)
+      dispatch_semaphore_signal(done);
+  };
+
+  NSUInteger i;
+  for (i = 0; i < count; i++) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+      perror("pipe");
+      return 1;
+    }
+    writeFds[i] = fds[1];
+    streams[i] = [[HDStream alloc] initWithReadOnlyFileDescriptor:fds[0]];
+    streams[i].onData = onData;
+    [streams[i] resume];
+  }
+  _report("created");
+
+  char *data = (char*)malloc(burst);
+  memset(data, 'x', burst);
+  for (i = 0; i < count; i++) {
+    size_t off = 0;
+    while (off < burst) {
+      ssize_t n = write(writeFds[i], data + off, burst - off);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        perror("write");
+        return 1;
+      }
+      off += n;
+    }
+  }
+  dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+  _report("idle");
+  printf("per-stream read buffers would have held up to %.1f MB more\n",
+         (double)count * (burst + 1) / (1024.0*1024.0));
+
+  for (i = 0; i < count; i++) {
+    [streams[i] cancel];
+    [streams[i] release];
+    close(writeFds[i]);
+  }
+  free(streams);
+  free(writeFds);
+  free(data);
+  dispatch_release(done);
+  [pool drain];
+  return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * Measures peak memory of a HURLConnection download per response sink.
+ *
+ * usage: bench-urlsink data|unsized|file|stream|digest [megabytes]
+ *
+ * A local server thread serves |megabytes| (default 256) of data and the body
+ * is fetched into the selected sink:
+ *
+ *   data     HURLDataSink, presized from Content-Length
+ *   unsized  HURLDataSink without Content-Length (the buffer grows as before)
+ *   file     HURLFileDescriptorSink writing to /dev/null
+ *   stream   HURLStreamSink writing to a HDStream on /dev/null
+ *   digest   HURLDigestSink computing SHA-1
+ *
+ * Peak RSS is process-wide, so run one sink per invocation.
+ */
+#import "HURLConnection.h"
+#import "HDStream.h"
+#import <sys/socket.h>
+#import <sys/resource.h>
+#import <netinet/in.h>
+#import <pthread.h>
+#import <fcntl.h>
+#import <mach/mach_time.h>
+
+static size_t gBodySize = 0;
+static BOOL gSendLength = YES;
+
+static double _now() {
+  static mach_timebase_info_data_t tb;
+  if (tb.denom == 0) mach_timebase_info(&tb);
+  return (double)(mach_absolute_time() * tb.numer / tb.denom) / 1e9;
+}
+
+static void *_serve(void *arg) {
+  int lfd = (int)(intptr_t)arg;
+  char buf[65536];
+  memset(buf, 'x', sizeof(buf));
+  while (1) {
+    int fd = accept(lfd, NULL, NULL);
+    if (fd == -1) continue;
+    read(fd, buf, sizeof(buf)); // request (ignored)
+    memset(buf, 'x', sizeof(buf));
+    int n;
+    if (gSendLength) {
+      n = snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\nContent-Length: %lu\r\n"
+                   "Connection: close\r\n\r\n", (unsigned long)gBodySize);
+    } else {
+      n = snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\n");
+    }
+    write(fd, buf, n);
+    memset(buf, 'x', sizeof(buf));
+    size_t left = gBodySize;
+    while (left) {
+      ssize_t w = write(fd, buf, MIN(left, sizeof(buf)));
+      if (w <= 0) break;
+      left -= w;
+    }
+    close(fd);
+  }
+  return NULL;
+}
+
+static int _start_server() {
+  int lfd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  bind(lfd, (struct sockaddr*)&addr, len);
+  listen(lfd, 16);
+  getsockname(lfd, (struct sockaddr*)&addr, &len);
+  pthread_t t;
+  pthread_create(&t, NULL, &_serve, (void*)(intptr_t)lfd);
+  return ntohs(addr.sin_port);
+}
+
+
+int main(int argc, const char * argv[]) {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  const char *mode = argc > 1 ? argv[1] : "data";
+  gBodySize = (argc > 2 ? strtoul(argv[2], NULL, 10) : 256) << 20;
+
+  id<HURLResponseSink> sink = nil;
+  if (strcmp(mode, "data") == 0) {
+    sink = [HURLDataSink sink];
+  } else if (strcmp(mode, "unsized") == 0) {
+    sink = [HURLDataSink sink];
+    gSendLength = NO;
+  } else if (strcmp(mode, "file") == 0) {
+    sink = [HURLFileDescriptorSink sinkWithFileDescriptor:open("/dev/null", O_WRONLY)
+                                            closeWhenDone:YES];
+  } else if (strcmp(mode, "stream") == 0) {
+    HDStream *stream =
+        [HDStream streamWithFileDescriptor:open("/dev/null", O_WRONLY)];
+    [stream resume];
+    sink = [HURLStreamSink sinkWithStream:stream];
+  } else if (strcmp(mode, "digest") == 0) {
+    sink = [HURLDigestSink sinkWithAlgorithm:HURLDigestSHA1];
+  } else {
+    fprintf(stderr, "unknown sink \"%s\"\n", mode);
+    return 1;
+  }
+
+  int port = _start_server();
+  NSURL *url = [NSURL URLWithString:
+                [NSString stringWithFormat:@"http://127.0.0.1:%d/", port]];
+  __block BOOL done = NO;
+  __block NSUInteger resultLength = 0;
+  double start = _now();
+  [url fetchToSink:sink onResponseBlock:nil onCompleteBlock:^(NSError *err,
+                                                              NSData *data) {
+    if (err) NSLog(@"error: %@", err);
+    resultLength = data.length;
+    done = YES;
+  } startImmediately:YES];
+  while (!done) {
+    NSAutoreleasePool *pool2 = [[NSAutoreleasePool alloc] init];
+    [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode
+                             beforeDate:[NSDate distantFuture]];
+    [pool2 drain];
+  }
+  double elapsed = _now() - start;
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  printf("%-8s %lu MB in %.3fs -- %.1f MB/s, peak RSS %.1f MB, result %lu bytes\n",
+         mode, (unsigned long)(gBodySize >> 20), elapsed,
+         (double)gBodySize / (1024.0*1024.0) / elapsed,
+         (double)ru.ru_maxrss / (1024.0*1024.0), // bytes on Darwin
+         (unsigned long)resultLength);
+
+  [pool drain];
+  return 0;
+}
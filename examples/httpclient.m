@@ -0,0 +1,216 @@
+/*
+ * Exercises HDHTTPClient against a local stand-in HTTP/1.1 server.
+ *
+ * usage: httpclient [requests [pipeliningDepth]]
+ *
+ * The server runs on a background thread, answers every request on a
+ * keep-alive connection (alternating Content-Length and chunked responses)
+ * and counts the connections it accepts. With connection reuse working, the
+ * number of connections should not exceed maximumConnectionsPerHost no matter
+ * how many requests are made.
+ *
+ * Afterwards, two failure paths are checked: a GET answered with half a
+ * response delimited by EOF followed by a connection reset must fail with
+ * HDHTTPClientErrorConnectionClosed (rather than complete with what arrived, or
+ * never complete), and a POST whose connection is closed without a response
+ * must fail the same way without being sent a second time.
+ */
+#import "HDHTTPClient.h"
+#import <sys/socket.h>
+#import <netinet/in.h>
+#import <arpa/inet.h>
+#import <pthread.h>
+#import <mach/mach_time.h>
+
+static volatile int32_t gAcceptedConnections = 0;
+static volatile int32_t gDroppedRequests = 0;
+
+static double _now() {
+  static mach_timebase_info_data_t tb;
+  if (tb.denom == 0) mach_timebase_info(&tb);
+  return (double)(mach_absolute_time() * tb.numer / tb.denom) / 1e9;
+}
+
+static void _write_all(int fd, const char *buf, size_t len) {
+  while (len) {
+    ssize_t n = write(fd, buf, len);
+    if (n <= 0) return;
+    buf += n; len -= n;
+  }
+}
+
+// Serve requests on one connection until the client closes it
+static void *_serve_connection(void *arg) {
+  int fd = (int)(intptr_t)arg;
+  char buf[16384];
+  size_t used = 0;
+  while (1) {
+    ssize_t n = read(fd, buf + used, sizeof(buf) - used - 1);
+    if (n <= 0) break;
+    used += n;
+    buf[used] = '\0';
+    char *end;
+    // answer every complete request in the buffer (handles pipelining)
+    while ((end = strstr(buf, "\r\n\r\n"))) {
+      char path[256] = "/";
+      sscanf(buf, "%*s %255s", path);
+      if (strcmp(path, "/reset") == 0) {
+        // half a response without Content-Length, then a RST instead of a FIN
+        static const char partial[] =
+            "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\npartial";
+        _write_all(fd, partial, sizeof(partial) - 1);
+        usleep(100000); // let the client read it first
+        struct linger lg = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        close(fd);
+        return NULL;
+      } else if (strcmp(path, "/drop") == 0) {
+        // close without answering
+        OSAtomicIncrement32(&gDroppedRequests);
+        close(fd);
+        return NULL;
+      }
+      char response[1024];
+      int len;
+      if (strncmp(path, "/chunked", 8) == 0) {
+        len = snprintf(response, sizeof(response),
+            "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+            "%lx\r\n%s\r\n0\r\n\r\n", (unsigned long)strlen(path), path);
+      } else {
+        len = snprintf(response, sizeof(response),
+            "HTTP/1.1 200 OK\r\nContent-Length: %lu\r\n\r\n%s",
+            (unsigned long)strlen(path), path);
+      }
+      _write_all(fd, response, len);
+      size_t consumed = (end + 4) - buf;
+      memmove(buf, end + 4, used - consumed + 1);
+      used -= consumed;
+    }
+  }
+  close(fd);
+  return NULL;
+}
+
+static void *_serve(void *arg) {
+  int lfd = (int)(intptr_t)arg;
+  while (1) {
+    int fd = accept(lfd, NULL, NULL);
+    if (fd == -1) continue;
+    OSAtomicIncrement32(&gAcceptedConnections);
+    pthread_t t;
+    pthread_create(&t, NULL, &_serve_connection, (void*)(intptr_t)fd);
+    pthread_detach(t);
+  }
+  return NULL;
+}
+
+static int _start_server() {
+  int lfd = socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+  setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  bind(lfd, (struct sockaddr*)&addr, len);
+  listen(lfd, 128);
+  getsockname(lfd, (struct sockaddr*)&addr, &len);
+  pthread_t t;
+  pthread_create(&t, NULL, &_serve, (void*)(intptr_t)lfd);
+  return ntohs(addr.sin_port);
+}
+
+
+int main(int argc, const char * argv[]) {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  NSUInteger count = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000;
+  NSUInteger depth = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+  int port = _start_server();
+
+  HDHTTPClient *client = [[HDHTTPClient new] autorelease];
+  client.pipeliningDepth = depth;
+
+  dispatch_group_t group = dispatch_group_create();
+  __block NSUInteger failures = 0;
+  double start = _now();
+  NSUInteger i;
+  for (i = 0; i < count; i++) {
+    NSString *path = [NSString stringWithFormat:@"/%@%lu",
+                      (i % 2) ? @"chunked" : @"plain", (unsigned long)i];
+    NSURL *url = [NSURL URLWithString:[NSString stringWithFormat:
+                  @"http://127.0.0.1:%d%@", port, path]];
+    dispatch_group_enter(group);
+    [client fetch:[NSURLRequest requestWithURL:url]
+        onResponseBlock:nil
+            onDataBlock:nil
+        onCompleteBlock:^(NSError *err, NSData *data) {
+      NSString *body = [[[NSString alloc] initWithData:data
+          encoding:NSUTF8StringEncoding] autorelease];
+      if (err || ![body isEqualToString:path]) {
+        NSLog(@"FAIL %@: %@ (got %@)", path, err, body);
+        failures++; // callbacks are serial
+      }
+      dispatch_group_leave(group);
+    }];
+  }
+  dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+  double elapsed = _now() - start;
+
+  printf("%lu requests in %.3fs (%.0f req/s), %lu failures, "
+         "%d connections (max %lu per host, pipelining depth %lu)\n",
+         (unsigned long)count, elapsed, (double)count / elapsed,
+         (unsigned long)failures, gAcceptedConnections,
+         (unsigned long)client.maximumConnectionsPerHost, (unsigned long)depth);
+
+  // failure paths
+  NSUInteger failuresBefore = failures;
+  NSURL *resetURL = [NSURL URLWithString:[NSString stringWithFormat:
+                     @"http://127.0.0.1:%d/reset", port]];
+  dispatch_group_enter(group);
+  [client fetch:[NSURLRequest requestWithURL:resetURL]
+      onResponseBlock:nil
+          onDataBlock:nil
+      onCompleteBlock:^(NSError *err, NSData *data) {
+    if (err.code != HDHTTPClientErrorConnectionClosed) {
+      NSLog(@"FAIL /reset: expected a closed connection, got %@ (%lu bytes)",
+            err, (unsigned long)data.length);
+      failures++;
+    } else {
+      printf("/reset: %s (%s)\n", [[err localizedDescription] UTF8String],
+             [[[[err userInfo] objectForKey:NSUnderlyingErrorKey] description]
+              UTF8String]);
+    }
+    dispatch_group_leave(group);
+  }];
+
+  NSURL *dropURL = [NSURL URLWithString:[NSString stringWithFormat:
+                    @"http://127.0.0.1:%d/drop", port]];
+  NSMutableURLRequest *post = [NSMutableURLRequest requestWithURL:dropURL];
+  [post setHTTPMethod:@"POST"];
+  dispatch_group_enter(group);
+  [client fetch:post
+      onResponseBlock:nil
+          onDataBlock:nil
+      onCompleteBlock:^(NSError *err, NSData *data) {
+    if (err.code != HDHTTPClientErrorConnectionClosed) {
+      NSLog(@"FAIL POST /drop: expected a closed connection, got %@", err);
+      failures++;
+    }
+    dispatch_group_leave(group);
+  }];
+
+  if (dispatch_group_wait(group, dispatch_time(DISPATCH_TIME_NOW,
+                                               10 * NSEC_PER_SEC)) != 0) {
+    printf("FAIL: failure path requests did not complete\n");
+    return 1; // the callbacks might still run, so don't tear anything down
+  } else if (gDroppedRequests != 1) {
+    printf("FAIL: POST /drop was sent %d times\n", gDroppedRequests);
+    failures++;
+  }
+  printf("failure paths: %s\n", failures > failuresBefore ? "FAILED" : "ok");
+
+  dispatch_release(group);
+  [pool drain];
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * Measures the cost of HRefcountLogger's NSLog and binary tracing modes and
+ * decodes trace files.
+ *
+ * usage: refcount-trace [threads [iterations]]
+ *        refcount-trace decode <tracefile>
+ *
+ * The benchmark retains and releases a shared logger from |threads| threads,
+ * first a few times in NSLog mode (stderr is redirected to /dev/null) and then
+ * |iterations| times per thread in tracing mode. The trace is written to
+ * /tmp/refcount.trace and the first records are decoded.
+ */
+#import "HRefcountLogger.h"
+#import <mach/mach_time.h>
+#import <fcntl.h>
+
+static double _now() {
+  static mach_timebase_info_data_t tb;
+  if (tb.denom == 0) mach_timebase_info(&tb);
+  return (double)(mach_absolute_time() * tb.numer / tb.denom) / 1e9;
+}
+
+static double _run(HRefcountLogger *logger, size_t threads, size_t iterations) {
+  dispatch_group_t group = dispatch_group_create();
+  dispatch_queue_t queue = dispatch_get_global_queue(0, 0);
+  double start = _now();
+  size_t t;
+  for (t = 0; t < threads; t++) {
+    dispatch_group_async(group, queue, ^{
+      size_t i;
+      for (i = 0; i < iterations; i++) {
+        [logger retain];
+        [logger release];
+      }
+    });
+  }
+  dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+  dispatch_release(group);
+  // nanoseconds per retain+release pair
+  return (_now() - start) * 1e9 / (double)(threads * iterations);
+}
+
+
+int main(int argc, const char * argv[]) {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+
+  if (argc > 2 && strcmp(argv[1], "decode") == 0) {
+    NSString *text = [HRefcountLogger decodeTraceAtPath:
+                      [NSString stringWithUTF8String:argv[2]]];
+    if (!text) {
+      fprintf(stderr, "failed to read %s\n", argv[2]);
+      return 1;
+    }
+    fputs([text UTF8String], stdout);
+    [pool drain];
+    return 0;
+  }
+
+  size_t threads = argc > 1 ? strtoul(argv[1], NULL, 10) : 4;
+  size_t iterations = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+
+  // silence NSLog
+  int savedStderr = dup(STDERR_FILENO);
+  int devnull = open("/dev/null", O_WRONLY);
+  dup2(devnull, STDERR_FILENO);
+  HRefcountLogger *logger = [[HRefcountLogger alloc] initWithName:@"bench"];
+  double nslogCost = _run(logger, threads, 100);
+  dup2(savedStderr, STDERR_FILENO);
+
+  [HRefcountLogger startTracingWithRecordsPerThread:65536];
+  HRefcountLogger *traced = [[HRefcountLogger alloc] initWithName:@"traced"];
+  double traceCost = _run(traced, threads, iterations);
+  logger.logRetainAndRelease = NO;
+  traced.logRetainAndRelease = NO;
+  double baseCost = _run(traced, threads, iterations);
+
+  printf("retain+release pair: %.0f ns untraced, %.0f ns traced, "
+         "%.0f ns NSLog (%lu threads)\n", baseCost, traceCost, nslogCost,
+         (unsigned long)threads);
+
+  const char *path = "/tmp/refcount.trace";
+  double start = _now();
+  [HRefcountLogger writeTraceToPath:[NSString stringWithUTF8String:path]];
+  printf("wrote %s in %.3fs\n", path, _now() - start);
+  NSString *text = [HRefcountLogger decodeTraceAtPath:
+                    [NSString stringWithUTF8String:path]];
+  NSArray *lines = [text componentsSeparatedByString:@"\n"];
+  NSUInteger i;
+  for (i = 0; i < 12 && i < [lines count]; i++)
+    printf("%s\n", [[lines objectAtIndex:i] UTF8String]);
+
+  [traced release];
+  [logger release];
+  [pool drain];
+  return 0;
+}
@@ -0,0 +1,167 @@
+/*
+ * Reference child process for HDProcess channels, in plain C.
+ *
+ * Waits for a channel to arrive on stdin (see -[HDProcess createChannel:] and
+ * -[HDProcess createSharedMemoryChannel:]) and echoes every message it
+ * receives on it back to the parent until the parent closes the channel.
+ *
+ *  - One file descriptor: a socketpair channel. Data is echoed as is.
+ *  - Two file descriptors: a shared memory channel (shared memory object and
+ *    doorbell socket, see HDShmRing.h). Messages from ring 0 are echoed to
+ *    ring 1.
+ *
+ * Build: cc -O2 -I.. -o shm-channel-client shm-channel-client.c
+ */
+#include "HDShmRing.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+// Busy-poll iterations before going to sleep on the doorbell. Spinning only
+// helps if the parent can run at the same time, so not on a single CPU.
+#define SPIN_COUNT 20000
+static int gSpinCount = SPIN_COUNT;
+
+// Receive a channel name and up to two file descriptors on |sock|
+static int recv_channel(int sock, char *name, size_t namesize, int fds[2]) {
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(2 * sizeof(int))];
+  } control;
+  struct iovec iov = { name, namesize - 1 };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  ssize_t n;
+  do {
+    n = recvmsg(sock, &msg, 0);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0)
+    return -1;
+  name[n] = '\0';
+  int count = 0;
+  struct cmsghdr *cmsg;
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      int nfds = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+      int i;
+      for (i = 0; i < nfds && count < 2; i++)
+        memcpy(&fds[count++], CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+    }
+  }
+  return count;
+}
+
+
+static void serve_socket(int fd) {
+  char buf[65536];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    ssize_t off = 0;
+    while (off < n) {
+      ssize_t w = write(fd, buf + off, n - off);
+      if (w < 0) {
+        if (errno == EINTR) continue;
+        return;
+      }
+      off += w;
+    }
+  }
+}
+
+
+static void ring_doorbell(int doorbell) {
+  char c = 0;
+  // EAGAIN means there are unread wakeups already, which is just as good
+  while (write(doorbell, &c, 1) < 0 && errno == EINTR) {}
+}
+
+// Wait for a wakeup from the parent. Returns 0 if the parent went away.
+static int wait_doorbell(int doorbell) {
+  struct pollfd pfd = { doorbell, POLLIN, 0 };
+  while (poll(&pfd, 1, -1) < 0) {
+    if (errno != EINTR) return 0;
+  }
+  char buf[64];
+  ssize_t n;
+  while ((n = read(doorbell, buf, sizeof(buf))) > 0) {}
+  return !(n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR));
+}
+
+
+static void serve_shm(int memfd, int doorbell) {
+  struct stat st;
+  if (fstat(memfd, &st) != 0) return;
+  hd_shm_header_t *h = (hd_shm_header_t*)mmap(NULL, st.st_size,
+      PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (h == MAP_FAILED) return;
+  if (!hd_shm_valid(h, st.st_size)) {
+    fprintf(stderr, "shm-channel-client: invalid shared memory\n");
+    return;
+  }
+  fcntl(doorbell, F_SETFL, fcntl(doorbell, F_GETFL) | O_NONBLOCK);
+
+  int spins = 0;
+  while (!h->closed) {
+    uint32_t length, next;
+    char *msg = hd_shm_ring_peek(h, HD_SHM_RING_TO_CHILD, &length, &next);
+    if (msg) {
+      spins = 0;
+      int r;
+      while ((r = hd_shm_ring_write(h, HD_SHM_RING_TO_PARENT, msg, length)) == 0) {
+        // the parent is not keeping up -- wait for it to make room
+        uint32_t tail = hd_shm_ring_tail(h, HD_SHM_RING_TO_PARENT);
+        if (hd_shm_ring_write(h, HD_SHM_RING_TO_PARENT, msg, length))
+          break;
+        if (hd_shm_ring_prepare_wait(h, HD_SHM_RING_TO_PARENT, tail) &&
+            !wait_doorbell(doorbell)) {
+          return;
+        }
+      }
+      if (hd_shm_ring_should_wake_reader(h, HD_SHM_RING_TO_PARENT))
+        ring_doorbell(doorbell);
+      if (hd_shm_ring_consume(h, HD_SHM_RING_TO_CHILD, next))
+        ring_doorbell(doorbell);
+    } else if (++spins < gSpinCount) {
+      #if defined(__x86_64__) || defined(__i386__)
+      __asm__ __volatile__("pause");
+      #endif
+    } else if (hd_shm_ring_prepare_sleep(h, HD_SHM_RING_TO_CHILD)) {
+      spins = 0;
+      if (!wait_doorbell(doorbell))
+        return;
+    }
+  }
+}
+
+
+int main(void) {
+  char name[256];
+  if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+    gSpinCount = 0;
+  int fds[2] = { -1, -1 };
+  int count = recv_channel(STDIN_FILENO, name, sizeof(name), fds);
+  if (count == 1) {
+    serve_socket(fds[0]);
+  } else if (count == 2) {
+    serve_shm(fds[0], fds[1]);
+  } else {
+    fprintf(stderr, "shm-channel-client: no channel received on stdin\n");
+    return 1;
+  }
+  return 0;
+}
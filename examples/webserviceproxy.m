@@ -0,0 +1,330 @@
+/*
+ * Exercises HUWebServiceProxy batching, deduplication and caching against a
+ * local stand-in JSON-RPC server.
+ *
+ * usage: webserviceproxy
+ *
+ * The server runs on a background thread and answers
+ *
+ *   /rpc/<method>  with {"method":<method>,"hits":<n>}, where n counts the
+ *                  requests made for <method> ("slow" waits 300 ms first)
+ *   /batch         with a JSON-RPC 2.0 batch response, in which "missing"
+ *                  calls get no entry and "fail" calls get an error
+ *
+ * and the driver checks that
+ *
+ *   - a batch fans its results out by id, failing the call whose id is
+ *     missing from the response and the call answered with an error
+ *   - identical calls in flight share one request, and a request canceled
+ *     with clearDelegatesAndCancel is not joined by later identical calls
+ *   - cached results are used until cacheTTL has passed
+ *
+ * Exits with a non-zero status if any check fails.
+ */
+#import "HUWebServiceProxy.h"
+#import "HUJSONStreamParser.h"
+#import <sys/socket.h>
+#import <netinet/in.h>
+#import <arpa/inet.h>
+#import <pthread.h>
+
+static NSMutableDictionary *gHits; // path => NSNumber, @synchronized
+static int gFailures = 0;
+
+static int _hits(NSString *path) {
+  @synchronized(gHits) {
+    return [[gHits objectForKey:path] intValue];
+  }
+}
+
+static int _count_hit(NSString *path) {
+  @synchronized(gHits) {
+    int n = [[gHits objectForKey:path] intValue] + 1;
+    [gHits setObject:[NSNumber numberWithInt:n] forKey:path];
+    return n;
+  }
+}
+
+static void _check(BOOL ok, NSString *what) {
+  printf("%s %s\n", ok ? "ok  " : "FAIL", [what UTF8String]);
+  if (!ok) gFailures++;
+}
+
+// ----------------------------------------------------------------------------
+// Stand-in server
+
+static void _write_all(int fd, const char *buf, size_t len) {
+  while (len) {
+    ssize_t n = write(fd, buf, len);
+    if (n <= 0) return;
+    buf += n; len -= n;
+  }
+}
+
+static NSString *_batch_response(NSData *body) {
+  HUJSONStreamParser *parser = [[[HUJSONStreamParser alloc] init] autorelease];
+  [parser parseData:body];
+  NSMutableArray *entries = [NSMutableArray array];
+  if ([parser finish] && [parser.rootObject isKindOfClass:[NSArray class]]) {
+    for (NSDictionary *rpc in (NSArray*)parser.rootObject) {
+      NSString *method = [rpc objectForKey:@"method"];
+      id ident = [rpc objectForKey:@"id"];
+      if ([method isEqualToString:@"missing"]) {
+        continue;
+      } else if ([method isEqualToString:@"fail"]) {
+        [entries addObject:[NSString stringWithFormat:
+            @"{\"jsonrpc\":\"2.0\",\"id\":%@,\"error\":"
+            "{\"code\":-32000,\"message\":\"failed on purpose\"}}", ident]];
+      } else {
+        [entries addObject:[NSString stringWithFormat:
+            @"{\"jsonrpc\":\"2.0\",\"id\":%@,\"result\":{\"method\":\"%@\"}}",
+            ident, method]];
+      }
+    }
+  }
+  return [NSString stringWithFormat:@"[%@]",
+          [entries componentsJoinedByString:@","]];
+}
+
+// Answer one request and close the connection
+static void *_serve_connection(void *arg) {
+  NSAutoreleasePool *pool = [NSAutoreleasePool new];
+  int fd = (int)(intptr_t)arg;
+  NSMutableData *request = [NSMutableData data];
+  char buf[16384];
+  NSUInteger headerLength = 0;
+  long contentLength = 0;
+  while (1) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n <= 0) break;
+    [request appendBytes:buf length:n];
+    if (!headerLength) {
+      const char *p = (const char*)[request bytes];
+      const char *end = strnstr(p, "\r\n\r\n", [request length]);
+      if (!end) continue;
+      headerLength = (end + 4) - p;
+      NSString *head = [[[NSString alloc] initWithBytes:p length:headerLength
+          encoding:NSISOLatin1StringEncoding] autorelease];
+      NSRange r = [head rangeOfString:@"\r\nContent-Length:"
+                              options:NSCaseInsensitiveSearch];
+      if (r.location != NSNotFound)
+        contentLength = [[head substringFromIndex:NSMaxRange(r)] intValue];
+    }
+    if ([request length] >= headerLength + contentLength) break;
+  }
+
+  char path[256] = "/";
+  if (headerLength)
+    sscanf((const char*)[request bytes], "%*s %255s", path);
+  NSString *pathString = [NSString stringWithUTF8String:path];
+  int hits = _count_hit(pathString);
+  NSString *json;
+  if ([pathString isEqualToString:@"/batch"]) {
+    NSData *body = [request subdataWithRange:NSMakeRange(headerLength,
+        [request length] - headerLength)];
+    json = _batch_response(body);
+  } else {
+    NSString *method = [pathString lastPathComponent];
+    if ([method isEqualToString:@"slow"])
+      usleep(300000);
+    json = [NSString stringWithFormat:@"{\"method\":\"%@\",\"hits\":%d}",
+            method, hits];
+  }
+  NSData *body = [json dataUsingEncoding:NSUTF8StringEncoding];
+  NSString *head = [NSString stringWithFormat:
+      @"HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+      "Content-Length: %lu\r\nConnection: close\r\n\r\n",
+      (unsigned long)[body length]];
+  _write_all(fd, [head UTF8String], strlen([head UTF8String]));
+  _write_all(fd, (const char*)[body bytes], [body length]);
+  close(fd);
+  [pool drain];
+  return NULL;
+}
+
+static void *_serve(void *arg) {
+  int lfd = (int)(intptr_t)arg;
+  while (1) {
+    int fd = accept(lfd, NULL, NULL);
+    if (fd == -1) continue;
+    pthread_t t;
+    pthread_create(&t, NULL, &_serve_connection, (void*)(intptr_t)fd);
+    pthread_detach(t);
+  }
+  return NULL;
+}
+
+static int _start_server() {
+  int lfd = socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+  setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  bind(lfd, (struct sockaddr*)&addr, len);
+  listen(lfd, 128);
+  getsockname(lfd, (struct sockaddr*)&addr, &len);
+  pthread_t t;
+  pthread_create(&t, NULL, &_serve, (void*)(intptr_t)lfd);
+  return ntohs(addr.sin_port);
+}
+
+// ----------------------------------------------------------------------------
+// Driver
+
+@interface StandInProxy : HUWebServiceProxy {
+  int port_;
+}
+- (id)initWithPort:(int)port;
+@end
+@implementation StandInProxy
+
+- (id)initWithPort:(int)port {
+  if ((self = [super init]))
+    port_ = port;
+  return self;
+}
+
+- (NSURL *)urlForMethod:(NSString *)method withArgs:(id)args {
+  return [NSURL URLWithString:[NSString stringWithFormat:
+          @"http://127.0.0.1:%d/rpc/%@", port_, method]];
+}
+
+- (NSURL *)urlForBatch:(NSArray *)calls {
+  return [NSURL URLWithString:[NSString stringWithFormat:
+          @"http://127.0.0.1:%d/batch", port_]];
+}
+
+@end
+
+
+// Run the main run loop (which delivers request callbacks, batch timers and
+// cache hits) until |remaining| reaches zero. Returns NO on timeout.
+static BOOL _run_until_done(volatile int *remaining, NSTimeInterval timeout) {
+  NSDate *deadline = [NSDate dateWithTimeIntervalSinceNow:timeout];
+  while (*remaining > 0 && [deadline timeIntervalSinceNow] > 0) {
+    [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode
+        beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.01]];
+  }
+  return *remaining <= 0;
+}
+
+static void _sleep_run_loop(NSTimeInterval seconds) {
+  [[NSRunLoop currentRunLoop] runUntilDate:
+      [NSDate dateWithTimeIntervalSinceNow:seconds]];
+}
+
+static NSDictionary *_args(int n) {
+  return [NSDictionary dictionaryWithObject:[NSNumber numberWithInt:n]
+                                     forKey:@"n"];
+}
+
+
+static void _test_batch(StandInProxy *proxy) {
+  proxy.batchWindow = 0.05;
+  __block int remaining = 4;
+  __block id resultA = nil, resultB = nil;
+  __block NSError *errMissing = nil, *errFail = nil;
+  [proxy call:@"a" args:_args(1) block:^(id r, NSError *err) {
+    resultA = [r retain]; remaining--;
+  }];
+  [proxy call:@"b" args:_args(2) block:^(id r, NSError *err) {
+    resultB = [r retain]; remaining--;
+  }];
+  [proxy call:@"missing" args:_args(3) block:^(id r, NSError *err) {
+    errMissing = [err retain]; remaining--;
+  }];
+  [proxy call:@"fail" args:_args(4) block:^(id r, NSError *err) {
+    errFail = [err retain]; remaining--;
+  }];
+  _check(_run_until_done(&remaining, 5.0), @"batch: all calls completed");
+  _check(_hits(@"/batch") == 1, @"batch: one request for four calls");
+  _check([[resultA objectForKey:@"method"] isEqual:@"a"] &&
+         [[resultB objectForKey:@"method"] isEqual:@"b"],
+         @"batch: results fanned out by id");
+  _check([[errMissing localizedDescription]
+          isEqual:@"Missing result in batch response"],
+         @"batch: call missing from the response failed");
+  _check([errFail code] == -32000, @"batch: error entry failed its call");
+  [resultA release]; [resultB release];
+  [errMissing release]; [errFail release];
+  proxy.batchWindow = 0.0;
+}
+
+
+static void _test_dedup(StandInProxy *proxy) {
+  proxy.deduplicatesCalls = YES;
+  __block int remaining = 2;
+  __block id result1 = nil, result2 = nil;
+  ASIHTTPRequest *r1 = [proxy call:@"slow" args:_args(1)
+                             block:^(id r, NSError *err) {
+    result1 = [r retain]; remaining--;
+  }];
+  ASIHTTPRequest *r2 = [proxy call:@"slow" args:_args(1)
+                             block:^(id r, NSError *err) {
+    result2 = [r retain]; remaining--;
+  }];
+  _check(r1 && r1 == r2, @"dedup: identical call joined the request");
+  _check(_run_until_done(&remaining, 5.0), @"dedup: both calls completed");
+  _check(result1 && result1 == result2 && _hits(@"/rpc/slow") == 1,
+         @"dedup: one request, same result");
+  [result1 release]; [result2 release];
+
+  // a canceled request must not be joined, or the call would never complete
+  ASIHTTPRequest *r3 = [proxy call:@"slow" args:_args(2)
+                             block:^(id r, NSError *err) {}];
+  [r3 clearDelegatesAndCancel];
+  remaining = 1;
+  ASIHTTPRequest *r4 = [proxy call:@"slow" args:_args(2)
+                             block:^(id r, NSError *err) { remaining--; }];
+  _check(r4 && r4 != r3, @"dedup: canceled request not joined");
+  _check(_run_until_done(&remaining, 5.0),
+         @"dedup: call after a canceled one completed");
+  proxy.deduplicatesCalls = NO;
+}
+
+
+static void _test_cache(StandInProxy *proxy) {
+  proxy.cacheTTL = 0.5;
+  __block int remaining = 1;
+  __block int hits1 = 0, hits2 = 0, hits3 = 0;
+  [proxy call:@"count" block:^(id r, NSError *err) {
+    hits1 = [[r objectForKey:@"hits"] intValue]; remaining--;
+  }];
+  _run_until_done(&remaining, 5.0);
+  remaining = 1;
+  [proxy call:@"count" block:^(id r, NSError *err) {
+    hits2 = [[r objectForKey:@"hits"] intValue]; remaining--;
+  }];
+  _run_until_done(&remaining, 5.0);
+  _check(hits1 == 1 && hits2 == 1 && _hits(@"/rpc/count") == 1,
+         @"cache: second call answered from the cache");
+
+  _sleep_run_loop(0.7);
+  remaining = 1;
+  [proxy call:@"count" block:^(id r, NSError *err) {
+    hits3 = [[r objectForKey:@"hits"] intValue]; remaining--;
+  }];
+  _run_until_done(&remaining, 5.0);
+  _check(hits3 == 2 && _hits(@"/rpc/count") == 2,
+         @"cache: expired result fetched again");
+  proxy.cacheTTL = 0.0;
+}
+
+
+int main(int argc, const char * argv[]) {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  gHits = [NSMutableDictionary new];
+  int port = _start_server();
+  StandInProxy *proxy = [[[StandInProxy alloc] initWithPort:port] autorelease];
+
+  _test_batch(proxy);
+  _test_dedup(proxy);
+  _test_cache(proxy);
+
+  printf("%d failures\n", gFailures);
+  [pool drain];
+  return gFailures ? 1 : 0;
+}
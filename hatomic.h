@@ -0,0 +1,64 @@
+/*
+ * The parts of <libkern/OSAtomic.h> used by HDStream and HDBufferPool.
+ *
+ * On Darwin this simply includes the system header. Elsewhere (the io_uring
+ * stream backend is Linux-only) the same names are provided on top of the
+ * GCC __sync builtins, with the same semantics -- including the bit
+ * numbering of OSAtomicTestAndSet/Clear, where bit n is (0x80 >> (n & 7)) of
+ * byte (n >> 3), which HAFLAG_TEST in HDStream-private.h relies on.
+ *
+ * Copyright 2010 Rasmus Andersson <http://hunch.se/>
+ * Licensed under the MIT license.
+ */
+#ifndef H_ATOMIC_H_
+#define H_ATOMIC_H_
+
+#if defined(__APPLE__)
+  #include <libkern/OSAtomic.h>
+#else
+  #include <stdbool.h>
+  #include <stdint.h>
+  #include <sched.h>
+
+  typedef int32_t OSSpinLock;
+  #define OS_SPINLOCK_INIT 0
+
+  static inline bool OSSpinLockTry(volatile OSSpinLock *lock) {
+    return __sync_lock_test_and_set(lock, 1) == 0;
+  }
+
+  static inline void OSSpinLockLock(volatile OSSpinLock *lock) {
+    int spins = 0;
+    while (!OSSpinLockTry(lock)) {
+      // wait without hammering the cache line, backing off to the scheduler
+      // if the holder has been preempted
+      while (*lock) {
+        if (++spins > 100) sched_yield();
+      }
+    }
+  }
+
+  static inline void OSSpinLockUnlock(volatile OSSpinLock *lock) {
+    __sync_lock_release(lock);
+  }
+
+  static inline void OSMemoryBarrier(void) {
+    __sync_synchronize();
+  }
+
+  static inline bool OSAtomicTestAndSetBarrier(uint32_t n,
+                                               volatile void *address) {
+    volatile uint8_t *p = (volatile uint8_t*)address + (n >> 3);
+    uint8_t mask = (uint8_t)(0x80 >> (n & 7));
+    return (__sync_fetch_and_or(p, mask) & mask) != 0;
+  }
+
+  static inline bool OSAtomicTestAndClearBarrier(uint32_t n,
+                                                 volatile void *address) {
+    volatile uint8_t *p = (volatile uint8_t*)address + (n >> 3);
+    uint8_t mask = (uint8_t)(0x80 >> (n & 7));
+    return (__sync_fetch_and_and(p, (uint8_t)~mask) & mask) != 0;
+  }
+#endif
+
+#endif // H_ATOMIC_H_
@@ -154,6 +154,22 @@ static inline void hobjc_swizzle(Class cls, SEL origsel, SEL newsel) {
   } \
 }
 
+/*!
+ * Forward missing messages to class instance |member| using the runtime's
+ * fast forwarding path. The message is resent to |member| directly by
+ * objc_msgSend (and thereby served from |member|'s method cache) without
+ * building an NSInvocation, making it an order of magnitude cheaper than
+ * H_FORWARD_INVOCATION_TO_MEMBER_IMPL.
+ *
+ * Messages |member| does not respond to fall back to the invocation path, so
+ * the behavior is otherwise the same as H_FORWARD_INVOCATION_TO_MEMBER_IMPL.
+ */
+#define H_FORWARD_TO_MEMBER_IMPL(member) \
+- (id)forwardingTargetForSelector:(SEL)sel { \
+  return (member && [member respondsToSelector:sel]) ? member : nil; \
+} \
+H_FORWARD_INVOCATION_TO_MEMBER_IMPL(member)
+
 
 #endif // __OBJC__
 
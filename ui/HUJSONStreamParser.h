@@ -0,0 +1,85 @@
+#import <Foundation/Foundation.h>
+
+extern NSString * const HUJSONStreamParserErrorDomain;
+
+typedef void (^HUJSONStreamParserElementBlock)(id element);
+
+/**
+ * Incremental JSON parser which consumes UTF-8 bytes as they arrive.
+ *
+ * Objects are built directly from the input bytes -- there is no intermediate
+ * string of the whole document -- and parsing state is carried across chunks,
+ * so a document can be split at any byte.
+ *
+ * Example:
+ *
+ *     HUJSONStreamParser *parser = [HUJSONStreamParser new];
+ *     [parser parseData:chunk1];
+ *     [parser parseData:chunk2];
+ *     if ([parser finish])
+ *       NSLog(@"parsed %@", parser.rootObject);
+ *     else
+ *       NSLog(@"error: %@", parser.error);
+ *     [parser release];
+ *
+ * Element mode:
+ *
+ * When <elementBlock> is set, values which are direct members of a container
+ * at <elementDepth> (1, the default, means the root array or object) are
+ * passed to the block as soon as they are complete instead of being added to
+ * their container. This way arbitrarily large arrays can be processed while
+ * only one element at a time is held in memory. The container itself is still
+ * part of <rootObject> -- it's just empty.
+ */
+@interface HUJSONStreamParser : NSObject {
+	int state_;
+	struct _hujson_frame *stack_;
+	NSUInteger depth_;
+	NSUInteger stackCapacity_;
+	id rootObject_;
+	NSError *error_;
+	unsigned long long offset_;
+	HUJSONStreamParserElementBlock elementBlock_;
+	NSUInteger elementDepth_;
+	// token buffer for strings and numbers spanning chunks
+	char *buf_;
+	size_t buflen_;
+	size_t bufcap_;
+	BOOL stringIsKey_;
+	uint32_t codepoint_;
+	int hexcount_;
+	uint32_t highSurrogate_;
+	const char *literal_;
+	size_t literalPos_;
+}
+
+// The parsed document, available after finish returned YES
+@property(readonly) id rootObject;
+
+// Set when parsing failed
+@property(readonly) NSError *error;
+
+// Called with each element at <elementDepth> (see "Element mode" above)
+@property(copy) HUJSONStreamParserElementBlock elementBlock;
+@property NSUInteger elementDepth;
+
+// Parse a complete document
++ (id)objectWithData:(NSData *)data error:(NSError **)error;
+
+/**
+ * Parse the next <length> bytes of the document. Returns NO if the input is
+ * not valid JSON, in which case <error> is set and further input is ignored.
+ */
+- (BOOL)parseBytes:(const void *)bytes length:(size_t)length;
+- (BOOL)parseData:(NSData *)data;
+
+/**
+ * Signal the end of the document. Returns YES if a complete value was parsed
+ * (available as <rootObject>), otherwise NO with <error> set.
+ */
+- (BOOL)finish;
+
+// Discard all state so the parser can be used for another document
+- (void)reset;
+
+@end
@@ -0,0 +1,460 @@
+#import "HUJSONStreamParser.h"
+
+NSString * const HUJSONStreamParserErrorDomain = @"HUJSONStreamParserErrorDomain";
+
+#define HUJSON_MAX_DEPTH 1024
+
+typedef struct _hujson_frame {
+	id container; // NSMutableArray or NSMutableDictionary
+	NSString *key; // pending key (dictionaries only)
+	BOOL isDict;
+} _hujson_frame_t;
+
+enum {
+	kStateValue = 0,    // expecting a value
+	kStateValueOrClose, // expecting a value or "]" (just after "[")
+	kStateKeyOrClose,   // expecting a key or "}" (just after "{")
+	kStateKey,          // expecting a key
+	kStateColon,        // expecting ":"
+	kStateComma,        // expecting "," or a matching close
+	kStateString,       // inside a string
+	kStateEscape,       // after "\" inside a string
+	kStateUnicode,      // inside a "\uXXXX" escape
+	kStateNumber,       // inside a number
+	kStateLiteral,      // inside true, false or null
+	kStateDone,         // a complete value has been parsed
+	kStateError,
+};
+
+@interface HUJSONStreamParser (Private)
+- (void)_fail:(NSString *)reason at:(unsigned long long)offset;
+- (void)_emit:(id)value;
+@end
+
+@implementation HUJSONStreamParser
+
+@synthesize rootObject = rootObject_,
+            error = error_,
+            elementBlock = elementBlock_,
+            elementDepth = elementDepth_;
+
++ (id)objectWithData:(NSData *)data error:(NSError **)error {
+	HUJSONStreamParser *parser = [[self alloc] init];
+	id obj = nil;
+	if ([parser parseData:data] && [parser finish])
+		obj = [[parser.rootObject retain] autorelease];
+	else if (error)
+		*error = [[parser.error retain] autorelease];
+	[parser release];
+	return obj;
+}
+
+- (id)init {
+	if ((self = [super init])) {
+		elementDepth_ = 1;
+	}
+	return self;
+}
+
+- (void)dealloc {
+	[self reset];
+	free(stack_);
+	free(buf_);
+	[elementBlock_ release];
+	[super dealloc];
+}
+
+- (void)reset {
+	while (depth_) {
+		_hujson_frame_t *f = &stack_[--depth_];
+		[f->container release];
+		[f->key release];
+	}
+	[rootObject_ release];
+	rootObject_ = nil;
+	[error_ release];
+	error_ = nil;
+	state_ = kStateValue;
+	offset_ = 0;
+	buflen_ = 0;
+	highSurrogate_ = 0;
+}
+
+#pragma mark -
+#pragma mark Helpers
+
+static inline void _buf_append(HUJSONStreamParser *self, const void *p, size_t len) {
+	if (self->buflen_ + len > self->bufcap_) {
+		size_t cap = self->bufcap_ ? self->bufcap_ : 256;
+		while (cap < self->buflen_ + len) cap *= 2;
+		self->buf_ = (char *)realloc(self->buf_, cap);
+		self->bufcap_ = cap;
+	}
+	memcpy(self->buf_ + self->buflen_, p, len);
+	self->buflen_ += len;
+}
+
+static void _buf_append_codepoint(HUJSONStreamParser *self, uint32_t cp) {
+	uint8_t u[4];
+	size_t n;
+	if (cp < 0x80) {
+		u[0] = cp; n = 1;
+	} else if (cp < 0x800) {
+		u[0] = 0xC0 | (cp >> 6);
+		u[1] = 0x80 | (cp & 0x3F); n = 2;
+	} else if (cp < 0x10000) {
+		u[0] = 0xE0 | (cp >> 12);
+		u[1] = 0x80 | ((cp >> 6) & 0x3F);
+		u[2] = 0x80 | (cp & 0x3F); n = 3;
+	} else {
+		u[0] = 0xF0 | (cp >> 18);
+		u[1] = 0x80 | ((cp >> 12) & 0x3F);
+		u[2] = 0x80 | ((cp >> 6) & 0x3F);
+		u[3] = 0x80 | (cp & 0x3F); n = 4;
+	}
+	_buf_append(self, u, n);
+}
+
+// A high surrogate not followed by a low surrogate becomes U+FFFD
+static inline void _flush_surrogate(HUJSONStreamParser *self) {
+	if (self->highSurrogate_) {
+		_buf_append_codepoint(self, 0xFFFD);
+		self->highSurrogate_ = 0;
+	}
+}
+
+static inline int _hexval(uint8_t c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+static inline BOOL _isws(uint8_t c) {
+	return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static inline BOOL _isnumchar(uint8_t c) {
+	return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' ||
+	       c == 'e' || c == 'E';
+}
+
+- (void)_fail:(NSString *)reason at:(unsigned long long)offset {
+	state_ = kStateError;
+	NSString *msg = [NSString stringWithFormat:@"%@ at offset %llu", reason, offset];
+	error_ = [[NSError alloc] initWithDomain:HUJSONStreamParserErrorDomain code:1 userInfo:[NSDictionary dictionaryWithObject:msg forKey:NSLocalizedDescriptionKey]];
+}
+
+- (void)_emit:(id)value {
+	if (depth_ == 0) {
+		if (elementBlock_ && elementDepth_ == 0)
+			elementBlock_(value);
+		rootObject_ = [value retain];
+		state_ = kStateDone;
+		return;
+	}
+	_hujson_frame_t *f = &stack_[depth_-1];
+	if (elementBlock_ && depth_ == elementDepth_)
+		elementBlock_(value);
+	else if (f->isDict)
+		[f->container setObject:value forKey:f->key];
+	else
+		[f->container addObject:value];
+	if (f->isDict) {
+		[f->key release];
+		f->key = nil;
+	}
+	state_ = kStateComma;
+}
+
+- (BOOL)_push:(BOOL)isDict {
+	if (depth_ == HUJSON_MAX_DEPTH)
+		return NO;
+	if (depth_ == stackCapacity_) {
+		stackCapacity_ = stackCapacity_ ? stackCapacity_ * 2 : 16;
+		stack_ = (_hujson_frame_t *)realloc(stack_, stackCapacity_ * sizeof(_hujson_frame_t));
+	}
+	_hujson_frame_t *f = &stack_[depth_++];
+	f->isDict = isDict;
+	f->key = nil;
+	f->container = isDict ? [NSMutableDictionary new] : [NSMutableArray new];
+	state_ = isDict ? kStateKeyOrClose : kStateValueOrClose;
+	return YES;
+}
+
+- (void)_pop {
+	_hujson_frame_t *f = &stack_[--depth_];
+	id container = f->container;
+	[f->key release];
+	[self _emit:container];
+	[container release];
+}
+
+- (BOOL)_finishNumber {
+	_buf_append(self, "", 1); // nul-terminate
+	const char *s = buf_;
+	char *end = NULL;
+	NSNumber *n = nil;
+	if (strpbrk(s, ".eE") == NULL) {
+		errno = 0;
+		long long v = strtoll(s, &end, 10);
+		if (*end == '\0' && errno != ERANGE)
+			n = [[NSNumber alloc] initWithLongLong:v];
+	}
+	if (!n) {
+		double v = strtod(s, &end);
+		if (*end != '\0' || end == s)
+			return NO;
+		n = [[NSNumber alloc] initWithDouble:v];
+	}
+	buflen_ = 0;
+	[self _emit:n];
+	[n release];
+	return YES;
+}
+
+- (void)_string:(NSString *)s {
+	if (stringIsKey_) {
+		stack_[depth_-1].key = [s retain];
+		state_ = kStateColon;
+	} else {
+		[self _emit:s];
+	}
+}
+
+#pragma mark -
+#pragma mark Parsing
+
+- (BOOL)parseData:(NSData *)data {
+	return [self parseBytes:[data bytes] length:[data length]];
+}
+
+- (BOOL)parseBytes:(const void *)bytes length:(size_t)length {
+	const uint8_t *p = (const uint8_t *)bytes;
+	const uint8_t *end = p + length;
+	if (state_ == kStateError)
+		return NO;
+
+	// skip a UTF-8 BOM
+	if (offset_ == 0 && length >= 3 && p[0] == 0xEF && p[1] == 0xBB && p[2] == 0xBF)
+		p += 3;
+
+	#define FAIL(reason) do { \
+		[self _fail:(reason) at:offset_ + (p - (const uint8_t *)bytes)]; \
+		return NO; \
+	} while (0)
+
+	while (p < end) {
+		uint8_t c = *p;
+		switch (state_) {
+
+		case kStateValueOrClose:
+		case kStateValue:
+			if (_isws(c)) {
+				p++;
+			} else if (c == '{' || c == '[') {
+				if (![self _push:(c == '{')])
+					FAIL(@"Nesting too deep");
+				p++;
+			} else if (c == ']' && state_ == kStateValueOrClose) {
+				p++;
+				[self _pop];
+			} else if (c == '"') {
+				stringIsKey_ = NO;
+				state_ = kStateString;
+				p++;
+			} else if (c == '-' || (c >= '0' && c <= '9')) {
+				buflen_ = 0;
+				state_ = kStateNumber;
+			} else if (c == 't' || c == 'f' || c == 'n') {
+				literal_ = (c == 't') ? "true" : (c == 'f') ? "false" : "null";
+				literalPos_ = 0;
+				state_ = kStateLiteral;
+			} else {
+				FAIL(@"Unexpected character");
+			}
+			break;
+
+		case kStateKeyOrClose:
+		case kStateKey:
+			if (_isws(c)) {
+				p++;
+			} else if (c == '"') {
+				stringIsKey_ = YES;
+				state_ = kStateString;
+				p++;
+			} else if (c == '}' && state_ == kStateKeyOrClose) {
+				p++;
+				[self _pop];
+			} else {
+				FAIL(@"Expected key");
+			}
+			break;
+
+		case kStateColon:
+			if (_isws(c)) {
+				p++;
+			} else if (c == ':') {
+				state_ = kStateValue;
+				p++;
+			} else {
+				FAIL(@"Expected ':'");
+			}
+			break;
+
+		case kStateComma:
+			if (_isws(c)) {
+				p++;
+			} else if (c == ',') {
+				state_ = stack_[depth_-1].isDict ? kStateKey : kStateValue;
+				p++;
+			} else if (c == (stack_[depth_-1].isDict ? '}' : ']')) {
+				p++;
+				[self _pop];
+			} else {
+				FAIL(@"Expected ',' or end of container");
+			}
+			break;
+
+		case kStateString: {
+			// scan the run of plain characters
+			const uint8_t *start = p;
+			while (p < end && *p != '"' && *p != '\\' && *p >= 0x20)
+				p++;
+			if (p != start) {
+				_flush_surrogate(self);
+				if (p == end || *p != '"' || buflen_ != 0)
+					_buf_append(self, start, p - start);
+			}
+			if (p == end)
+				break;
+			if (*p == '"') {
+				_flush_surrogate(self);
+				NSString *s;
+				if (buflen_ == 0) {
+					// the complete string is in this chunk -- no copy needed
+					s = [[NSString alloc] initWithBytes:start length:p - start encoding:NSUTF8StringEncoding];
+				} else {
+					s = [[NSString alloc] initWithBytes:buf_ length:buflen_ encoding:NSUTF8StringEncoding];
+					buflen_ = 0;
+				}
+				if (!s)
+					FAIL(@"Invalid UTF-8 in string");
+				p++;
+				[self _string:s];
+				[s release];
+			} else if (*p == '\\') {
+				state_ = kStateEscape;
+				p++;
+			} else {
+				FAIL(@"Control character in string");
+			}
+			break;
+		}
+
+		case kStateEscape: {
+			char e;
+			switch (c) {
+				case '"': e = '"'; break;
+				case '\\': e = '\\'; break;
+				case '/': e = '/'; break;
+				case 'b': e = '\b'; break;
+				case 'f': e = '\f'; break;
+				case 'n': e = '\n'; break;
+				case 'r': e = '\r'; break;
+				case 't': e = '\t'; break;
+				case 'u': e = 0; break;
+				default: FAIL(@"Invalid escape sequence");
+			}
+			p++;
+			if (e) {
+				_flush_surrogate(self);
+				_buf_append(self, &e, 1);
+				state_ = kStateString;
+			} else {
+				codepoint_ = 0;
+				hexcount_ = 0;
+				state_ = kStateUnicode;
+			}
+			break;
+		}
+
+		case kStateUnicode: {
+			int v = _hexval(c);
+			if (v == -1)
+				FAIL(@"Invalid \\u escape");
+			p++;
+			codepoint_ = (codepoint_ << 4) | v;
+			if (++hexcount_ < 4)
+				break;
+			state_ = kStateString;
+			if (codepoint_ >= 0xDC00 && codepoint_ <= 0xDFFF && highSurrogate_) {
+				uint32_t cp = 0x10000 + ((highSurrogate_ - 0xD800) << 10) + (codepoint_ - 0xDC00);
+				highSurrogate_ = 0;
+				_buf_append_codepoint(self, cp);
+			} else {
+				_flush_surrogate(self);
+				if (codepoint_ >= 0xD800 && codepoint_ <= 0xDBFF)
+					highSurrogate_ = codepoint_;
+				else if (codepoint_ >= 0xDC00 && codepoint_ <= 0xDFFF)
+					_buf_append_codepoint(self, 0xFFFD);
+				else
+					_buf_append_codepoint(self, codepoint_);
+			}
+			break;
+		}
+
+		case kStateNumber: {
+			const uint8_t *start = p;
+			while (p < end && _isnumchar(*p))
+				p++;
+			_buf_append(self, start, p - start);
+			if (p != end && ![self _finishNumber])
+				FAIL(@"Invalid number");
+			break;
+		}
+
+		case kStateLiteral:
+			if (c != (uint8_t)literal_[literalPos_])
+				FAIL(@"Invalid literal");
+			p++;
+			if (literal_[++literalPos_] == '\0') {
+				id value = (literal_[0] == 't') ? (id)[NSNumber numberWithBool:YES] :
+				           (literal_[0] == 'f') ? (id)[NSNumber numberWithBool:NO] :
+				           (id)[NSNull null];
+				[self _emit:value];
+			}
+			break;
+
+		case kStateDone:
+			if (!_isws(c))
+				FAIL(@"Unexpected data after end of document");
+			p++;
+			break;
+
+		default:
+			return NO;
+		}
+	}
+
+	#undef FAIL
+
+	offset_ += length;
+	return YES;
+}
+
+- (BOOL)finish {
+	if (state_ == kStateError)
+		return NO;
+	if (state_ == kStateNumber && depth_ == 0 && ![self _finishNumber]) {
+		[self _fail:@"Invalid number" at:offset_];
+		return NO;
+	}
+	if (state_ != kStateDone) {
+		[self _fail:@"Unexpected end of input" at:offset_];
+		return NO;
+	}
+	return YES;
+}
+
+@end
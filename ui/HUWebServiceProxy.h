@@ -20,10 +20,104 @@
  */
 typedef void (^HUWebServiceProxyCallBlock)(id parsedResponseObject, NSError *error);
 
+/**
+ * Element closure, called with each element of a streamed JSON array response
+ * as soon as the element has been parsed (see call:args:elementBlock:block:).
+ */
+typedef void (^HUWebServiceProxyElementBlock)(id element);
+
+// Error domain for errors reported in a batch response (code is the JSON-RPC
+// error code, the message is available as the localized description)
+extern NSString * const HUWebServiceProxyErrorDomain;
+
 
 @interface HUWebServiceProxy : NSObject {
+	NSTimeInterval batchWindow_;
+	NSUInteger maximumBatchSize_;
+	NSMutableArray *pendingCalls_;
+	NSTimer *batchTimer_;
+	BOOL deduplicatesCalls_;
+	NSMutableDictionary *inflight_; // key => NSMutableArray of blocks
+	NSTimeInterval cacheTTL_;
+	NSUInteger cacheCapacity_;
+	NSMutableDictionary *cache_; // key => _HUWebServiceCacheEntry
+	NSMutableArray *cacheKeys_;  // least recently used first
+	id jsonWriter_;
 }
 
+#pragma mark -
+#pragma mark Batching, deduplication and caching
+
+/**
+ * Calls made within <batchWindow> seconds of each other are combined into a
+ * single JSON-RPC 2.0 batch request and the results are fanned out to each
+ * call's block. 0 (the default) disables batching.
+ *
+ * Batching requires urlForBatch: to return a URL. Only calls made with
+ * autostart are batched and for those the -call:* methods return nil.
+ */
+@property NSTimeInterval batchWindow;
+
+// A batch is sent immediately when it reaches this many calls. Defaults to 50.
+@property NSUInteger maximumBatchSize;
+
+/**
+ * When enabled, a call which is identical (same method and args) to a call
+ * still in flight does not cause another request. Instead its block is called
+ * with the result of the call already in flight, and the -call:* methods
+ * return the request already in flight (or nil if it is part of a batch).
+ * Only calls made with autostart are deduplicated. Defaults to NO.
+ *
+ * A request canceled without its delegate being told (e.g. with
+ * clearDelegatesAndCancel) is not joined -- identical calls made after that
+ * send a new request.
+ */
+@property BOOL deduplicatesCalls;
+
+/**
+ * Successful results are cached for <cacheTTL> seconds, keyed on method and
+ * args. At most <cacheCapacity> (default 128) results are kept, least recently
+ * used evicted first. 0 (the default) disables the cache.
+ *
+ * On a cache hit no request is made; the -call:* methods return nil and the
+ * block is called asynchronously on the main queue.
+ */
+@property NSTimeInterval cacheTTL;
+@property NSUInteger cacheCapacity;
+
+/**
+ * Return the key identifying a call to <method> with <args>, used for
+ * deduplication and caching.
+ *
+ * The default implementation combines <method> with the JSON representation of
+ * <args> (with sorted keys).
+ */
+- (NSString *)keyForMethod:(NSString *)method withArgs:(id)args;
+
+// Forget all cached results
+- (void)invalidateCache;
+
+// Send any pending batched calls now
+- (void)flushBatch;
+
+/**
+ * Return the URL to which a batch of <calls> should be sent. <calls> is an
+ * array of JSON-RPC 2.0 request objects ("jsonrpc", "method", "params", "id").
+ *
+ * The default implementation returns nil, which causes the calls to be sent
+ * as individual requests.
+ */
+- (NSURL *)urlForBatch:(NSArray *)calls;
+
+/**
+ * Called before a batch request will be sent. Returning a false value aborts
+ * the batch, failing all of its calls.
+ *
+ * The default implementation sets r.postBody to the JSON representation of
+ * <calls>.
+ */
+- (BOOL)willSendBatchRequest:(ASIHTTPRequest *)r withCalls:(NSArray *)calls;
+
 #pragma mark -
 #pragma mark Preparing requests
 
@@ -90,22 +184,30 @@ typedef void (^HUWebServiceProxyCallBlock)(id parsedResponseObject, NSError *err
  * the response closure, if any.
  *
  * The default implementation tries to parse the object based on content type.
+ * Successful "application/json" responses are parsed incrementally as their
+ * data arrives (see request:didReceiveData:), in which case this only
+ * completes the parse. Other responses are buffered in r.rawResponseData.
  */
 - (NSObject *)parsedObjectFromResponse:(ASIHTTPRequest *)r withContentType:(NSString *)ct;
 
 /**
  * Called when a request has successfully finished.
  *
- * The default implementation calls closure(msg, nil) and releases the closure
- * after it returns.
+ * The default implementation calls closure(msg, nil) for every closure waiting
+ * on the call (several when calls are deduplicated). For a batch request, each
+ * result in <msg> is passed to the closures of the call with the matching id.
+ * Closures are owned by the request's call entry and released with it, so
+ * overrides must not release them.
  */
 - (void)requestFinished:(ASIHTTPRequest *)request withParsedObject:(NSObject *)msg;
 
 /**
  * Called when a request has failed.
  *
- * The default implementation calls closure(r, r.error) and releases the closure
- * after it returns.
+ * The default implementation calls closure(r, r.error) for every closure
+ * waiting on the call, or on each call of a batch. Closures are owned by the
+ * request's call entry and released with it, so overrides must not release
+ * them.
  */
 - (void)requestFailed:(ASIHTTPRequest *)r;
 
@@ -158,9 +260,26 @@ typedef void (^HUWebServiceProxyCallBlock)(id parsedResponseObject, NSError *err
 							autostart:(BOOL)autostart
 								  block:(HUWebServiceProxyCallBlock)b;
 
+/**
+ * Call a remote method which responds with a (possibly very large) JSON array
+ * and dispatch the call immediately.
+ *
+ * Each element of the array is passed to <eb> as soon as it has been parsed
+ * and is not kept around, so the complete array never needs to be held in
+ * memory. <b> is called when the call completes, with an empty array as the
+ * parsed object. Such calls are never batched, deduplicated or cached.
+ */
+-(ASIHTTPRequest *)call:(NSString *)method
+                   args:(id)args
+           elementBlock:(HUWebServiceProxyElementBlock)eb
+                  block:(HUWebServiceProxyCallBlock)b;
+
 #pragma mark -
 #pragma mark Base
 
 - (void)requestFinished:(ASIHTTPRequest *)request;
 
+// Feeds successful JSON responses to an incremental parser as data arrives
+- (void)request:(ASIHTTPRequest *)r didReceiveData:(NSData *)data;
+
 @end
@@ -1,8 +1,58 @@
 #import "HUWebServiceProxy.h"
+#import "HUJSONStreamParser.h"
 #import "JSON.h"
 
+NSString * const HUWebServiceProxyErrorDomain = @"HUWebServiceProxyErrorDomain";
+
+@interface _HUWebServiceCacheEntry : NSObject {
+@public
+	id object;
+	CFAbsoluteTime expires;
+}
+@end
+@implementation _HUWebServiceCacheEntry
+- (void)dealloc {
+	[object release];
+	[super dealloc];
+}
+@end
+
+@interface HUWebServiceProxy (Private)
+- (ASIHTTPRequest *)_sendCall:(NSMutableDictionary *)call autostart:(BOOL)start;
+- (void)_removeInflightCall:(NSMutableDictionary *)call;
+- (void)_pruneInflightCalls;
+- (void)_completeCall:(NSMutableDictionary *)call withObject:(id)obj error:(NSError *)err;
+- (void)_failCall:(NSMutableDictionary *)call withMessage:(NSString *)message;
+- (NSString *)_contentTypeOfResponse:(ASIHTTPRequest *)r;
+- (ASIHTTPRequest *)_call:(NSString *)method args:(id)args autostart:(BOOL)start elementBlock:(HUWebServiceProxyElementBlock)eb block:(HUWebServiceProxyCallBlock)cl;
+@end
+
 @implementation HUWebServiceProxy
 
+@synthesize batchWindow = batchWindow_,
+            maximumBatchSize = maximumBatchSize_,
+            deduplicatesCalls = deduplicatesCalls_,
+            cacheTTL = cacheTTL_,
+            cacheCapacity = cacheCapacity_;
+
+- (id)init {
+	if ((self = [super init])) {
+		maximumBatchSize_ = 50;
+		cacheCapacity_ = 128;
+	}
+	return self;
+}
+
+- (void)dealloc {
+	[batchTimer_ invalidate];
+	[pendingCalls_ release];
+	[inflight_ release];
+	[cache_ release];
+	[cacheKeys_ release];
+	[jsonWriter_ release];
+	[super dealloc];
+}
+
 #pragma mark -
 #pragma mark Preparing requests
 
@@ -17,6 +67,225 @@
 	return YES;
 }
 
+- (NSURL *)urlForBatch:(NSArray *)calls {
+	return nil;
+}
+
+- (BOOL)willSendBatchRequest:(ASIHTTPRequest *)r withCalls:(NSArray *)calls {
+	r.postBody = [[[[calls JSONRepresentation] dataUsingEncoding:NSUTF8StringEncoding] mutableCopy] autorelease];
+	[r addRequestHeader:@"Content-Type" value:@"application/json"];
+	return YES;
+}
+
+#pragma mark -
+#pragma mark Batching, deduplication and caching
+
+- (NSString *)keyForMethod:(NSString *)method withArgs:(id)args {
+	if (!args)
+		return method;
+	if (!jsonWriter_) {
+		jsonWriter_ = [SBJsonWriter new];
+		[jsonWriter_ setSortKeys:YES];
+	}
+	NSString *json = [jsonWriter_ stringWithObject:args];
+	return json ? [NSString stringWithFormat:@"%@\n%@", method, json] : nil;
+}
+
+- (id)_cachedObjectForKey:(NSString *)key {
+	_HUWebServiceCacheEntry *entry = [cache_ objectForKey:key];
+	if (!entry)
+		return nil;
+	[[key retain] autorelease];
+	[cacheKeys_ removeObject:key];
+	if (entry->expires < CFAbsoluteTimeGetCurrent()) {
+		[cache_ removeObjectForKey:key];
+		return nil;
+	}
+	[cacheKeys_ addObject:key]; // most recently used
+	return [[entry->object retain] autorelease];
+}
+
+- (void)_cacheObject:(id)obj forKey:(NSString *)key {
+	if (cacheTTL_ <= 0.0 || cacheCapacity_ == 0 || !obj || !key)
+		return;
+	if (!cache_) {
+		cache_ = [NSMutableDictionary new];
+		cacheKeys_ = [NSMutableArray new];
+	}
+	_HUWebServiceCacheEntry *entry = [_HUWebServiceCacheEntry new];
+	entry->object = [obj retain];
+	entry->expires = CFAbsoluteTimeGetCurrent() + cacheTTL_;
+	if ([cache_ objectForKey:key])
+		[cacheKeys_ removeObject:key];
+	[cache_ setObject:entry forKey:key];
+	[cacheKeys_ addObject:key];
+	[entry release];
+	// evict least recently used
+	while ([cacheKeys_ count] > cacheCapacity_) {
+		[cache_ removeObjectForKey:[cacheKeys_ objectAtIndex:0]];
+		[cacheKeys_ removeObjectAtIndex:0];
+	}
+}
+
+- (void)invalidateCache {
+	[cache_ removeAllObjects];
+	[cacheKeys_ removeAllObjects];
+}
+
+- (void)_batchTimerFired:(NSTimer *)timer {
+	batchTimer_ = nil;
+	[self flushBatch];
+}
+
+- (void)flushBatch {
+	if (batchTimer_) {
+		[batchTimer_ invalidate];
+		batchTimer_ = nil;
+	}
+	if (![pendingCalls_ count])
+		return;
+	NSArray *calls = [pendingCalls_ autorelease];
+	pendingCalls_ = nil;
+	
+	// build JSON-RPC 2.0 request objects, using the index in the batch as id
+	NSMutableArray *rpcCalls = [NSMutableArray arrayWithCapacity:[calls count]];
+	NSUInteger i = 0;
+	for (NSMutableDictionary *call in calls) {
+		NSMutableDictionary *rpc = [NSMutableDictionary dictionaryWithObjectsAndKeys:
+				@"2.0", @"jsonrpc",
+				[call objectForKey:@"method"], @"method",
+				[NSNumber numberWithUnsignedInteger:i++], @"id", nil];
+		id args = [call objectForKey:@"args"];
+		if (args)
+			[rpc setObject:args forKey:@"params"];
+		[rpcCalls addObject:rpc];
+	}
+	
+	NSURL *url = ([calls count] > 1) ? [self urlForBatch:rpcCalls] : nil;
+	if (!url) {
+		// send as individual requests
+		for (NSMutableDictionary *call in calls) {
+			if (![self _sendCall:call autostart:YES])
+				[self _failCall:call withMessage:@"Request aborted"];
+		}
+		return;
+	}
+	
+	ASIHTTPRequest *r = [ASIHTTPRequest requestWithURL:url];
+	[r setDelegate:self];
+	r.userInfo = [NSMutableDictionary dictionaryWithObject:calls forKey:@"batch"];
+	if (![self willSendBatchRequest:r withCalls:rpcCalls]) {
+		for (NSMutableDictionary *call in calls)
+			[self _failCall:call withMessage:@"Request aborted"];
+		return;
+	}
+	// lets identical calls notice if the batch is canceled (see _call:...)
+	for (NSMutableDictionary *call in calls) {
+		if ([call objectForKey:@"key"])
+			[call setObject:r forKey:@"request"];
+	}
+	[r startAsynchronous];
+}
+
+- (ASIHTTPRequest *)_sendCall:(NSMutableDictionary *)call autostart:(BOOL)start {
+	NSString *method = [call objectForKey:@"method"];
+	id args = [call objectForKey:@"args"];
+	NSURL *url = [self urlForMethod:method withArgs:args];
+	ASIHTTPRequest *r = [ASIHTTPRequest requestWithURL:url];
+	[r setDelegate:self];
+	
+	NSMutableDictionary *info = [NSMutableDictionary dictionaryWithObjectsAndKeys:
+			method, @"method", call, @"call", nil];
+	if (args)
+		[info setObject:args forKey:@"args"];
+	HUWebServiceProxyCallBlock cl = [[call objectForKey:@"blocks"] lastObject];
+	if (cl)
+		[info setObject:cl forKey:@"block"];
+	r.userInfo = info;
+	
+	if (![self willSendRequest:r toMethod:method withArgs:args])
+		return nil; // aborted
+	
+	NSString *key = [call objectForKey:@"key"];
+	if (start && key && deduplicatesCalls_) {
+		// retained (and r.userInfo retains call) until the call completes or an
+		// identical call finds r canceled
+		[call setObject:r forKey:@"request"];
+		if (!inflight_)
+			inflight_ = [NSMutableDictionary new];
+		else
+			[self _pruneInflightCalls];
+		[inflight_ setObject:call forKey:key];
+	}
+	if (start)
+		[r startAsynchronous];
+	return r;
+}
+
+- (void)_removeInflightCall:(NSMutableDictionary *)call {
+	NSString *key = [call objectForKey:@"key"];
+	if (key && [inflight_ objectForKey:key] == call)
+		[inflight_ removeObjectForKey:key];
+	[call removeObjectForKey:@"request"];
+}
+
+// Drop calls whose request was canceled without telling us, which would
+// otherwise be kept (along with their request) forever
+- (void)_pruneInflightCalls {
+	for (NSMutableDictionary *call in [inflight_ allValues]) {
+		ASIHTTPRequest *r = [call objectForKey:@"request"];
+		if (r && ([r isCancelled] || [r isFinished]))
+			[self _removeInflightCall:call];
+	}
+}
+
+- (void)_completeCall:(NSMutableDictionary *)call withObject:(id)obj error:(NSError *)err {
+	[call retain];
+	[self _removeInflightCall:call];
+	NSString *key = [call objectForKey:@"key"];
+	if (key && !err)
+		[self _cacheObject:obj forKey:key];
+	for (HUWebServiceProxyCallBlock block in [call objectForKey:@"blocks"])
+		block(obj, err);
+	[call release];
+}
+
+- (void)_failCall:(NSMutableDictionary *)call withMessage:(NSString *)message {
+	NSError *err = [NSError errorWithDomain:HUWebServiceProxyErrorDomain code:0 userInfo:[NSDictionary dictionaryWithObject:message forKey:NSLocalizedDescriptionKey]];
+	[self _completeCall:call withObject:nil error:err];
+}
+
+- (void)_fanOutBatch:(NSArray *)calls response:(NSObject *)obj {
+	NSMutableIndexSet *completed = [NSMutableIndexSet indexSet];
+	if ([obj isKindOfClass:[NSArray class]]) {
+		for (NSDictionary *rpc in (NSArray *)obj) {
+			if (![rpc isKindOfClass:[NSDictionary class]])
+				continue;
+			id ident = [rpc objectForKey:@"id"];
+			if (![ident isKindOfClass:[NSNumber class]])
+				continue;
+			NSUInteger i = [ident unsignedIntegerValue];
+			if (i >= [calls count] || [completed containsIndex:i])
+				continue;
+			[completed addIndex:i];
+			NSDictionary *error = [rpc objectForKey:@"error"];
+			if ([error isKindOfClass:[NSDictionary class]]) {
+				NSString *message = [error objectForKey:@"message"];
+				NSError *err = [NSError errorWithDomain:HUWebServiceProxyErrorDomain code:[[error objectForKey:@"code"] integerValue] userInfo:message ? [NSDictionary dictionaryWithObject:message forKey:NSLocalizedDescriptionKey] : nil];
+				[self _completeCall:[calls objectAtIndex:i] withObject:error error:err];
+			}
+			else {
+				[self _completeCall:[calls objectAtIndex:i] withObject:[rpc objectForKey:@"result"] error:nil];
+			}
+		}
+	}
+	NSUInteger i, count = [calls count];
+	for (i = 0; i < count; i++) {
+		if (![completed containsIndex:i])
+			[self _failCall:[calls objectAtIndex:i] withMessage:@"Missing result in batch response"];
+	}
+}
+
 #pragma mark -
 #pragma mark Handling responses
 
@@ -30,24 +299,36 @@
 
 - (NSObject *)parsedObjectFromResponse:(ASIHTTPRequest *)r withContentType:(NSString *)type {
 	if ([type isEqualToString:@"application/json"]) {
+		HUJSONStreamParser *parser = [r.userInfo objectForKey:@"parser"];
+		if ([parser isKindOfClass:[HUJSONStreamParser class]]) {
+			if ([parser finish])
+				return parser.rootObject;
+			NSLog(@"%@: failed to parse JSON response: %@", self, parser.error);
+			return nil;
+		}
 		return [[r responseString] JSONValue];
 	}
 	return nil;
 }
 
 - (void)requestFinished:(ASIHTTPRequest *)r withParsedObject:(NSObject *)obj {
-	HUWebServiceProxyCallBlock block;
-	if (r.userInfo && (block = [r.userInfo objectForKey:@"block"])) {
-		block(obj, nil);
-		[block release];
-	}
+	NSArray *batch;
+	NSMutableDictionary *call;
+	if ((batch = [r.userInfo objectForKey:@"batch"]))
+		[self _fanOutBatch:batch response:obj];
+	else if ((call = [r.userInfo objectForKey:@"call"]))
+		[self _completeCall:call withObject:obj error:nil];
 }
 
 - (void)requestFailed:(ASIHTTPRequest *)r {
-	HUWebServiceProxyCallBlock block;
-	if (r.userInfo && (block = [r.userInfo objectForKey:@"block"])) {
-		block(r, r.error);
-		[block release];
+	NSArray *batch;
+	NSMutableDictionary *call;
+	if ((batch = [r.userInfo objectForKey:@"batch"])) {
+		for (call in batch)
+			[self _completeCall:call withObject:r error:r.error];
+	}
+	else if ((call = [r.userInfo objectForKey:@"call"])) {
+		[self _completeCall:call withObject:r error:r.error];
 	}
 }
 
@@ -56,6 +337,52 @@
 #pragma mark -
 #pragma mark Base
 
+- (NSString *)_contentTypeOfResponse:(ASIHTTPRequest *)r {
+	NSString *contentType;
+	// todo: case-insensitive search for "content-type"
+	if (!(contentType = [r.responseHeaders objectForKey:@"Content-Type"]))
+		contentType = [r.responseHeaders objectForKey:@"Content-type"];
+	if (contentType) {
+		NSRange range = [contentType rangeOfString:@";"];
+		if (range.location != NSNotFound) {
+			contentType = [[contentType substringToIndex:range.location] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+		}
+	}
+	return contentType;
+}
+
+
+- (void)request:(ASIHTTPRequest *)r didReceiveData:(NSData *)data {
+	// Since we implement this method, ASIHTTPRequest leaves the response data to
+	// us. Successful JSON responses are parsed as they arrive -- anything else
+	// (including compressed responses) is buffered like ASIHTTPRequest would.
+	id parser = [r.userInfo objectForKey:@"parser"];
+	if (!parser) {
+		parser = [NSNull null];
+		if (r.responseStatusCode >= 200 && r.responseStatusCode < 300 &&
+				![r isResponseCompressed] &&
+				[[self _contentTypeOfResponse:r] isEqualToString:@"application/json"]) {
+			HUJSONStreamParser *p = [[[HUJSONStreamParser alloc] init] autorelease];
+			p.elementBlock = [[r.userInfo objectForKey:@"call"] objectForKey:@"elementBlock"];
+			parser = p;
+		}
+		// userInfo might be immutable (e.g. set by a subclass), so store a copy
+		NSMutableDictionary *info = r.userInfo ? [[r.userInfo mutableCopy] autorelease] : [NSMutableDictionary dictionary];
+		[info setObject:parser forKey:@"parser"];
+		r.userInfo = info;
+	}
+	if (parser == [NSNull null]) {
+		if (!r.rawResponseData)
+			r.rawResponseData = [NSMutableData data];
+		[r.rawResponseData appendData:data];
+	}
+	else {
+		// errors are reported when the parse is completed
+		[(HUJSONStreamParser *)parser parseData:data];
+	}
+}
+
+
 - (void)requestFinished:(ASIHTTPRequest *)r {
 	NSString *contentType = nil;
 	NSObject *parsedObject = nil;
@@ -66,20 +393,10 @@
 		return;
 	}
 	
-	// todo: case-insensitive search for "content-type"
-	if (!(contentType = [r.responseHeaders objectForKey:@"Content-Type"]))
-		contentType = [r.responseHeaders objectForKey:@"Content-type"];
-	
 	// parse response object if possible
-	if (r.contentLength) {
-		if (contentType) {
-			NSRange range = [contentType rangeOfString:@";"];
-			if (range.location != NSNotFound) {
-				contentType = [[contentType substringToIndex:range.location] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
-			}
-		}
+	contentType = [self _contentTypeOfResponse:r];
+	if (r.contentLength || [[r.userInfo objectForKey:@"parser"] isKindOfClass:[HUJSONStreamParser class]])
 		parsedObject = [self parsedObjectFromResponse:r withContentType:contentType];
-	}
 	
 	// xxx debug logging:
 	#if DEBUG
@@ -127,41 +444,85 @@
 }
 
 
+- (ASIHTTPRequest *)call:(NSString *)method args:(id)args elementBlock:(HUWebServiceProxyElementBlock)eb block:(HUWebServiceProxyCallBlock)b {
+	return [self _call:method args:args autostart:YES elementBlock:eb block:b];
+}
+
+
 - (ASIHTTPRequest *)call:(NSString *)method args:(id)args autostart:(BOOL)start block:(HUWebServiceProxyCallBlock)cl
 {
-	NSURL *url = [self urlForMethod:method withArgs:args];
-	ASIHTTPRequest *r = [ASIHTTPRequest requestWithURL:url];
-	[r setDelegate:self];
-	
+	return [self _call:method args:args autostart:start elementBlock:nil block:cl];
+}
+
+
+- (ASIHTTPRequest *)_call:(NSString *)method args:(id)args autostart:(BOOL)start elementBlock:(HUWebServiceProxyElementBlock)eb block:(HUWebServiceProxyCallBlock)cl
+{
 	if (cl)
-		cl = [cl copy]; // todo: check if it's already copied?
+		cl = [[cl copy] autorelease];
 	
-	if (args && cl) {
-		r.userInfo = [NSDictionary dictionaryWithObjectsAndKeys:
-									method, @"method", args, @"args", cl, @"block", nil];
-	}
-	else if (args) {
-		r.userInfo = [NSDictionary dictionaryWithObjectsAndKeys:
-									method, @"method", args, @"args", nil];
-	}
-	else if (cl) {
-		r.userInfo = [NSDictionary dictionaryWithObjectsAndKeys:
-									method, @"method", cl, @"block", nil];
-	}
-	else {
-		r.userInfo = [NSDictionary dictionaryWithObject:method forKey:@"method"];
+	NSString *key = nil;
+	if (start && !eb && (deduplicatesCalls_ || cacheTTL_ > 0.0))
+		key = [self keyForMethod:method withArgs:args];
+	
+	if (key && cacheTTL_ > 0.0) {
+		id obj = [self _cachedObjectForKey:key];
+		if (obj) {
+			if (cl) {
+				dispatch_async(dispatch_get_main_queue(), ^{
+					cl(obj, nil);
+				});
+			}
+			return nil;
+		}
 	}
 	
-	if ([self willSendRequest:r toMethod:method withArgs:args]) {
-		if (start)
-			[r startAsynchronous];
-		return r;
+	if (key && deduplicatesCalls_) {
+		NSMutableDictionary *call = [inflight_ objectForKey:key];
+		ASIHTTPRequest *r = [call objectForKey:@"request"];
+		if (r && ([r isCancelled] || [r isFinished])) {
+			// canceled without telling us (e.g. clearDelegatesAndCancel) -- the
+			// call will never complete, so don't join it
+			[self _removeInflightCall:call];
+			call = nil;
+		}
+		if (call) {
+			if (cl)
+				[[call objectForKey:@"blocks"] addObject:cl];
+			// nil for calls which are part of a batch
+			return [r.userInfo objectForKey:@"batch"] ? nil : r;
+		}
 	}
-	// else aborted
 	
+	NSMutableDictionary *call = [NSMutableDictionary dictionaryWithObjectsAndKeys:
+			method, @"method", [NSMutableArray array], @"blocks", nil];
+	if (args)
+		[call setObject:args forKey:@"args"];
+	if (key)
+		[call setObject:key forKey:@"key"];
 	if (cl)
-		[cl release];
-	return nil;
+		[[call objectForKey:@"blocks"] addObject:cl];
+	if (eb)
+		[call setObject:[[eb copy] autorelease] forKey:@"elementBlock"];
+	
+	if (start && !eb && batchWindow_ > 0.0) {
+		if (!pendingCalls_)
+			pendingCalls_ = [NSMutableArray new];
+		[pendingCalls_ addObject:call];
+		if (key && deduplicatesCalls_) {
+			if (!inflight_)
+				inflight_ = [NSMutableDictionary new];
+			[inflight_ setObject:call forKey:key];
+		}
+		if ([pendingCalls_ count] >= maximumBatchSize_) {
+			[self flushBatch];
+		}
+		else if (!batchTimer_) {
+			batchTimer_ = [NSTimer scheduledTimerWithTimeInterval:batchWindow_ target:self selector:@selector(_batchTimerFired:) userInfo:nil repeats:NO];
+		}
+		return nil;
+	}
+	
+	return [self _sendCall:call autostart:start];
 }
 
 @end